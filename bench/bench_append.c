@@ -0,0 +1,64 @@
+//Import-like append benchmark: one file is written block_size bytes at a time,
+//the same way fill_jfs_image does it. Time per MiB should stay flat as the file grows.
+//Build: cc -O2 -pthread -I. bench/bench_append.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_append
+//Usage: bench_append [max_mib] [block_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_log.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t max_mib = argc > 1 ? atoi(argv[1]) : 1024;
+    uint32_t block_size = argc > 2 ? atoi(argv[2]) : 256;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    fprintf(stderr, "%10s %12s %12s %10s\n", "file_mib", "seconds", "ns_per_mib", "mib_per_s");
+    for (uint32_t mib = 1; mib <= max_mib; mib *= 2)
+    {
+        uint64_t file_size = (uint64_t)mib << 20;
+        uint32_t blocks = file_size / block_size + 16;
+        uint32_t system_size = jfs_system_size(blocks);
+        uint8_t *image = calloc(1, system_size + (uint64_t)blocks * block_size);
+        uint8_t *chunk = malloc(block_size);
+        if (NULL == image || NULL == chunk)
+        {
+            fprintf(stderr, "Can't alloc %u MiB image!\n", mib);
+            return 1;
+        }
+        memset(chunk, 'j', block_size);
+
+        struct JSuper *sb = (struct JSuper *)image;
+        jfs_format(sb, block_size, blocks);
+        struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, "big", 0);
+
+        double start = now_sec();
+        for (uint64_t written = 0; written < file_size; written += block_size)
+        {
+            if (0 > jfs_write_file(file, sb, written, chunk, block_size))
+            {
+                fprintf(stderr, "Write failed at %llu!\n", (unsigned long long)written);
+                return 1;
+            }
+        }
+        double spent = now_sec() - start;
+
+        fprintf(stderr, "%10u %12.4f %12.0f %10.1f\n", mib, spent, spent * 1e9 / mib, mib / spent);
+        free(chunk);
+        free(image);
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+//Parallel image build: scan + read of a synthetic source tree with 1..16 workers.
+//Build: cc -O2 -pthread -I. bench/bench_build.c gen_jfs_tree.c gen_jfs_image.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_build
+//Usage: bench_build [dirs] [files_per_dir] [file_size] [block_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "jfs.h"
+#include "jfs_log.h"
+#include "gen_jfs_image.h"
+#include "gen_jfs_tree.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int make_tree(char *root, uint32_t dirs, uint32_t files, uint32_t file_size)
+{
+    char path[256];
+    uint8_t *buf = malloc(file_size + 1);
+    if (NULL == buf)
+        return -1;
+
+    mkdir(root, 0755);
+    for (uint32_t dd = 0; dd < dirs; dd++)
+    {
+        snprintf(path, sizeof(path), "%s/d%03u", root, dd);
+        mkdir(path, 0755);
+        for (uint32_t ff = 0; ff < files; ff++)
+        {
+            snprintf(path, sizeof(path), "%s/d%03u/f%04u", root, dd, ff);
+            uint32_t size = file_size / 2 + (dd * 7919 + ff * 104729) % (file_size + 1);
+            memset(buf, 'a' + (dd + ff) % 26, file_size + 1);
+            FILE *out = fopen(path, "wb");
+            if (NULL == out || fwrite(buf, 1, size > file_size ? file_size : size, out) == 0)
+            {
+                free(buf);
+                return -1;
+            }
+            fclose(out);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+static int same_files(char *a, char *b)
+{
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int ca, cb, same = (NULL != fa && NULL != fb);
+
+    while (same)
+    {
+        ca = fgetc(fa);
+        cb = fgetc(fb);
+        if (ca != cb)
+            same = 0;
+        if (EOF == ca)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t dirs = argc > 1 ? atoi(argv[1]) : 64;
+    uint32_t files = argc > 2 ? atoi(argv[2]) : 64;
+    uint32_t file_size = argc > 3 ? atoi(argv[3]) : 16384;
+    uint32_t block_size = argc > 4 ? atoi(argv[4]) : 4096;
+    uint32_t threads[] = {1, 2, 4, 8, 16};
+    char src[64];
+    char ref[] = "/tmp/jfs_bench_1.img";
+    char img[64];
+
+    uint64_t total = (uint64_t)dirs * files;
+
+    //One source tree per shape, so reruns with other arguments don't mix trees
+    snprintf(src, sizeof(src), "/tmp/jfs_bench_src_%u_%u_%u", dirs, files, file_size);
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    if (0 != make_tree(src, dirs, files, file_size))
+    {
+        fprintf(stderr, "Can't create source tree in %s!\n", src);
+        return 1;
+    }
+
+    fprintf(stderr, "%u dirs x %u files, <= %u bytes each, bs %u, %ld cpus\n",
+            dirs, files, file_size, block_size, sysconf(_SC_NPROCESSORS_ONLN));
+    for (uint32_t ii = 0; ii < sizeof(threads) / sizeof(threads[0]); ii++)
+    {
+        snprintf(img, sizeof(img), "/tmp/jfs_bench_%u.img", threads[ii]);
+        double start = now_sec();
+        if (0 != create_jfs_image_parallel(img, src, block_size, 0, threads[ii]))
+        {
+            fprintf(stderr, "Build with %u threads failed!\n", threads[ii]);
+            return 1;
+        }
+        double sec = now_sec() - start;
+
+        struct stat st;
+        stat(img, &st);
+        fprintf(stderr, "threads %2u: %8.3f s %10.0f files/s %8.1f MB/s image %s\n",
+                threads[ii], sec, total / sec, st.st_size / sec / 1e6,
+                ii == 0 ? "ref" : (same_files(ref, img) ? "identical" : "DIFFERS"));
+    }
+
+    return 0;
+}
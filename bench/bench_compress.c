@@ -0,0 +1,184 @@
+//Plain files vs files compressed in clusters of several sizes
+//(JFS_FLAG_COMPRESS). Files are text-like: words drawn from a small
+//vocabulary. Each image is read through an mmap and a pread mount, whole
+//files in read_size pieces and read_size pieces at random offsets. Output:
+//used blocks, ratio to the plain image, sequential MB/s and random reads/s.
+//Build: cc -O2 -pthread -I. bench/bench_compress.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_compress
+//Usage: bench_compress [files] [file_kib] [read_size] [block_size] [reads] [image]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+static const char *words[] = {"block", "chain", "inode", "image", "journal", "super", "the", "of", "a", "file",
+                              "mount", "read", "write", "cluster", "data", "free", "dir", "entry", "size", "name"};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_text(uint8_t *data, uint32_t size, uint64_t seed)
+{
+    uint32_t pos = 0;
+
+    while (pos < size)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        const char *word = words[(seed >> 33) % (sizeof(words) / sizeof(words[0]))];
+        for (uint32_t ii = 0; '\0' != word[ii] && pos < size; ii++)
+            data[pos++] = word[ii];
+        if (pos < size)
+            data[pos++] = (seed >> 40) % 8 ? ' ' : '\n';
+    }
+}
+
+///cluster 0 - plain image
+static int32_t make_image(const char *path, uint32_t cluster, uint32_t files, uint32_t file_size, uint32_t block_size,
+                          uint32_t *used)
+{
+    uint32_t flags = JFS_FLAG_ITABLE | (cluster ? JFS_FLAG_COMPRESS : 0);
+    uint32_t blocks = files * ((file_size + block_size - 1) / block_size) + files / (block_size / jfs_dir_entry_size(flags)) + 16;
+    uint64_t size = jfs_system_size_opts(blocks, files + 1, flags) + (uint64_t)blocks * block_size;
+    uint8_t *image = calloc(1, size);
+    uint8_t *data = malloc(file_size);
+    char name[32];
+    int32_t ret = NULL != image && NULL != data ? 0 : -1;
+
+    if (0 == ret)
+    {
+        struct JSuper *sb = (struct JSuper *)image;
+        jfs_format_opts(sb, block_size, blocks, files + 1, flags);
+        for (uint32_t ii = 0; 0 == ret && ii < files; ii++)
+        {
+            snprintf(name, sizeof(name), "f%u", ii);
+            struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, name, 0);
+            fill_text(data, file_size, ii + 1);
+            ret = NULL != file ? jfs_write_file(file, sb, 0, data, file_size) : -1;
+            if (0 == ret && cluster)
+                ret = jfs_compress_file(file, sb, cluster);
+        }
+        *used = blocks - jfs_free_blocks(sb);
+    }
+
+    FILE *out = 0 == ret ? fopen(path, "wb") : NULL;
+    if (0 == ret)
+        ret = NULL != out && fwrite(image, 1, size, out) == size ? 0 : -1;
+    if (NULL != out && 0 != fclose(out))
+        ret = -1;
+
+    free(data);
+    free(image);
+    return ret;
+}
+
+static int32_t pass(const char *path, uint32_t flags, uint32_t files, uint32_t read_size, uint32_t reads,
+                    double *seq_mbs, double *rand_rps, uint64_t *sum)
+{
+    uint8_t *buf = malloc(read_size);
+    uint64_t bytes = 0, check = 0, seed = 42;
+    char name[32];
+
+    struct JSuper *sb = jfs_mount(path, flags);
+    if (NULL == sb || NULL == buf)
+    {
+        if (NULL != sb)
+            jfs_umount(sb);
+        free(buf);
+        return -1;
+    }
+
+    double start = now_sec();
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%u", ii);
+        struct JFile *file = jfs_lookup(jfs_get_root_dir(sb), sb, name);
+        uint32_t got = 0;
+
+        for (uint32_t pos = 0; NULL != file && pos < file->size; pos += got)
+        {
+            if (0 != jfs_read_file(file, sb, pos, buf, read_size, &got) || 0 == got)
+                break;
+            for (uint32_t jj = 0; jj < got; jj++)
+                check = check * 131 + buf[jj];
+            bytes += got;
+        }
+    }
+    *seq_mbs = bytes / (now_sec() - start) / 1e6;
+
+    start = now_sec();
+    for (uint32_t ii = 0; ii < reads; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        snprintf(name, sizeof(name), "f%u", (uint32_t)(seed >> 33) % files);
+        struct JFile *file = jfs_lookup(jfs_get_root_dir(sb), sb, name);
+        uint32_t got = 0;
+
+        if (NULL != file && file->size > read_size)
+            jfs_read_file(file, sb, (seed >> 13) % (file->size - read_size), buf, read_size, &got);
+        check += got ? buf[got - 1] : 0;
+    }
+    *rand_rps = reads / (now_sec() - start);
+
+    jfs_umount(sb);
+    free(buf);
+    if (0 != *sum && check != *sum)
+    {
+        fprintf(stderr, "%s read other data than the plain image!\n", path);
+        return -1;
+    }
+    *sum = check;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 64;
+    uint32_t file_size = (argc > 2 ? atoi(argv[2]) : 1024) << 10;
+    uint32_t read_size = argc > 3 ? atoi(argv[3]) : 4096;
+    uint32_t block_size = argc > 4 ? atoi(argv[4]) : 4096;
+    uint32_t reads = argc > 5 ? atoi(argv[5]) : 20000;
+    const char *path = argc > 6 ? argv[6] : "/tmp/bench_compress.img";
+    uint32_t clusters[] = {0, block_size, 4 * block_size, JFS_CLUSTER_SIZE, 128u << 10};
+    uint64_t sums[2] = {0, 0};
+    uint32_t plain_used = 0;
+    int32_t ret = 0;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    printf("%u files of %u KiB, block %u, reads of %u bytes\n", files, file_size >> 10, block_size, read_size);
+    printf("%-8s %10s %6s %12s %12s %12s %12s\n", "cluster", "used", "ratio", "mmap_MB/s", "mmap_rd/s", "pread_MB/s", "pread_rd/s");
+    for (uint32_t ii = 0; 0 == ret && ii < sizeof(clusters) / sizeof(clusters[0]); ii++)
+    {
+        uint32_t used = 0;
+        double seq[2], rnd[2];
+
+        if (ii > 1 && clusters[ii] % block_size)
+            continue;
+        if (0 != make_image(path, clusters[ii], files, file_size, block_size, &used))
+        {
+            fprintf(stderr, "Can't make image %s!\n", path);
+            ret = -1;
+            break;
+        }
+        if (0 == clusters[ii])
+            plain_used = used;
+        ret |= pass(path, JFS_MOUNT_RDONLY, files, read_size, reads, &seq[0], &rnd[0], &sums[0]);
+        ret |= pass(path, JFS_MOUNT_PREAD, files, read_size, reads, &seq[1], &rnd[1], &sums[1]);
+
+        char label[16];
+        snprintf(label, sizeof(label), "%u", clusters[ii]);
+        printf("%-8s %10u %6.3f %12.1f %12.0f %12.1f %12.0f\n", clusters[ii] ? label : "plain", used,
+               (double)used / plain_used, seq[0], rnd[0], seq[1], rnd[1]);
+    }
+
+    remove(path);
+    return 0 != ret;
+}
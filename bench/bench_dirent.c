@@ -0,0 +1,100 @@
+//Directory formats side by side: classic JFile entries, inode table with
+//JDirent, inode table with compact entries. One directory of short names
+//("e123"), no side tables attached, so lookups scan the entry blocks.
+//Output: per format entries per block, dir blocks, lookup scan and listing
+//rates, and the time to remove every entry from the front.
+//Build: cc -O2 -pthread -I. bench/bench_dirent.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_dirent
+//Usage: bench_dirent [entries] [block_size] [lookups]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *format, uint32_t inodes, uint32_t flags, uint32_t entries, uint32_t block_size, uint32_t lookups)
+{
+    uint32_t fit = block_size / jfs_dir_entry_size(inodes ? JFS_FLAG_ITABLE | flags : 0);
+    uint32_t blocks = entries / fit + 16;
+    uint64_t size = jfs_system_size_inodes(blocks, inodes) + (uint64_t)blocks * block_size;
+    char name[32];
+
+    struct JSuper *sb = calloc(1, size);
+    if (NULL == sb)
+    {
+        fprintf(stderr, "Can't alloc %lu bytes!\n", (unsigned long)size);
+        return;
+    }
+    jfs_format_opts(sb, block_size, blocks, inodes, flags);
+
+    ///Names are checked while attached, then scans go over the blocks
+    struct JFile *dir = jfs_get_root_dir(sb);
+    jfs_attach(sb);
+    for (uint32_t ii = 0; ii < entries; ii++)
+    {
+        snprintf(name, sizeof(name), "e%u", ii);
+        jfs_create_file(dir, sb, name, 0);
+    }
+    jfs_detach(sb);
+
+    uint64_t seed = 42, found = 0;
+    double start = now_sec();
+    for (uint32_t ii = 0; ii < lookups; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        snprintf(name, sizeof(name), "e%u", (uint32_t)((seed >> 33) % entries));
+        found += NULL != jfs_lookup(dir, sb, name);
+    }
+    double lookup_sec = now_sec() - start;
+
+    struct JDirIter it;
+    uint64_t bytes = 0;
+    start = now_sec();
+    for (uint32_t pass = 0; pass < 10; pass++)
+    {
+        struct JFile *entry;
+        jfs_dir_iter_init(&it, dir, sb);
+        while (NULL != (entry = jfs_dir_iter_next(&it, sb)))
+            bytes += entry->size;
+    }
+    double list_sec = now_sec() - start;
+
+    uint32_t dir_blocks = blocks - jfs_free_blocks(sb);
+    start = now_sec();
+    while (0 != dir->size)
+    {
+        struct JFile *entry;
+        jfs_read_dir(dir, sb, 0, &entry);
+        jfs_remove_file(entry, sb);
+    }
+    double remove_sec = now_sec() - start;
+
+    printf("%-8s block %5u: %3u entries/block, %6u dir blocks, lookup %9.0f/s (%lu found), list %11.0f entries/s, remove all %.3f s\n",
+           format, block_size, fit, dir_blocks, lookups / lookup_sec, (unsigned long)found,
+           10.0 * entries / list_sec, remove_sec);
+    free(sb);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t entries = argc > 1 ? atoi(argv[1]) : 20000;
+    uint32_t block_size = argc > 2 ? atoi(argv[2]) : 256;
+    uint32_t lookups = argc > 3 ? atoi(argv[3]) : 2000;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    run("classic", 0, 0, entries, block_size, lookups);
+    run("itable", entries, 0, entries, block_size, lookups);
+    run("compact", entries, JFS_FLAG_COMPACT, entries, block_size, lookups);
+    return 0;
+}
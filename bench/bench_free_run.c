@@ -0,0 +1,185 @@
+//Free space after files go away. "large": one file grown to file_blocks, then
+//removed; at most JFS_MAG_MAX of the freed blocks may wait in the thread cache,
+//the rest must be back in the free list and the free map. "shuffled": files
+//grown a block at a time in turn, so their chains interleave, then removed in
+//random order; the freed extents must merge again. Output: time of the
+//removes, blocks left cached, the largest free run before, after them and
+//after a drain of the caches, free list extents and the fragments of a file
+//of file_blocks allocated afterwards.
+//Build: cc -O2 -pthread -I. bench/bench_free_run.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_free_run
+//Usage: bench_free_run [blocks] [file_blocks] [block_size] [files]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t largest_run(struct JSuper *sb)
+{
+    struct JStatfs st;
+    return 0 == jfs_statfs(sb, &st) ? st.largest_free_run : 0;
+}
+
+static uint32_t free_extents(struct JSuper *sb)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t n = 0;
+
+    for (int32_t ext = sb->first_free_block; 0 <= ext; ext = fat[ext])
+        n++;
+    return n;
+}
+
+///Runs of contiguous blocks in a fresh file of file_blocks, removed again
+static uint32_t fresh_fragments(struct JSuper *sb, uint32_t file_blocks)
+{
+    struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, "fresh", 0);
+    uint32_t n = 0;
+
+    if (NULL == file || 0 != jfs_resize_file(file, sb, file_blocks * sb->block_size))
+        return 0;
+    for (int32_t block = file->first_data_block_idx; 0 <= block; n++)
+    {
+        uint32_t run = jfs_contig_blocks(jfs_get_fat_ptr(sb), block, file_blocks);
+        block = jfs_get_fat_ptr(sb)[block + run - 1];
+    }
+    jfs_remove_file(file, sb);
+    jfs_alloc_drain(sb);
+    return n;
+}
+
+static void report(struct JSuper *sb, const char *name, uint32_t blocks, double sec, uint32_t cached, uint32_t before,
+                   uint32_t after, uint32_t drained, uint32_t file_blocks)
+{
+    uint32_t extents = free_extents(sb);
+    fprintf(stderr, "%-10s %10u %12.6f %10u %10u %10u %10u %10u %10u\n", name, blocks, sec, cached, before, after, drained,
+            extents, fresh_fragments(sb, file_blocks));
+}
+
+static int32_t large_file(struct JSuper *sb, uint32_t file_blocks)
+{
+    uint32_t before = largest_run(sb);
+    struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, "large", 0);
+
+    if (NULL == file || 0 != jfs_resize_file(file, sb, file_blocks * sb->block_size))
+    {
+        fprintf(stderr, "Can't grow file to %u blocks!\n", file_blocks);
+        return -1;
+    }
+
+    double start = now_sec();
+    int32_t ret = jfs_remove_file(file, sb);
+    double sec = now_sec() - start;
+    uint32_t cached = jfs_free_blocks(sb) - sb->free_blocks;
+    uint32_t after = largest_run(sb);
+    jfs_alloc_drain(sb);
+    uint32_t drained = largest_run(sb);
+
+    report(sb, "large", file_blocks, sec, cached, before, after, drained, file_blocks);
+    if (0 != ret || cached > JFS_MAG_MAX || drained != before)
+    {
+        fprintf(stderr, "Freed blocks stay out of the free list!\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int32_t shuffled_files(struct JSuper *sb, uint32_t files, uint32_t file_blocks)
+{
+    uint32_t before = largest_run(sb);
+    uint32_t *order = malloc(files * sizeof(uint32_t));
+    uint64_t seed = 42;
+    char name[32];
+    int32_t ret = NULL != order ? 0 : -1;
+
+    for (uint32_t ii = 0; 0 == ret && ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "s%u", ii);
+        ret = NULL != jfs_create_file(jfs_get_root_dir(sb), sb, name, 0) ? 0 : -1;
+        order[ii] = ii;
+    }
+    for (uint32_t jj = 1; 0 == ret && jj <= file_blocks / files; jj++)
+        for (uint32_t ii = 0; 0 == ret && ii < files; ii++)
+        {
+            snprintf(name, sizeof(name), "s%u", ii);
+            ret = jfs_resize_file(jfs_lookup(jfs_get_root_dir(sb), sb, name), sb, jj * sb->block_size);
+        }
+    if (0 != ret)
+    {
+        fprintf(stderr, "Can't grow %u files!\n", files);
+        free(order);
+        return -1;
+    }
+
+    for (uint32_t ii = files - 1; ii > 0; ii--)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t jj = (seed >> 33) % (ii + 1), tmp = order[ii];
+        order[ii] = order[jj];
+        order[jj] = tmp;
+    }
+
+    double start = now_sec();
+    for (uint32_t ii = 0; 0 == ret && ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "s%u", order[ii]);
+        ret = jfs_remove_file(jfs_lookup(jfs_get_root_dir(sb), sb, name), sb);
+    }
+    double sec = now_sec() - start;
+    uint32_t cached = jfs_free_blocks(sb) - sb->free_blocks;
+    uint32_t after = largest_run(sb);
+    jfs_alloc_drain(sb);
+    uint32_t drained = largest_run(sb);
+
+    report(sb, "shuffled", file_blocks / files * files, sec, cached, before, after, drained, file_blocks);
+    free(order);
+    if (0 != ret || cached > JFS_MAG_MAX || drained != before)
+    {
+        fprintf(stderr, "Freed extents didn't merge back!\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t blocks = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t file_blocks = argc > 2 ? atoi(argv[2]) : 40000;
+    uint32_t block_size = argc > 3 ? atoi(argv[3]) : 512;
+    uint32_t files = argc > 4 ? atoi(argv[4]) : 1000;
+    int32_t ret = 0;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    uint8_t *image = calloc(1, jfs_system_size(blocks) + (uint64_t)blocks * block_size);
+    if (NULL == image)
+    {
+        fprintf(stderr, "Can't alloc image of %u blocks!\n", blocks);
+        return 1;
+    }
+
+    struct JSuper *sb = (struct JSuper *)image;
+    jfs_format(sb, block_size, blocks);
+    jfs_attach(sb);
+
+    fprintf(stderr, "%u blocks of %u bytes\n", blocks, block_size);
+    fprintf(stderr, "%-10s %10s %12s %10s %10s %10s %10s %10s %10s\n", "case", "blocks", "seconds", "cached", "run_before",
+            "run_after", "drained", "extents", "fragments");
+    ret |= large_file(sb, file_blocks);
+    ret |= shuffled_files(sb, files, file_blocks);
+
+    jfs_detach(sb);
+    free(image);
+    return 0 != ret;
+}
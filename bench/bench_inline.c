@@ -0,0 +1,90 @@
+//Small files with their data in blocks vs in the inode (JFS_FLAG_INLINE).
+//Files of file_size bytes spread over 100 directories, read whole in random
+//order by path. Output: image bytes and read rate per format.
+//Build: cc -O2 -pthread -I. bench/bench_inline.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_inline
+//Usage: bench_inline [files] [file_size] [block_size] [reads]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define DIRS 100
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *format, uint32_t flags, uint32_t files, uint32_t file_size, uint32_t block_size, uint32_t reads)
+{
+    uint32_t inodes = files + DIRS;
+    uint32_t fit = block_size / jfs_dir_entry_size(flags);
+    uint32_t file_blocks = flags & JFS_FLAG_INLINE && file_size <= JFS_INLINE_SIZE ? 0 : (file_size + block_size - 1) / block_size;
+    uint32_t blocks = files * file_blocks + (files / fit + 1) + DIRS * 2 + 16;
+    uint64_t size = jfs_system_size_opts(blocks, inodes, flags) + (uint64_t)blocks * block_size;
+    uint8_t data[4096], buf[4096];
+    char path[64];
+
+    struct JSuper *sb = calloc(1, size);
+    if (NULL == sb || file_size > sizeof(data))
+    {
+        fprintf(stderr, "Can't alloc %lu bytes!\n", (unsigned long)size);
+        free(sb);
+        return;
+    }
+    jfs_format_opts(sb, block_size, blocks, inodes, flags);
+    jfs_attach(sb);
+
+    memset(data, 'j', file_size);
+    for (uint32_t ii = 0; ii < DIRS; ii++)
+    {
+        snprintf(path, sizeof(path), "d%u", ii);
+        jfs_create_file(jfs_get_root_dir(sb), sb, path, 1);
+    }
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(path, sizeof(path), "d%u", ii % DIRS);
+        struct JFile *dir = jfs_resolve_path(sb, path);
+        snprintf(path, sizeof(path), "f%u", ii);
+        jfs_write_file(jfs_create_file(dir, sb, path, 0), sb, 0, data, file_size);
+    }
+
+    uint64_t seed = 42, bytes = 0;
+    uint32_t got;
+    double start = now_sec();
+    for (uint32_t ii = 0; ii < reads; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t file = (seed >> 33) % files;
+        snprintf(path, sizeof(path), "d%u/f%u", file % DIRS, file);
+        jfs_read_file(jfs_resolve_path(sb, path), sb, 0, buf, file_size, &got);
+        bytes += got;
+    }
+    double sec = now_sec() - start;
+
+    printf("%-8s %u files of %u B, block %u: image %lu bytes (%u used blocks), %.0f reads/s, %lu bytes read\n",
+           format, files, file_size, block_size, (unsigned long)size, blocks - jfs_free_blocks(sb), reads / sec, (unsigned long)bytes);
+    jfs_detach(sb);
+    free(sb);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t file_size = argc > 2 ? atoi(argv[2]) : 64;
+    uint32_t block_size = argc > 3 ? atoi(argv[3]) : 4096;
+    uint32_t reads = argc > 4 ? atoi(argv[4]) : 1000000;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    run("blocks", JFS_FLAG_ITABLE | JFS_FLAG_COMPACT, files, file_size, block_size, reads);
+    run("inline", JFS_FLAG_ITABLE | JFS_FLAG_COMPACT | JFS_FLAG_INLINE, files, file_size, block_size, reads);
+    return 0;
+}
@@ -0,0 +1,169 @@
+//Metadata ops on a journaled file-backed image: every thread creates, renames,
+//moves and removes its own files, each op durable on return. Commits of
+//concurrent ops are grouped, ops_per_sync shows how many share one fdatasync.
+//Build: cc -O2 -pthread -I. bench/bench_journal.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_journal
+//Usage: bench_journal [ops_per_thread] [image] [journal_kib]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define MAX_THREADS 16
+#define BLOCK_SIZE 512
+
+struct Worker
+{
+    pthread_t tid;
+    struct JSuper *sb;
+    uint32_t id;
+    uint32_t ops;
+    uint32_t errors;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//Entries move on others' removes, so lookup and change go in one write section
+//and the commit comes after it
+static int32_t one_op(struct JSuper *sb, uint32_t id, uint32_t ii)
+{
+    struct JFile *root = jfs_get_root_dir(sb);
+    char name[32], dir[32], new_name[32];
+    int32_t ret = 0;
+
+    snprintf(name, sizeof(name), "t%u_%u", id, ii / 4);
+    snprintf(new_name, sizeof(new_name), "r%u_%u", id, ii / 4);
+    snprintf(dir, sizeof(dir), "d%u", id);
+
+    if (0 == ii % 4)
+        return NULL == jfs_create_file(root, sb, name, 0) ? -1 : 0;
+
+    jfs_ns_write_lock(sb);
+    struct JFile *sub = jfs_lookup(root, sb, dir);
+    struct JFile *file = NULL;
+    if (NULL != sub)
+        file = jfs_lookup(3 == ii % 4 ? sub : root, sb, 1 == ii % 4 ? name : new_name);
+
+    if (NULL == file || NULL == sub)
+        ret = -1;
+    else if (1 == ii % 4)
+        ret = jfs_rename_file(file, sb, new_name);
+    else if (2 == ii % 4)
+        ret = jfs_move_file(file, sb, sub);
+    else
+        ret = jfs_remove_file(file, sb);
+    jfs_ns_write_unlock(sb);
+
+    return 0 == ret ? jfs_journal_sync(sb) : -1;
+}
+
+static void *worker(void *arg)
+{
+    struct Worker *w = arg;
+
+    for (uint32_t ii = 0; ii < w->ops; ii++)
+        if (0 != one_op(w->sb, w->id, ii))
+            w->errors++;
+
+    return NULL;
+}
+
+static int32_t make_image(const char *path, uint32_t blocks, uint32_t journal_kib)
+{
+    uint64_t size = jfs_system_size(blocks) + (uint64_t)blocks * BLOCK_SIZE;
+    uint8_t *image = calloc(1, size);
+    FILE *out = fopen(path, "wb");
+    int32_t ret = -1;
+
+    if (NULL != image && NULL != out)
+    {
+        jfs_format((struct JSuper *)image, BLOCK_SIZE, blocks);
+        ret = fwrite(image, 1, size, out) == size ? 0 : -1;
+    }
+    if (NULL != out && 0 != fclose(out))
+        ret = -1;
+    free(image);
+
+    return 0 == ret ? jfs_journal_add(path, (uint64_t)journal_kib << 10) : -1;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t ops = argc > 1 ? atoi(argv[1]) / 4 * 4 : 2000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/bench_journal.img";
+    uint32_t journal_kib = argc > 3 ? atoi(argv[3]) : JFS_JOURNAL_BYTES >> 10;
+    uint32_t blocks = MAX_THREADS * (ops / 4 * sizeof(struct JFile) / BLOCK_SIZE + 4) + 64;
+    static const uint32_t threads[] = {1, 2, 4, 8, 16};
+    uint32_t errors = 0;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    fprintf(stderr, "%u metadata ops per thread, journal %u KiB, %s, %ld cpus\n",
+            ops, journal_kib, path, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(stderr, "%-8s %12s %12s %10s %10s %14s\n", "threads", "seconds", "ops_per_sec", "commits", "syncs", "ops_per_sync");
+
+    for (uint32_t tt = 0; tt < sizeof(threads) / sizeof(threads[0]); tt++)
+    {
+        struct Worker w[MAX_THREADS];
+
+        if (0 != make_image(path, blocks, journal_kib))
+        {
+            fprintf(stderr, "Can't make image %s!\n", path);
+            return 1;
+        }
+        struct JSuper *sb = jfs_mount(path, JFS_MOUNT_RDWR);
+        if (NULL == sb)
+        {
+            fprintf(stderr, "Can't mount %s!\n", path);
+            return 1;
+        }
+        for (uint32_t ii = 0; ii < threads[tt]; ii++)
+        {
+            char dir[32];
+            snprintf(dir, sizeof(dir), "d%u", ii);
+            if (NULL == jfs_create_file(jfs_get_root_dir(sb), sb, dir, 1))
+                errors++;
+        }
+
+        struct JJournal *j = jfs_get_state(sb)->journal;
+        uint64_t commits = j->commits, syncs = j->syncs;
+        double start = now_sec();
+
+        for (uint32_t ii = 0; ii < threads[tt]; ii++)
+        {
+            w[ii] = (struct Worker){.sb = sb, .id = ii, .ops = ops};
+            pthread_create(&(w[ii].tid), NULL, worker, &(w[ii]));
+        }
+        for (uint32_t ii = 0; ii < threads[tt]; ii++)
+        {
+            pthread_join(w[ii].tid, NULL);
+            errors += w[ii].errors;
+        }
+
+        double sec = now_sec() - start;
+        commits = j->commits - commits;
+        syncs = j->syncs - syncs;
+        fprintf(stderr, "%-8u %12.4f %12.0f %10lu %10lu %14.2f\n", threads[tt], sec, threads[tt] * ops / sec,
+                (unsigned long)commits, (unsigned long)syncs, syncs ? (double)threads[tt] * ops / syncs : 0.0);
+
+        if (0 != jfs_umount(sb))
+            errors++;
+    }
+
+    if (0 != errors)
+        fprintf(stderr, "%u operations failed\n", errors);
+    remove(path);
+
+    return 0 != errors;
+}
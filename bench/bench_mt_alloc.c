@@ -0,0 +1,166 @@
+//Allocator throughput with concurrent writers: every thread creates its own
+//files, grows them a few blocks per append (allocations), then truncates them
+//(frees). Free list lock only vs thread caches. Scaling needs as many cores.
+//Build: cc -O2 -pthread -I. bench/bench_mt_alloc.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_mt_alloc
+//Usage: bench_mt_alloc [files_per_thread] [appends_per_file] [blocks_per_append] [block_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define MAX_THREADS 16
+
+struct Worker
+{
+    pthread_t tid;
+    struct JSuper *sb;
+    uint32_t id;
+    uint32_t files;
+    uint32_t appends;
+    uint32_t chunk;
+    uint8_t *data;
+    uint32_t errors;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void file_name(char *name, uint32_t thread, uint32_t file)
+{
+    snprintf(name, 32, "t%u_f%u", thread, file);
+}
+
+static void *writer(void *arg)
+{
+    struct Worker *w = arg;
+    struct JFile **files = malloc(w->files * sizeof(struct JFile *));
+    struct JFile *root = jfs_get_root_dir(w->sb);
+    char name[32];
+
+    if (NULL == files)
+    {
+        w->errors++;
+        return NULL;
+    }
+
+    for (uint32_t ii = 0; ii < w->files; ii++)
+    {
+        file_name(name, w->id, ii);
+        if (NULL == jfs_create_file(root, w->sb, name, 0))
+            w->errors++;
+    }
+
+    //Entries may move on others' removes, so pointers are taken inside the section.
+    //Round robin over own files, consecutive allocations belong to different chains
+    jfs_ns_read_lock(w->sb);
+    for (uint32_t ii = 0; ii < w->files; ii++)
+    {
+        file_name(name, w->id, ii);
+        files[ii] = jfs_lookup(root, w->sb, name);
+    }
+    for (uint32_t jj = 0; jj < w->appends; jj++)
+        for (uint32_t ii = 0; ii < w->files; ii++)
+            if (NULL == files[ii] || 0 != jfs_write_file(files[ii], w->sb, files[ii]->size, w->data, w->chunk))
+                w->errors++;
+    for (uint32_t ii = 0; ii < w->files; ii++)
+        if (NULL == files[ii] || 0 != jfs_resize_file(files[ii], w->sb, 0))
+            w->errors++;
+    jfs_ns_read_unlock(w->sb);
+
+    for (uint32_t ii = 0; ii < w->files; ii++)
+    {
+        file_name(name, w->id, ii);
+        jfs_ns_write_lock(w->sb);
+        struct JFile *file = jfs_lookup(root, w->sb, name);
+        if (NULL == file || 0 != jfs_remove_file(file, w->sb))
+            w->errors++;
+        jfs_ns_write_unlock(w->sb);
+    }
+
+    free(files);
+    return NULL;
+}
+
+static double run(struct JSuper *sb, uint32_t threads, uint32_t files, uint32_t appends, uint32_t chunk, uint8_t *data, uint32_t *errors)
+{
+    struct Worker w[MAX_THREADS];
+    double start = now_sec();
+
+    for (uint32_t ii = 0; ii < threads; ii++)
+    {
+        w[ii] = (struct Worker){.sb = sb, .id = ii, .files = files, .appends = appends, .chunk = chunk, .data = data};
+        pthread_create(&(w[ii].tid), NULL, writer, &(w[ii]));
+    }
+    for (uint32_t ii = 0; ii < threads; ii++)
+    {
+        pthread_join(w[ii].tid, NULL);
+        *errors += w[ii].errors;
+    }
+
+    return now_sec() - start;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 64;
+    uint32_t appends = argc > 2 ? atoi(argv[2]) : 64;
+    uint32_t chunk_blocks = argc > 3 ? atoi(argv[3]) : 1;
+    uint32_t block_size = argc > 4 ? atoi(argv[4]) : 512;
+    uint32_t chunk = chunk_blocks * block_size;
+    uint32_t blocks = MAX_THREADS * (files * (appends * chunk_blocks + 1) + files / (block_size / sizeof(struct JFile)) + 1) + 1024;
+    static const uint32_t threads[] = {1, 2, 4, 8, 16};
+    uint32_t errors = 0;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    uint8_t *image = calloc(1, jfs_system_size(blocks) + (uint64_t)blocks * block_size);
+    uint8_t *data = malloc(chunk);
+    if (NULL == image || NULL == data)
+    {
+        fprintf(stderr, "Can't alloc image of %u blocks!\n", blocks);
+        return 1;
+    }
+    memset(data, 'j', chunk);
+
+    struct JSuper *sb = (struct JSuper *)image;
+    jfs_format(sb, block_size, blocks);
+    jfs_attach(sb);
+
+    fprintf(stderr, "%u files x %u appends of %u blocks per thread, block %u, %ld cpus\n",
+            files, appends, chunk_blocks, block_size, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(stderr, "%-8s %-8s %12s %16s %10s\n", "cache", "threads", "seconds", "blocks_per_sec", "speedup");
+
+    for (int cache = 0; cache < 2; cache++)
+    {
+        double base = 0;
+        jfs_set_alloc_cache(sb, cache);
+        for (uint32_t ii = 0; ii < sizeof(threads) / sizeof(threads[0]); ii++)
+        {
+            double sec = run(sb, threads[ii], files, appends, chunk, data, &errors);
+            //Every block is taken once and given back once
+            double rate = 2.0 * threads[ii] * files * appends * chunk_blocks / sec;
+            if (0 == ii)
+                base = rate;
+            fprintf(stderr, "%-8s %-8u %12.4f %16.0f %10.2f\n", cache ? "on" : "off", threads[ii], sec, rate, rate / base);
+        }
+    }
+
+    if (0 != errors)
+        fprintf(stderr, "%u operations failed\n", errors);
+
+    jfs_detach(sb);
+    free(data);
+    free(image);
+    return 0 != errors;
+}
@@ -0,0 +1,135 @@
+//Concurrent readers on one attached image: lookup by name plus a random read,
+//each inside a namespace read section. Scaling is only visible on as many cores.
+//Build: cc -O2 -pthread -I. bench/bench_mt_read.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_mt_read
+//Usage: bench_mt_read [files] [ops_per_thread] [read_size] [block_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define FILE_SIZE (64u << 10)
+
+struct Worker
+{
+    pthread_t tid;
+    struct JSuper *sb;
+    uint32_t files;
+    uint32_t ops;
+    uint32_t read_size;
+    uint32_t seed;
+    uint64_t bytes;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *reader(void *arg)
+{
+    struct Worker *w = arg;
+    uint64_t seed = w->seed;
+    uint8_t *dst = malloc(w->read_size);
+    char name[32];
+    uint32_t got;
+
+    for (uint32_t ii = 0; NULL != dst && ii < w->ops; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        snprintf(name, sizeof(name), "f%u", (uint32_t)(seed >> 33) % w->files);
+
+        jfs_ns_read_lock(w->sb);
+        struct JFile *file = jfs_lookup(jfs_get_root_dir(w->sb), w->sb, name);
+        if (NULL != file && 0 == jfs_read_file(file, w->sb, (seed >> 17) % (FILE_SIZE - w->read_size), dst, w->read_size, &got))
+            w->bytes += got;
+        jfs_ns_read_unlock(w->sb);
+    }
+
+    free(dst);
+    return NULL;
+}
+
+static double run(struct JSuper *sb, uint32_t threads, uint32_t files, uint32_t ops, uint32_t read_size)
+{
+    struct Worker w[16];
+    double start = now_sec();
+
+    for (uint32_t ii = 0; ii < threads; ii++)
+    {
+        w[ii] = (struct Worker){.sb = sb, .files = files, .ops = ops, .read_size = read_size, .seed = 42 + ii};
+        pthread_create(&(w[ii].tid), NULL, reader, &(w[ii]));
+    }
+    for (uint32_t ii = 0; ii < threads; ii++)
+        pthread_join(w[ii].tid, NULL);
+
+    return now_sec() - start;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 4096;
+    uint32_t ops = argc > 2 ? atoi(argv[2]) : 200000;
+    uint32_t read_size = argc > 3 ? atoi(argv[3]) : 512;
+    uint32_t block_size = argc > 4 ? atoi(argv[4]) : 4096;
+    uint32_t dir_blocks = files / (block_size / sizeof(struct JFile)) + 2;
+    uint32_t blocks = (uint64_t)files * FILE_SIZE / block_size + dir_blocks + 16;
+    static const uint32_t threads[] = {1, 2, 4, 8, 16};
+    char name[32];
+
+    if (read_size >= FILE_SIZE)
+        read_size = FILE_SIZE / 2;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    uint8_t *image = calloc(1, jfs_system_size(blocks) + (uint64_t)blocks * block_size);
+    uint8_t *buf = malloc(FILE_SIZE);
+    if (NULL == image || NULL == buf)
+    {
+        fprintf(stderr, "Can't alloc image for %u files!\n", files);
+        return 1;
+    }
+
+    struct JSuper *sb = (struct JSuper *)image;
+    jfs_format(sb, block_size, blocks);
+    jfs_attach(sb);
+    jfs_set_seek_index(sb, JFS_SEEK_STRIDE);
+    memset(buf, 'j', FILE_SIZE);
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%u", ii);
+        struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, name, 0);
+        if (NULL == file || 0 != jfs_write_file(file, sb, 0, buf, FILE_SIZE))
+        {
+            fprintf(stderr, "Can't fill the image!\n");
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%u files of %u KiB, block %u, %u ops of %u bytes per thread, %ld cpus\n",
+            files, FILE_SIZE >> 10, block_size, ops, read_size, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(stderr, "%-8s %12s %14s %10s\n", "threads", "seconds", "ops_per_sec", "speedup");
+
+    double base = 0;
+    for (uint32_t ii = 0; ii < sizeof(threads) / sizeof(threads[0]); ii++)
+    {
+        double sec = run(sb, threads[ii], files, ops, read_size);
+        double rate = (double)threads[ii] * ops / sec;
+        if (0 == ii)
+            base = rate;
+        fprintf(stderr, "%-8u %12.4f %14.0f %10.2f\n", threads[ii], sec, rate, rate / base);
+    }
+
+    jfs_detach(sb);
+    free(buf);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,179 @@
+//Sequential reads of fragmented files: mmap mount vs pread mount with its
+//block cache, without and with readahead along the chains. Files are written
+//interleaved, so each chain hops between extents. The page cache of the image
+//is dropped before every pass (posix_fadvise).
+//Build: cc -O2 -pthread -I. bench/bench_pread.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_pread
+//Usage: bench_pread [files] [file_kib] [extent_blocks] [read_size] [block_size] [image]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int32_t fill(struct JSuper *sb, uint32_t files, uint32_t file_size, uint32_t chunk, uint8_t *data)
+{
+    char name[32];
+
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%u", ii);
+        if (NULL == jfs_create_file(jfs_get_root_dir(sb), sb, name, 0))
+            return -1;
+    }
+
+    ///Round robin: every file takes the next extent in turn
+    for (uint32_t pos = 0; pos < file_size; pos += chunk)
+        for (uint32_t ii = 0; ii < files; ii++)
+        {
+            snprintf(name, sizeof(name), "f%u", ii);
+            struct JFile *file = jfs_lookup(jfs_get_root_dir(sb), sb, name);
+            for (uint32_t jj = 0; jj < chunk; jj++)
+                data[jj] = (uint8_t)(ii * 31 + pos + jj);
+            if (NULL == file || 0 != jfs_write_file(file, sb, pos, data, file_size - pos < chunk ? file_size - pos : chunk))
+                return -1;
+        }
+
+    return 0;
+}
+
+static int32_t make_image(const char *path, uint32_t files, uint32_t file_size, uint32_t extent_blocks, uint32_t block_size)
+{
+    uint32_t chunk = extent_blocks * block_size;
+    uint32_t blocks = (uint64_t)files * ((file_size + block_size - 1) / block_size + 1) + files / (block_size / sizeof(struct JFile)) + 16;
+    uint64_t size = jfs_system_size(blocks) + (uint64_t)blocks * block_size;
+    uint8_t *image = calloc(1, size);
+    uint8_t *data = malloc(chunk);
+    int32_t ret = -1;
+
+    if (NULL != image && NULL != data)
+    {
+        struct JSuper *sb = (struct JSuper *)image;
+        jfs_format(sb, block_size, blocks);
+        jfs_attach(sb);
+        jfs_set_alloc_cache(sb, 0); //Written out while attached
+        ret = fill(sb, files, file_size, chunk, data);
+        jfs_detach(sb);
+    }
+
+    FILE *out = 0 == ret ? fopen(path, "wb") : NULL;
+    if (0 == ret)
+        ret = NULL != out && fwrite(image, 1, size, out) == size ? 0 : -1;
+    if (NULL != out && 0 != fclose(out))
+        ret = -1;
+
+    free(data);
+    free(image);
+    return ret;
+}
+
+static void drop_page_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static int32_t pass(const char *path, const char *mode, uint32_t flags, uint32_t readahead, uint32_t files, uint32_t read_size, uint64_t *sum)
+{
+    uint8_t *buf = malloc(read_size);
+    uint64_t bytes = 0, check = 0;
+    char name[32];
+
+    drop_page_cache(path);
+    struct JSuper *sb = jfs_mount(path, flags);
+    if (NULL == sb || NULL == buf)
+    {
+        free(buf);
+        return -1;
+    }
+    if ((flags & JFS_MOUNT_PREAD) && 0 != jfs_set_block_cache(sb, JFS_CACHE_MIB, readahead))
+    {
+        jfs_umount(sb);
+        free(buf);
+        return -1;
+    }
+
+    double start = now_sec();
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%u", ii);
+        struct JFile *file = jfs_lookup(jfs_get_root_dir(sb), sb, name);
+        uint32_t got = 0;
+
+        for (uint32_t pos = 0; NULL != file && pos < file->size; pos += got)
+        {
+            if (0 != jfs_read_file(file, sb, pos, buf, read_size, &got) || 0 == got)
+                break;
+            for (uint32_t jj = 0; jj < got; jj++)
+                check = check * 131 + buf[jj];
+            bytes += got;
+        }
+    }
+    double sec = now_sec() - start;
+
+    struct JCacheStats cs;
+    jfs_cache_stats(sb, &cs);
+    fprintf(stderr, "%-10s %6u %10.4f %10.1f %10lu %10.1f %10lu %10lu %10lu %10lu\n", mode, readahead, sec, bytes / sec / (1 << 20),
+            (unsigned long)cs.reads, cs.reads ? cs.read_bytes / 1024.0 / cs.reads : 0.0, (unsigned long)cs.hits,
+            (unsigned long)cs.misses, (unsigned long)cs.readahead, (unsigned long)cs.readahead_hits);
+
+    jfs_umount(sb);
+    free(buf);
+    if (0 != *sum && check != *sum)
+    {
+        fprintf(stderr, "%s read other data than mmap!\n", mode);
+        return -1;
+    }
+    *sum = check;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 16;
+    uint32_t file_size = (argc > 2 ? atoi(argv[2]) : 4096) << 10;
+    uint32_t extent_blocks = argc > 3 ? atoi(argv[3]) : 8;
+    uint32_t read_size = argc > 4 ? atoi(argv[4]) : 4096;
+    uint32_t block_size = argc > 5 ? atoi(argv[5]) : 4096;
+    const char *path = argc > 6 ? argv[6] : "/tmp/bench_pread.img";
+    uint64_t sum = 0;
+    int32_t ret = 0;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    if (0 != make_image(path, files, file_size, extent_blocks, block_size))
+    {
+        fprintf(stderr, "Can't make image %s!\n", path);
+        return 1;
+    }
+
+    fprintf(stderr, "%u files of %u KiB in extents of %u blocks, block %u, reads of %u bytes, cache %u MiB\n",
+            files, file_size >> 10, extent_blocks, block_size, read_size, JFS_CACHE_MIB);
+    fprintf(stderr, "%-10s %6s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "mode", "ahead", "seconds", "MiB_per_s", "dev_reads", "KiB_per_rd", "hits", "misses", "readahead", "ahead_hits");
+
+    ret |= pass(path, "mmap", JFS_MOUNT_RDONLY, 0, files, read_size, &sum);
+    ret |= pass(path, "pread", JFS_MOUNT_PREAD, 0, files, read_size, &sum);
+    ret |= pass(path, "pread", JFS_MOUNT_PREAD, JFS_READAHEAD, files, read_size, &sum);
+    ret |= pass(path, "pread", JFS_MOUNT_PREAD, 4 * JFS_READAHEAD, files, read_size, &sum);
+
+    remove(path);
+    return 0 != ret;
+}
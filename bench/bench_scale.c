@@ -0,0 +1,363 @@
+//Scaling sweep over the core operations on synthetic in-memory images, to
+//catch complexity regressions: per op costs (latency, fat[] hops) must stay
+//flat as entries and file sizes grow. Entries go from 10^3 up by tens to
+//max_entries in one directory; files from 1 B up to max_file_mib. Images
+//use the seek index, as mounts that serve random reads do.
+//Output: one CSV row per phase on stdout; skipped combinations on stderr.
+//fat_hops_per_op is filled only when the core is built with -DJFS_STATS.
+//Build: make bench, or cc -O2 -pthread -DJFS_STATS -I. bench/bench_scale.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_scale
+//Usage: bench_scale [max_entries] [max_file_mib] [block_sizes, e.g. 512,4096] [max_image_mib]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define MAX_SAMPLES (1u << 20) //Latencies kept per phase, longer phases are sampled evenly
+#define CHUNK       (64u << 10) //Bytes per write/read call of sequential phases
+#define RANDOM_READ 4096
+#define MAX_FILES   10000
+
+struct Phase
+{
+    const char *op;
+    uint32_t block_size;
+    uint64_t entries;
+    uint64_t file_size;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t stride;  //Every stride-th op is timed alone
+    int64_t hops;    //Count at the start, -1 without stats
+    uint64_t start_ns;
+    uint32_t samples;
+    uint64_t *lat;
+};
+
+static uint64_t lat_buf[MAX_SAMPLES];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+///fat[] links followed by all ops so far, -1 without stats in the core
+static int64_t hops_now(void)
+{
+    struct JStats stats;
+    int64_t hops = 0;
+
+    if (0 != jfs_stats_get(&stats))
+        return -1;
+    for (uint32_t ii = 0; ii < JFS_OP_COUNT; ii++)
+        hops += stats.fat_hops[ii];
+    return hops;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void phase_begin(struct Phase *ph, const char *op, uint32_t block_size, uint64_t entries, uint64_t file_size, uint64_t ops)
+{
+    *ph = (struct Phase){.op = op, .block_size = block_size, .entries = entries, .file_size = file_size, .lat = lat_buf};
+    ph->stride = ops / MAX_SAMPLES + 1;
+    ph->hops = hops_now();
+    ph->start_ns = now_ns();
+}
+
+static inline uint64_t op_begin(struct Phase *ph)
+{
+    return 0 == ph->ops % ph->stride ? now_ns() : 0;
+}
+
+static inline void op_end(struct Phase *ph, uint64_t t, uint64_t bytes)
+{
+    if (0 != t && ph->samples < MAX_SAMPLES)
+        ph->lat[ph->samples++] = now_ns() - t;
+    ph->ops++;
+    ph->bytes += bytes;
+}
+
+static void phase_end(struct Phase *ph)
+{
+    double sec = (now_ns() - ph->start_ns) * 1e-9;
+    int64_t hops = hops_now() - ph->hops;
+    uint64_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+
+    if (0 != ph->samples)
+    {
+        qsort(ph->lat, ph->samples, sizeof(uint64_t), cmp_u64);
+        p50 = ph->lat[(uint64_t)ph->samples * 50 / 100];
+        p90 = ph->lat[(uint64_t)ph->samples * 90 / 100];
+        p99 = ph->lat[(uint64_t)ph->samples * 99 / 100];
+        max = ph->lat[ph->samples - 1];
+    }
+
+    printf("%s,%u,%lu,%lu,%lu,%.6f,%.0f,%.0f,%lu,%lu,%lu,%lu,", ph->op, ph->block_size,
+           (unsigned long)ph->entries, (unsigned long)ph->file_size, (unsigned long)ph->ops, sec,
+           sec > 0 ? ph->ops / sec : 0.0, sec > 0 ? ph->bytes / sec : 0.0,
+           (unsigned long)p50, (unsigned long)p90, (unsigned long)p99, (unsigned long)max);
+    if (0 > ph->hops)
+        printf("\n");
+    else
+        printf("%.2f\n", ph->ops ? (double)hops / ph->ops : 0.0);
+    fflush(stdout);
+}
+
+static struct JSuper *image_new(uint32_t block_size, uint64_t blocks, uint64_t max_image)
+{
+    uint64_t size = blocks * block_size + blocks * 2 * sizeof(int32_t);
+
+    if (size > max_image || blocks > INT32_MAX)
+    {
+        fprintf(stderr, "skip: block %u, %lu blocks is over the image limit\n", block_size, (unsigned long)blocks);
+        return NULL;
+    }
+
+    size = jfs_system_size(blocks) + blocks * block_size;
+    struct JSuper *sb = calloc(1, size);
+    if (NULL == sb)
+    {
+        fprintf(stderr, "skip: can't alloc %lu bytes\n", (unsigned long)size);
+        return NULL;
+    }
+
+    jfs_format(sb, block_size, blocks);
+    jfs_attach(sb);
+    jfs_set_seek_index(sb, JFS_SEEK_STRIDE);
+    return sb;
+}
+
+static void image_free(struct JSuper *sb)
+{
+    jfs_detach(sb);
+    free(sb);
+}
+
+///create, lookup, read_dir, move and remove with n entries in one directory
+static void run_entries(uint32_t block_size, uint64_t n, uint64_t max_image)
+{
+    uint64_t fit = block_size / sizeof(struct JFile);
+    struct JSuper *sb = image_new(block_size, (n / fit + 2) * 2 + 16, max_image);
+    struct Phase ph;
+    char name[32];
+
+    if (NULL == sb)
+        return;
+
+    struct JFile *root = jfs_get_root_dir(sb);
+    jfs_create_file(root, sb, "a", 1);
+    jfs_create_file(root, sb, "b", 1);
+    struct JFile *dir_a = jfs_lookup(root, sb, "a");
+    struct JFile *dir_b = jfs_lookup(root, sb, "b");
+
+    phase_begin(&ph, "create", block_size, n, 0, n);
+    for (uint64_t ii = 0; ii < n; ii++)
+    {
+        snprintf(name, sizeof(name), "e%lu", (unsigned long)ii);
+        uint64_t t = op_begin(&ph);
+        if (NULL == jfs_create_file(dir_a, sb, name, 0))
+            break;
+        op_end(&ph, t, 0);
+    }
+    phase_end(&ph);
+
+    uint64_t seed = 42;
+    phase_begin(&ph, "lookup", block_size, n, 0, n);
+    for (uint64_t ii = 0; ii < n; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        snprintf(name, sizeof(name), "e%lu", (unsigned long)((seed >> 33) % n));
+        uint64_t t = op_begin(&ph);
+        jfs_lookup(dir_a, sb, name);
+        op_end(&ph, t, 0);
+    }
+    phase_end(&ph);
+
+    phase_begin(&ph, "read_dir", block_size, n, 0, n);
+    for (uint64_t ii = 0; ii < n; ii++)
+    {
+        struct JFile *entry;
+        uint64_t t = op_begin(&ph);
+        jfs_read_dir(dir_a, sb, ii, &entry);
+        op_end(&ph, t, 0);
+    }
+    phase_end(&ph);
+
+    ///A tenth goes over by name: the op is a lookup plus the move
+    uint64_t moves = n / 10 ? n / 10 : 1;
+    phase_begin(&ph, "move", block_size, n, 0, moves);
+    for (uint64_t ii = 0; ii < moves; ii++)
+    {
+        snprintf(name, sizeof(name), "e%lu", (unsigned long)(ii * 10 % n));
+        uint64_t t = op_begin(&ph);
+        struct JFile *file = jfs_lookup(dir_a, sb, name);
+        if (NULL == file || 0 != jfs_move_file(file, sb, dir_b))
+            break;
+        op_end(&ph, t, 0);
+    }
+    phase_end(&ph);
+
+    ///First entry each time, the last one is moved into its place
+    phase_begin(&ph, "remove", block_size, n, 0, n);
+    for (struct JFile *dir = dir_a; NULL != dir; dir = dir == dir_a ? dir_b : NULL)
+        while (0 != dir->size)
+        {
+            struct JFile *entry;
+            uint64_t t = op_begin(&ph);
+            jfs_read_dir(dir, sb, 0, &entry);
+            if (0 != jfs_remove_file(entry, sb))
+                break;
+            op_end(&ph, t, 0);
+        }
+    phase_end(&ph);
+
+    image_free(sb);
+}
+
+///write, read, random reads, resize and remove of files of size bytes
+static void run_files(uint32_t block_size, uint64_t size, uint64_t max_image)
+{
+    uint64_t budget = max_image / 4 > size ? max_image / 4 : size;
+    uint64_t files = budget / size < MAX_FILES ? budget / size : MAX_FILES;
+    uint64_t file_blocks = (size + block_size - 1) / block_size;
+    uint64_t fit = block_size / sizeof(struct JFile);
+    uint64_t blocks = files * file_blocks + files / fit + 16;
+    struct JSuper *sb = image_new(block_size, blocks + blocks / 32 + 256, max_image); //Slack for the allocator caches
+    struct JFile **list = malloc(files * sizeof(struct JFile *));
+    uint8_t *buf = malloc(CHUNK);
+    struct Phase ph;
+    char name[32];
+
+    if (NULL == sb || NULL == list || NULL == buf)
+    {
+        if (NULL != sb)
+            image_free(sb);
+        free(list);
+        free(buf);
+        return;
+    }
+    memset(buf, 'j', CHUNK);
+
+    struct JFile *root = jfs_get_root_dir(sb);
+    for (uint64_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%lu", (unsigned long)ii);
+        jfs_create_file(root, sb, name, 0);
+    }
+    ///No more creates, so the entries stay where they are
+    for (uint64_t ii = 0; ii < files; ii++)
+    {
+        snprintf(name, sizeof(name), "f%lu", (unsigned long)ii);
+        list[ii] = jfs_lookup(root, sb, name);
+    }
+
+    uint64_t chunk = size < CHUNK ? size : CHUNK;
+    uint64_t calls = files * ((size + chunk - 1) / chunk);
+    phase_begin(&ph, "write", block_size, files, size, calls);
+    for (uint64_t ii = 0; ii < files; ii++)
+        for (uint64_t pos = 0; pos < size; pos += chunk)
+        {
+            uint32_t len = size - pos < chunk ? size - pos : chunk;
+            uint64_t t = op_begin(&ph);
+            if (0 != jfs_write_file(list[ii], sb, pos, buf, len))
+                break;
+            op_end(&ph, t, len);
+        }
+    phase_end(&ph);
+
+    phase_begin(&ph, "read", block_size, files, size, calls);
+    for (uint64_t ii = 0; ii < files; ii++)
+        for (uint64_t pos = 0; pos < size; pos += chunk)
+        {
+            uint32_t got;
+            uint64_t t = op_begin(&ph);
+            jfs_read_file(list[ii], sb, pos, buf, chunk, &got);
+            op_end(&ph, t, got);
+        }
+    phase_end(&ph);
+
+    uint64_t len = size < RANDOM_READ ? size : RANDOM_READ;
+    uint64_t reads = files * 16 < 100000 ? files * 16 : 100000;
+    uint64_t seed = 42;
+    phase_begin(&ph, "read_random", block_size, files, size, reads);
+    for (uint64_t ii = 0; ii < reads; ii++)
+    {
+        uint32_t got;
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        struct JFile *file = list[(seed >> 33) % files];
+        uint32_t offset = (seed >> 11) % (size - len + 1);
+        uint64_t t = op_begin(&ph);
+        jfs_read_file(file, sb, offset, buf, len, &got);
+        op_end(&ph, t, got);
+    }
+    phase_end(&ph);
+
+    ///Shrink to half and grow back
+    phase_begin(&ph, "resize", block_size, files, size, 2 * files);
+    for (uint64_t ii = 0; ii < files; ii++)
+    {
+        uint64_t t = op_begin(&ph);
+        jfs_resize_file(list[ii], sb, size / 2);
+        op_end(&ph, t, 0);
+        t = op_begin(&ph);
+        jfs_resize_file(list[ii], sb, size);
+        op_end(&ph, t, size - size / 2);
+    }
+    phase_end(&ph);
+
+    phase_begin(&ph, "remove", block_size, files, size, files);
+    while (0 != root->size)
+    {
+        struct JFile *entry;
+        uint64_t t = op_begin(&ph);
+        jfs_read_dir(root, sb, 0, &entry);
+        if (0 != jfs_remove_file(entry, sb))
+            break;
+        op_end(&ph, t, 0);
+    }
+    phase_end(&ph);
+
+    free(list);
+    free(buf);
+    image_free(sb);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t max_entries = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    uint64_t max_file = (argc > 2 ? strtoull(argv[2], NULL, 10) : 64) << 20;
+    char *block_sizes = strdup(argc > 3 ? argv[3] : "512,4096");
+    uint64_t max_image = (argc > 4 ? strtoull(argv[4], NULL, 10) : 1024) << 20;
+    static const uint64_t sizes[] = {1, 100, 4096, 64 << 10, 1 << 20, 16 << 20, 256 << 20, 1 << 30};
+
+    //Core messages go with the notes on stderr
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    printf("op,block_size,entries,file_size,ops,seconds,ops_per_sec,bytes_per_sec,p50_ns,p90_ns,p99_ns,max_ns,fat_hops_per_op\n");
+
+    for (char *tok = strtok(block_sizes, ","); NULL != tok; tok = strtok(NULL, ","))
+    {
+        uint32_t block_size = atoi(tok);
+        if (block_size < sizeof(struct JFile))
+        {
+            fprintf(stderr, "skip: block %u holds no entry\n", block_size);
+            continue;
+        }
+
+        for (uint64_t n = 1000; n <= max_entries; n *= 10)
+            run_entries(block_size, n, max_image);
+        for (uint32_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]) && sizes[ii] <= max_file; ii++)
+            run_files(block_size, sizes[ii], max_image);
+    }
+
+    free(block_sizes);
+    return 0;
+}
@@ -0,0 +1,79 @@
+//Random pread-style reads from one big file, plain chain walk vs seek index.
+//Build: cc -O2 -pthread -I. bench/bench_seek.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_seek
+//Usage: bench_seek [file_mib] [reads] [read_size] [block_size]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double random_reads(struct JFile *file, struct JSuper *sb, uint32_t reads, uint32_t read_size, uint8_t *dst)
+{
+    uint64_t seed = 42;
+    uint32_t got;
+    double start = now_sec();
+
+    for (uint32_t ii = 0; ii < reads; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t offset = (seed >> 33) % (file->size - read_size);
+        jfs_read_file(file, sb, offset, dst, read_size, &got);
+    }
+
+    return now_sec() - start;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t file_mib = argc > 1 ? atoi(argv[1]) : 256;
+    uint32_t reads = argc > 2 ? atoi(argv[2]) : 2000;
+    uint32_t read_size = argc > 3 ? atoi(argv[3]) : 4096;
+    uint32_t block_size = argc > 4 ? atoi(argv[4]) : 256;
+    uint64_t file_size = (uint64_t)file_mib << 20;
+    uint32_t blocks = file_size / block_size + 16;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    uint8_t *image = calloc(1, jfs_system_size(blocks) + (uint64_t)blocks * block_size);
+    uint8_t *buf = malloc(read_size > (1 << 20) ? read_size : (1 << 20));
+    if (NULL == image || NULL == buf)
+    {
+        fprintf(stderr, "Can't alloc %u MiB image!\n", file_mib);
+        return 1;
+    }
+
+    struct JSuper *sb = (struct JSuper *)image;
+    jfs_format(sb, block_size, blocks);
+    struct JFile *file = jfs_create_file(jfs_get_root_dir(sb), sb, "big", 0);
+    memset(buf, 'j', 1 << 20);
+    for (uint32_t ii = 0; ii < file_mib; ii++)
+        jfs_write_file(file, sb, file->size, buf, 1 << 20);
+
+    double plain = random_reads(file, sb, reads, read_size, buf);
+
+    jfs_set_seek_index(sb, JFS_SEEK_STRIDE);
+    double cold = random_reads(file, sb, reads, read_size, buf); //Builds the index on the way
+    double warm = random_reads(file, sb, reads, read_size, buf);
+    jfs_detach(sb);
+
+    fprintf(stderr, "file %u MiB, block %u, %u reads of %u bytes\n", file_mib, block_size, reads, read_size);
+    fprintf(stderr, "%-14s %12s %12s\n", "mode", "seconds", "us_per_read");
+    fprintf(stderr, "%-14s %12.4f %12.2f\n", "plain", plain, plain * 1e6 / reads);
+    fprintf(stderr, "%-14s %12.4f %12.2f\n", "indexed_cold", cold, cold * 1e6 / reads);
+    fprintf(stderr, "%-14s %12.4f %12.2f\n", "indexed_warm", warm, warm * 1e6 / reads);
+
+    free(buf);
+    free(image);
+    return 0;
+}
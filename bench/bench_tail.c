@@ -0,0 +1,107 @@
+//Files with their last partial block in a block of its own vs packed into
+//shared tail blocks (JFS_FLAG_TAILPACK). Files of 1..max_size bytes spread
+//over 100 directories, read whole in random order by path. Output: used
+//blocks and read rate per format.
+//Build: cc -O2 -pthread -I. bench/bench_tail.c jfs.c jfs_state.c jfs_mount.c jfs_journal.c jfs_cache.c jfs_compress.c -o bench_tail
+//Usage: bench_tail [files] [max_size] [block_size] [reads]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+
+#define DIRS 100
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t file_size(uint32_t file, uint32_t max_size)
+{
+    return (uint32_t)(file * 2654435761u) % max_size + 1;
+}
+
+static void run(const char *format, uint32_t flags, uint32_t files, uint32_t max_size, uint32_t block_size, uint32_t reads)
+{
+    uint32_t inodes = files + DIRS;
+    uint32_t fit = block_size / jfs_dir_entry_size(flags);
+    uint32_t blocks = DIRS * 2 + 16 + files / fit + 1;
+    char path[64];
+
+    for (uint32_t ii = 0; ii < files; ii++)
+        blocks += (file_size(ii, max_size) + block_size - 1) / block_size;
+    uint64_t size = jfs_system_size_opts(blocks, inodes, flags) + (uint64_t)blocks * block_size;
+
+    struct JSuper *sb = calloc(1, size);
+    uint8_t *data = malloc(max_size);
+    uint8_t *buf = malloc(max_size);
+    if (NULL == sb || NULL == data || NULL == buf)
+    {
+        fprintf(stderr, "Can't alloc %lu bytes!\n", (unsigned long)size);
+        free(sb);
+        free(data);
+        free(buf);
+        return;
+    }
+    jfs_format_opts(sb, block_size, blocks, inodes, flags);
+    jfs_attach(sb);
+
+    memset(data, 'j', max_size);
+    for (uint32_t ii = 0; ii < DIRS; ii++)
+    {
+        snprintf(path, sizeof(path), "d%u", ii);
+        jfs_create_file(jfs_get_root_dir(sb), sb, path, 1);
+    }
+    for (uint32_t ii = 0; ii < files; ii++)
+    {
+        snprintf(path, sizeof(path), "d%u", ii % DIRS);
+        struct JFile *dir = jfs_resolve_path(sb, path);
+        snprintf(path, sizeof(path), "f%u", ii);
+        struct JFile *file = jfs_create_file(dir, sb, path, 0);
+        jfs_write_file(file, sb, 0, data, file_size(ii, max_size));
+        jfs_pack_tail(file, sb);
+    }
+
+    uint64_t seed = 42, bytes = 0;
+    uint32_t got;
+    double start = now_sec();
+    for (uint32_t ii = 0; ii < reads; ii++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t file = (seed >> 33) % files;
+        snprintf(path, sizeof(path), "d%u/f%u", file % DIRS, file);
+        jfs_read_file(jfs_resolve_path(sb, path), sb, 0, buf, file_size(file, max_size), &got);
+        bytes += got;
+    }
+    double sec = now_sec() - start;
+
+    uint32_t used = blocks - jfs_free_blocks(sb);
+    printf("%-8s %u files of 1..%u B, block %u: %u used blocks (%lu bytes), %.0f reads/s, %.1f MB/s\n",
+           format, files, max_size, block_size, used, (unsigned long)used * block_size,
+           reads / sec, bytes / sec / 1e6);
+    jfs_detach(sb);
+    free(sb);
+    free(data);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t files = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t max_size = argc > 2 ? atoi(argv[2]) : 16384;
+    uint32_t block_size = argc > 3 ? atoi(argv[3]) : 4096;
+    uint32_t reads = argc > 4 ? atoi(argv[4]) : 1000000;
+
+    //Core messages go with the report
+    jfs_set_log(JFS_LOG_WARN, JFS_LOG_ALL, stderr);
+
+    run("blocks", JFS_FLAG_ITABLE | JFS_FLAG_COMPACT, files, max_size, block_size, reads);
+    run("tailpack", JFS_FLAG_ITABLE | JFS_FLAG_COMPACT | JFS_FLAG_TAILPACK, files, max_size, block_size, reads);
+    return 0;
+}
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include "extract_jfs_image.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+///Extraction runs in two passes: the tree is walked once to create every
+///directory and collect the files, then a worker pool writes the files.
+
+struct ExtractJob
+{
+    struct JFile *file;
+    char *path;
+};
+
+struct Extract
+{
+    struct JSuper *sb;
+    int image_fd;
+    struct ExtractJob *jobs;
+    uint32_t jobs_cnt;
+    uint32_t jobs_cap;
+    uint32_t next;      //Next job to take, atomic
+    int copy_range;     //copy_file_range works on this pair of filesystems, atomic
+    int error;
+    uint32_t rejected;  //Entries skipped for names that would leave the destination
+};
+
+static int32_t add_job(struct Extract *ex, struct JFile *file, char *path)
+{
+    if (ex->jobs_cnt == ex->jobs_cap)
+    {
+        uint32_t cap = ex->jobs_cap ? 2 * ex->jobs_cap : 1024;
+        struct ExtractJob *jobs = realloc(ex->jobs, cap * sizeof(struct ExtractJob));
+        if (NULL == jobs)
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't alloc memory for extraction!\n");
+            return -1;
+        }
+        ex->jobs = jobs;
+        ex->jobs_cap = cap;
+    }
+
+    ex->jobs[ex->jobs_cnt].file = file;
+    ex->jobs[ex->jobs_cnt].path = strdup(path);
+    if (NULL == ex->jobs[ex->jobs_cnt].path)
+        return -1;
+    ex->jobs_cnt++;
+
+    return 0;
+}
+
+///Names come from the image, a host path made of them must stay below the destination
+static uint8_t host_name_ok(const char *name)
+{
+    return '\0' != name[0] && 0 != strcmp(name, ".") && 0 != strcmp(name, "..") && NULL == strchr(name, '/');
+}
+
+static int32_t plan_dir(struct Extract *ex, struct JFile *dir, char *path)
+{
+    struct JDirIter it;
+    struct JFile *entry;
+    size_t len = strlen(path);
+
+    if (0 != mkdir(path, 0755) && EEXIST != errno)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create directory %s!\n", path);
+        return -1;
+    }
+
+    char *child = malloc(len + 1 + JFS_FILE_NAME_SIZE);
+    if (NULL == child)
+        return -1;
+
+    jfs_dir_iter_init(&it, dir, ex->sb);
+    while (NULL != (entry = jfs_dir_iter_next(&it, ex->sb)))
+    {
+        if (!host_name_ok(entry->name))
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Skip entry \"%s\" in %s, not a plain file name!\n", entry->name, path);
+            ex->rejected++;
+            continue;
+        }
+        snprintf(child, len + 1 + JFS_FILE_NAME_SIZE, "%s/%s", path, entry->name);
+        if (0 != (jfs_is_dir(entry) ? plan_dir(ex, entry, child) : add_job(ex, entry, child)))
+        {
+            free(child);
+            return -1;
+        }
+    }
+
+    free(child);
+    return 0;
+}
+
+static int32_t write_all(int fd, const uint8_t *src, uint64_t len, uint64_t offset)
+{
+    while (0 != len)
+    {
+        ssize_t ret = pwrite(fd, src, len, offset);
+        if (ret <= 0)
+            return -1;
+        src += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+///One contiguous run of the chain: kernel side copy if the filesystems allow it
+static int32_t copy_run(struct Extract *ex, int fd, int32_t block, uint64_t len, uint64_t offset)
+{
+    loff_t in = (uint8_t *)jfs_block_idx_to_ptr(block, ex->sb) - (uint8_t *)ex->sb;
+    loff_t out = offset;
+
+    while (0 != len && __atomic_load_n(&(ex->copy_range), __ATOMIC_RELAXED))
+    {
+        ssize_t ret = copy_file_range(ex->image_fd, &in, fd, &out, len, 0);
+        if (ret > 0)
+        {
+            len -= ret;
+            continue;
+        }
+        if (0 == ret || (ENOSYS != errno && EXDEV != errno && EINVAL != errno && EOPNOTSUPP != errno))
+            return -1;
+        __atomic_store_n(&(ex->copy_range), 0, __ATOMIC_RELAXED); ///Fall back to writes from the mapping
+    }
+
+    return write_all(fd, (uint8_t *)ex->sb + in, len, out);
+}
+
+///Data of compressed files is decompressed, a few clusters per write
+static int32_t extract_comp(struct Extract *ex, int fd, struct JFile *file)
+{
+    uint32_t chunk = jfs_file_comp(file)->cluster * 16;
+    uint8_t *buf = malloc(chunk);
+    int32_t ret = NULL == buf ? -1 : 0;
+
+    for (uint32_t done = 0, got = 0; 0 == ret && done < file->size; done += got)
+    {
+        ret = jfs_read_file(file, ex->sb, done, buf, chunk, &got);
+        if (0 == ret)
+            ret = write_all(fd, buf, got, done);
+    }
+    free(buf);
+
+    return ret;
+}
+
+static int32_t extract_file(struct Extract *ex, struct JFile *file, char *path)
+{
+    int32_t *fat = jfs_get_fat_ptr(ex->sb);
+    uint32_t bs = ex->sb->block_size;
+    struct JTail *tail = jfs_file_tail(file);
+    uint64_t chain_end = file->size - (NULL == tail ? 0 : tail->len);
+    uint64_t done = 0;
+    int32_t ret = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create file %s!\n", path);
+        return -1;
+    }
+
+    if (jfs_is_inline(file))
+    {
+        ret = write_all(fd, jfs_inline_data(file), file->size, 0);
+        done = file->size;
+    }
+    else if (NULL != jfs_file_comp(file))
+    {
+        ret = extract_comp(ex, fd, file);
+        done = file->size;
+    }
+
+    for (int32_t block = file->first_data_block_idx; 0 == ret && done < chain_end; )
+    {
+        uint32_t left = (chain_end - done + bs - 1) / bs;
+        uint32_t run = jfs_contig_blocks(fat, block, left);
+        uint64_t len = (uint64_t)run * bs < chain_end - done ? (uint64_t)run * bs : chain_end - done;
+
+        ret = copy_run(ex, fd, block, len, done);
+        done += len;
+        block = fat[block + run - 1];
+    }
+
+    if (0 == ret && NULL != tail)
+        ret = write_all(fd, jfs_tail_data(file, ex->sb), tail->len, chain_end);
+
+    if (0 != ret)
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't write file %s!\n", path);
+    if (0 != close(fd))
+        ret = -1;
+    return ret;
+}
+
+static void *extract_worker(void *arg)
+{
+    struct Extract *ex = arg;
+
+    for (;;)
+    {
+        uint32_t job = __atomic_fetch_add(&(ex->next), 1, __ATOMIC_RELAXED);
+        if (job >= ex->jobs_cnt || __atomic_load_n(&(ex->error), __ATOMIC_RELAXED))
+            return NULL;
+
+        if (0 != extract_file(ex, ex->jobs[job].file, ex->jobs[job].path))
+            __atomic_store_n(&(ex->error), 1, __ATOMIC_RELAXED);
+    }
+}
+
+int extract_jfs_image(char *image_name, char *jfs_path, char *dst_path, uint32_t threads)
+{
+    struct Extract ex;
+    pthread_t *workers;
+    uint32_t started = 0;
+
+    memset(&ex, 0, sizeof(ex));
+    ex.sb = jfs_mount(image_name, JFS_MOUNT_RDONLY);
+    if (NULL == ex.sb)
+        return -1;
+    ex.image_fd = jfs_get_state(ex.sb)->fd;
+    ex.copy_range = 1;
+
+    struct JFile *node = jfs_resolve_path(ex.sb, NULL == jfs_path ? "" : jfs_path);
+    if (NULL == node)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "No %s in %s!\n", jfs_path, image_name);
+        jfs_umount(ex.sb);
+        return -1;
+    }
+
+    if (0 != (jfs_is_dir(node) ? plan_dir(&ex, node, dst_path) : add_job(&ex, node, dst_path)))
+        ex.error = 1;
+
+    if (0 == threads)
+        threads = 1;
+    workers = malloc(threads * sizeof(pthread_t));
+    for (; NULL != workers && !ex.error && started < threads; started++)
+    {
+        if (0 != pthread_create(&(workers[started]), NULL, extract_worker, &ex))
+            break;
+    }
+    if (0 == started && !ex.error)
+        extract_worker(&ex);
+    for (uint32_t ii = 0; ii < started; ii++)
+        pthread_join(workers[ii], NULL);
+    free(workers);
+
+    for (uint32_t ii = 0; ii < ex.jobs_cnt; ii++)
+        free(ex.jobs[ii].path);
+    free(ex.jobs);
+    jfs_umount(ex.sb);
+
+    return ex.error || 0 != ex.rejected ? -1 : 0;
+}
@@ -0,0 +1,13 @@
+#ifndef __EXTRACT_JFS_IMAGE_H__
+#define __EXTRACT_JFS_IMAGE_H__
+
+#include <stdint.h>
+#include "jfs.h"
+
+#define JFS_EXTRACT_THREADS 4
+
+//jfs_path "" or "/" - whole image. A dir is recreated as dst_path with its
+//content inside, a single file is written to dst_path
+int extract_jfs_image(char *image_name, char *jfs_path, char *dst_path, uint32_t threads);
+
+#endif
@@ -1,11 +1,17 @@
 #include "jfs.h"
 #include "gen_jfs_image.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include "gen_jfs_tree.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 //TODO: Use inst_name
@@ -15,72 +21,134 @@
 //*((struct JFile *)(data_blocks + BLOCK_SIZE*0 + sizeof(struct JFile)*))
 //((char *)(data_blocks + 128*))
 
+static uint32_t image_flags;
+static uint32_t image_inodes;
+
+void jfs_set_image_format(uint32_t flags, uint32_t inodes)
+{
+    image_flags = flags & (JFS_FLAG_ITABLE | JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS);
+    if (image_flags & (JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS))
+        image_flags |= JFS_FLAG_ITABLE;
+    image_inodes = inodes;
+}
+
+///Inode table size for a source of entries_count files and dirs, 0 - no table
+uint32_t jfs_image_inodes(uint32_t entries_count)
+{
+    if (!(image_flags & JFS_FLAG_ITABLE))
+        return 0;
+    if (0 != image_inodes)
+        return image_inodes;
+
+    return entries_count ? entries_count : 1;
+}
+
+///Bytes of a directory entry in the images made
+uint32_t jfs_image_entry_size(void)
+{
+    return jfs_dir_entry_size(image_flags);
+}
+
+uint32_t jfs_image_system_size(uint32_t data_blocks_count, uint32_t inodes_count)
+{
+    return jfs_system_size_opts(data_blocks_count, inodes_count, image_flags);
+}
+
+void jfs_image_format(struct JSuper *sb, uint32_t block_size, uint32_t data_blocks_count, uint32_t inodes_count)
+{
+    jfs_format_opts(sb, block_size, data_blocks_count, inodes_count, image_flags);
+}
+
+///Fills plan, sets *data_blocks_count to the exact need if it is 0
+static int32_t plan_image(char *src_path, uint32_t block_size, uint32_t *data_blocks_count, struct Dir_explore *plan)
+{
+    if (block_size < jfs_image_entry_size())
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Too small block size - can't create any file!\n");
+        return -1;
+    }
+    if (0 != explore_dir(src_path, block_size, plan))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "Can't explore %s!\n", src_path);
+        return -1;
+    }
+
+    ///One spare block: a file's last block is written before its tail is packed
+    uint32_t need = plan->file_blocks + plan->dir_blocks + (0 != plan->tail_fill);
+    if (0 == *data_blocks_count)
+    {
+        *data_blocks_count = need ? need : 1;
+    }
+    else if (need > *data_blocks_count)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOSPC, "Source needs %u blocks, image has %u!\n", need, *data_blocks_count);
+        return -1;
+    }
+    uint32_t entries = plan->files + plan->dirs;
+    if ((image_flags & JFS_FLAG_ITABLE) && jfs_image_inodes(entries) < entries)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOSPC, "Source needs %u inodes, image has %u!\n", entries, jfs_image_inodes(entries));
+        return -1;
+    }
+
+    return 0;
+}
+
 int create_jfs_image(char *name, char *inst_name, char *src_path, uint32_t block_size, uint32_t data_blocks_count)
 {
     FILE *jfs_image;
     uint8_t *data_blocks, *system_data;
-    uint32_t system_data_size, data_blocks_size;
+    uint32_t system_data_size;
+    uint64_t data_blocks_size;
     struct JSuper *sb;
     int32_t *fat;
 
     size_t write_size;
+    uint8_t exact = 0 == data_blocks_count;
+
+    ///plan: exact count of blocks the tree takes
+    struct Dir_explore plan = {0, 0, 0, 0, 0};
+    if (0 != plan_image(src_path, block_size, &data_blocks_count, &plan))
+        return -1;
 
     jfs_image = fopen(name, "wb");
     if (NULL == jfs_image)
     {
-        printf("Can't create data file!\n");
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create data file!\n");
         return -1;
     }
 
     ///alloc
 
-    system_data_size = sizeof(struct JSuper) +
-                       data_blocks_count * sizeof(uint32_t); //FAT
-    data_blocks_size = data_blocks_count * block_size;
+    uint32_t inodes = jfs_image_inodes(plan.files + plan.dirs);
+    system_data_size = jfs_image_system_size(data_blocks_count, inodes);
+    data_blocks_size = (uint64_t)data_blocks_count * block_size;
 
     system_data = (uint8_t *)calloc(system_data_size + data_blocks_size, sizeof(uint8_t));
     if (NULL == system_data)
     {
-        printf("Can't alloc memory for jfs!\n");
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't alloc memory for jfs!\n");
+        fclose(jfs_image);
         return -1;
     }
 
     sb = (struct JSuper *)system_data;
-    fat = (int32_t *)(system_data + sizeof(struct JSuper));
     data_blocks = system_data + system_data_size;
 
-    ///init
-    //superblock
-    sb->block_size = block_size;
-    sb->blocks_count = data_blocks_count;
-    sb->system_bytes = system_data_size;
-    sb->total_bytes = data_blocks_count*block_size + system_data_size;
-
-    ///FAT
-    for (int ii=0; ii<(int)(data_blocks_count-1); ii++)
-    {
-        fat[ii] = ii + 1;
-    }
-    fat[data_blocks_count-1] = -1; // -1 is for no next
-    sb->first_free_block = 0;
-
-    //Root
-    //int32_t root_block = get_free_block(fat, sb);
-    //strcpy(sb->root.name, inst_name);
-    //sb->root.size = files_of_dir(name);
-    //sb->root.first_data_block_idx = 0;
-    //sb->root.flags = 1;
-    sb->root.coord.my_jfile_block = -1;
-    sb->root.coord.my_jfile_offset = 0;
-    sb->root.coord.parent_jfile_block = -1;
-    sb->root.coord.parent_jfile_offset = 0;
+    ///init: superblock, FAT, root
+    jfs_image_format(sb, block_size, data_blocks_count, inodes);
+    fat = jfs_get_fat_ptr(sb);
+    jfs_attach(sb); //Side tables make name checks O(1) while filling
+    jfs_set_alloc_cache(sb, 0); //Written out while attached, keep the free list whole
 
     ///fill
     int32_t ret = fill_jfs_image(src_path, fat, sb, data_blocks, &(sb->root), NULL);
     if (0 != ret)
     {
-        printf("Image cannot be created, see comments above!\n");
+        JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Image cannot be created, see comments above!\n");
+        jfs_detach(sb);
         free(system_data);
+        fclose(jfs_image);
         return -1;
     }
 
@@ -88,22 +156,28 @@ int create_jfs_image(char *name, char *inst_name, char *src_path, uint32_t block
     write_size = fwrite(system_data, sizeof(uint8_t), system_data_size, jfs_image);
     if (write_size < system_data_size * sizeof(uint8_t))
     {
-        printf("Can't write system data to file!\n");
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't write system data to file!\n");
+        jfs_detach(sb);
         free(system_data);
+        fclose(jfs_image);
         return -1;
     }
 
-    write_size = fwrite(data_blocks, sizeof(uint8_t), block_size * data_blocks_count, jfs_image);
-    if (write_size < system_data_size * sizeof(uint8_t))
+    write_size = fwrite(data_blocks, sizeof(uint8_t), data_blocks_size, jfs_image);
+    if (write_size < data_blocks_size * sizeof(uint8_t))
     {
-        printf("Can't write blocks to file!\n");
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't write blocks to file!\n");
+        jfs_detach(sb);
         free(system_data);
+        fclose(jfs_image);
         return -1;
     }
 
     explore_image(jfs_get_root_dir(sb), sb);
     fat_dump(sb);
 
+    printf("Blocks: %u (files %u, dirs %u), planned: %u file + %u dir blocks\n",
+           data_blocks_count, plan.files, plan.dirs, plan.file_blocks, plan.dir_blocks);
     printf("System data size: %d, JSuper block size: %lu, JFile size: %lu\n", system_data_size, sizeof(struct JSuper), sizeof(struct JFile));
     //hexdump(system_data, system_data_size);
 
@@ -126,8 +200,13 @@ int create_jfs_image(char *name, char *inst_name, char *src_path, uint32_t block
         fat_dump(sb);
     }*/
 
+    jfs_detach(sb);
     free(system_data);
     fclose(jfs_image);
+
+    ///Compressed files left free blocks all over the planned ones, a compacting rewrite drops them
+    if ((image_flags & JFS_FLAG_COMPRESS) && exact)
+        return jfs_defrag_image(name, 1);
     return 0;
 }
 
@@ -170,7 +249,7 @@ int32_t write_file_name(char *path, struct JFile *meta)
     meta->name[end - begin + 1] = '\0';
 
     ///tolower
-    for (int ii; ii<strlen(meta->name); ii++)
+    for (int ii = 0; ii<strlen(meta->name); ii++)
         meta->name[ii] = tolower(meta->name[ii]);
 
     //printf("%s\n",  meta->name);
@@ -178,126 +257,298 @@ int32_t write_file_name(char *path, struct JFile *meta)
     return 0;
 }
 
-int fill_jfs_image(char *path, int32_t *fat, struct JSuper *sb, uint8_t *data, struct JFile *meta, struct JCoord *parent)
+///Streaming build: data blocks leave memory as soon as they are written
+struct JStream
+{
+    int fd;
+    uint8_t *base;   //Image start, a reserved anonymous mapping
+    uint64_t lo, hi; //Pending data bytes, image offsets
+    uint64_t page;
+};
+
+static int32_t stream_write(struct JStream *stream, uint64_t lo, uint64_t hi)
+{
+    while (lo < hi)
+    {
+        ssize_t ret = pwrite(stream->fd, stream->base + lo, hi - lo, lo);
+        if (ret <= 0)
+        {
+            perror("Can't write image!");
+            return -1;
+        }
+        lo += ret;
+    }
+
+    return 0;
+}
+
+///Write lo..hi out and drop the pages that hold nothing else
+static int32_t stream_flush(struct JStream *stream, uint64_t hi)
+{
+    uint64_t first_page = (stream->lo + stream->page - 1) / stream->page * stream->page;
+    uint64_t last_page = hi / stream->page * stream->page;
+
+    if (0 != stream_write(stream, stream->lo, hi))
+        return -1;
+    if (first_page < last_page)
+        madvise(stream->base + first_page, last_page - first_page, MADV_DONTNEED);
+    stream->lo = hi;
+
+    return 0;
+}
+
+///Blocks first..last are final. Adjacent ranges are merged into one big write,
+///dir blocks between them stay resident until the end
+static int32_t stream_data(struct JStream *stream, struct JSuper *sb, int32_t first, int32_t last)
+{
+    if (NULL == stream || 0 > first || first > last) ///Inline files have no blocks
+        return 0;
+
+    uint64_t lo = jfs_block_idx_to_ptr(first, sb) - stream->base;
+    uint64_t hi = jfs_block_idx_to_ptr(last, sb) + sb->block_size - stream->base;
+
+    if (lo != stream->hi)
+    {
+        if (stream->lo != stream->hi && 0 != stream_flush(stream, stream->hi))
+            return -1;
+        stream->lo = lo;
+    }
+    stream->hi = hi;
+
+    if (stream->hi - stream->lo >= JFS_STREAM_CHUNK)
+        return stream_flush(stream, stream->hi / stream->page * stream->page);
+
+    return 0;
+}
+
+static int32_t stream_tail_block(struct JStream *stream, struct JSuper *sb, int32_t block)
+{
+    uint64_t lo = jfs_block_idx_to_ptr(block, sb) - stream->base;
+
+    return stream_write(stream, lo, lo + sb->block_size);
+}
+
+///Resident part: dir chains, written after all the data
+static int32_t stream_dirs(struct JStream *stream, struct JFile *dir, struct JSuper *sb)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t left = blocks_of_dir(sb->block_size, dir->size);
+    struct JDirIter it;
+    struct JFile *entry;
+
+    for (int32_t block = dir->first_data_block_idx; 0 != left; )
+    {
+        uint32_t run = jfs_contig_blocks(fat, block, left);
+        uint64_t lo = jfs_block_idx_to_ptr(block, sb) - stream->base;
+        if (0 != stream_write(stream, lo, lo + (uint64_t)run * sb->block_size))
+            return -1;
+        left -= run;
+        block = fat[block + run - 1];
+    }
+
+    jfs_dir_iter_init(&it, dir, sb);
+    while (NULL != (entry = jfs_dir_iter_next(&it, sb)))
+    {
+        if (jfs_is_dir(entry) && 0 != stream_dirs(stream, entry, sb))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int32_t copy_file_data(char *path, struct JFile *file, struct JSuper *sb, struct JStream *stream)
+{
+    uint32_t chunk = (NULL == stream ? 64 * sb->block_size : (JFS_STREAM_CHUNK / sb->block_size + 1) * sb->block_size);
+    uint8_t *data = malloc(chunk * sizeof(uint8_t));
+    if (NULL == data)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't alloc memory for file input!\n");
+        return -1;
+    }
+    size_t ret_read;
+    uint32_t was_written = 0;
+    FILE *input_file = fopen(path, "rb");
+    if (NULL == input_file)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "Can't open data file!\n");
+        free(data);
+        return -1;
+    }
+
+    ///The last block is streamed once the file is done, it may become a tail block
+    int32_t from = -1;
+    while ((ret_read = fread(data, sizeof(uint8_t), chunk, input_file)))
+    {
+        int ret = jfs_write_file(file, sb, was_written, data, ret_read);
+        if (0 > from)
+            from = file->first_data_block_idx;
+        if (ret < 0 || 0 != stream_data(stream, sb, from, file->last_data_block_idx - 1))
+        {
+            JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Can't write file data!\n");
+            free(data);
+            fclose(input_file);
+            return -1;
+        }
+        if (from < file->last_data_block_idx)
+            from = file->last_data_block_idx;
+        was_written += ret_read;
+    }
+    free(data);
+    fclose(input_file);
+
+    ///Streamed blocks are gone from memory, only in-memory builds compress
+    if ((sb->flags & JFS_FLAG_COMPRESS) && NULL == stream && 0 != jfs_compress_file(file, sb, 0))
+        return -1;
+
+    int32_t tail_block = sb->tail_block;
+    if ((sb->flags & JFS_FLAG_TAILPACK) && 0 != jfs_pack_tail(file, sb))
+        return -1;
+    if (0 != stream_data(stream, sb, from, file->last_data_block_idx))
+        return -1;
+    ///Tail blocks stay resident while they are filled
+    if (NULL != stream && tail_block != sb->tail_block && 0 <= tail_block)
+        return stream_tail_block(stream, sb, tail_block);
+    return 0;
+}
+
+///Same order as jfs_layout_tree: entries of the dir, its files' data, then subdirs.
+///On a freshly formatted image this leaves every chain sequential.
+static int32_t fill_dir(char *path, struct JSuper *sb, struct JFile *meta, struct JStream *stream)
 {
     ///init metadata
     meta->size = 0;
     meta->first_data_block_idx = -1;
-    meta->flags = 1;
+    meta->last_data_block_idx = -1;
+    meta->flags = JFS_FILE_DIR;
 
     int32_t ret = write_file_name(path, meta);
     if (ret < 0)
     {
-        printf("Incorrect file name!\n");
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Incorrect file name!\n");
         return -1;
     }
 
     ///explore content
-    struct dirent *files;
-    DIR *dp = opendir(path);
-    if (NULL == dp)
+    struct JSrcNode *node = jfs_src_node(path, 1);
+    if (NULL == node || 0 != jfs_list_dir(node))
     {
-        printf("Cant open directory: %s", path);
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "Cant open directory: %s\n", path);
+        jfs_free_tree(node);
         return -1;
     }
 
-    while (NULL != (files = readdir(dp)))
+    struct JFile **children = malloc((node->children_cnt + 1) * sizeof(struct JFile *));
+    if (NULL == children)
     {
-        char newp[1000];
-        struct stat buf;
-        if (!strcmp(files->d_name, ".") || !strcmp(files->d_name, ".."))
-        {
-            continue;
-        }
+        jfs_free_tree(node);
+        return -1;
+    }
 
-        ///new path
-        if (strlen(path) + 1 + strlen(files->d_name) >= 1000)
+    ///entries
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        children[ii] = jfs_create_file(meta, sb, node->children[ii]->name, node->children[ii]->is_dir);
+        if (NULL == children[ii])
         {
-            printf("Reach the end of the buffer size!\n");
-            return -1;
+            JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Can't create new %s!\n", node->children[ii]->is_dir ? "directory" : "file");
+            ret = -1;
         }
-        strcpy(newp, path);
-        strcat(newp, "/");
-        strcat(newp, files->d_name);
+    }
 
-        ///stat
-        if (-1 == stat(newp, &buf))
-        {
-            perror("Can't get stat!");
-            return -1;
-        }
+    ///files
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        if (!node->children[ii]->is_dir)
+            ret = copy_file_data(node->children[ii]->path, children[ii], sb, stream);
+    }
 
-        ///process child
-        if (S_ISDIR(buf.st_mode)) ///Is directory
-        {
-            int ret = -1;
-            //printf("handle dir:  '%s'\n", newp);
-            struct JFile *new_dir = jfs_create_file(meta, sb, NULL, 1); //name will be filled later
-            if (new_dir != NULL)
-                ret = fill_jfs_image(newp, fat, sb, data, new_dir, &(meta->coord));
-            if (NULL == new_dir || 0 != ret)
-            {
-                printf("Can't create new directory!\n");
-                return -1;
-            }
-        }
-        else if (S_ISREG(buf.st_mode)) ///Is file
-        {
-            //printf("handle file: '%s'\n", newp);
-            struct JFile *new_file = jfs_create_file(meta, sb, NULL, 0);
-            if (NULL == new_file)
-            {
-                printf("Can't create new file!\n");
-                return -1;
-            }
+    ///subdirs
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        if (node->children[ii]->is_dir)
+            ret = fill_dir(node->children[ii]->path, sb, children[ii], stream);
+    }
 
-            write_file_name(newp, new_file);
+    free(children);
+    jfs_free_tree(node);
+    return ret;
+}
 
-            uint8_t *data = malloc(sb->block_size * sizeof(uint8_t));
-            if (NULL == data)
-            {
-                printf("Can't alloc memory for file input!\n");
-                return -1;
-            }
-            size_t ret_read;
-            uint32_t was_written = 0;
-            FILE *input_file = fopen(newp, "rb");
-            if (NULL == input_file)
-            {
-                printf("Can't open data file!\n");
-                free(data);
-                return -1;
-            }
+int fill_jfs_image(char *path, int32_t *fat, struct JSuper *sb, uint8_t *data, struct JFile *meta, struct JCoord *parent)
+{
+    return fill_dir(path, sb, meta, NULL);
+}
 
-            while ((ret_read = fread(data, sizeof(uint8_t), sb->block_size, input_file)))
-            {
-                int ret = jfs_write_file(new_file, sb, was_written, data, ret_read);//(new_file, sb, 0, NULL, 0);
-                if (ret < 0)
-                {
-                    printf("Can't write file data!\n");
-                    free(data);
-                    return -1;
-                }
-                was_written += ret_read;
-            }
-            free(data);
-        }
-        else
-        {
-            continue;
-        }
+///Peak memory is the metadata (superblock, FATs, dir blocks) plus a few chunks:
+///the image lives in a reserved mapping and data pages are dropped once written
+int create_jfs_image_stream(char *name, char *src_path, uint32_t block_size, uint32_t data_blocks_count)
+{
+    struct Dir_explore plan = {0, 0, 0, 0, 0};
+    struct JStream stream;
+    int32_t ret = -1;
+
+    if (0 != plan_image(src_path, block_size, &data_blocks_count, &plan))
+        return -1;
+
+    uint32_t inodes = jfs_image_inodes(plan.files + plan.dirs);
+    uint64_t image_size = jfs_image_system_size(data_blocks_count, inodes) + (uint64_t)data_blocks_count * block_size;
+
+    stream.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stream.fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create data file!\n");
+        return -1;
     }
-    //printf("Add: %s\n", meta->name);
-    return 0;
+    if (0 != ftruncate(stream.fd, image_size)) ///Free blocks stay holes
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't resize %s!\n", name);
+        close(stream.fd);
+        return -1;
+    }
+
+    stream.base = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == stream.base)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't reserve memory for jfs!\n");
+        close(stream.fd);
+        return -1;
+    }
+    stream.lo = stream.hi = 0;
+    stream.page = sysconf(_SC_PAGESIZE);
+
+    struct JSuper *sb = (struct JSuper *)stream.base;
+    jfs_image_format(sb, block_size, data_blocks_count, inodes);
+    jfs_attach(sb);
+    jfs_set_alloc_cache(sb, 0);
+
+    if (0 != fill_dir(src_path, sb, &(sb->root), &stream))
+    {
+        JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Image cannot be created, see comments above!\n");
+    }
+    else if (0 == stream_flush(&stream, stream.hi) &&
+             (0 > sb->tail_block || 0 == stream_tail_block(&stream, sb, sb->tail_block)) &&
+             0 == stream_dirs(&stream, jfs_get_root_dir(sb), sb) &&
+             0 == stream_write(&stream, 0, sb->system_bytes))
+    {
+        ret = 0;
+    }
+
+    jfs_detach(sb);
+    munmap(stream.base, image_size);
+    if (0 != close(stream.fd))
+        ret = -1;
+    return ret;
 }
 
 void explore_image(struct JFile *file, struct JSuper *sb)
 {
-    if (file->flags)
+    if (jfs_is_dir(file))
     {
         struct JFile *subdir;
+        struct JDirIter it;
         int32_t offset = 0;
-        while (!jfs_read_dir(file, sb, offset, &subdir) && NULL != subdir)
+        jfs_dir_iter_init(&it, file, sb);
+        while (NULL != (subdir = jfs_dir_iter_next(&it, sb)))
         {
             printf("Name: %s, offset: %d, type: %d, size: %d\n", subdir->name, offset, subdir->flags, subdir->size);
             printf("Coord: my block %d, offset %d, parent block %d, offset %d\n",
@@ -321,17 +572,30 @@ void explore_image(struct JFile *file, struct JSuper *sb)
         {
             printf("Nothing was read!\n");
         }
+        else if (jfs_is_inline(file))
+        {
+            printf("Inline\n");
+            for (int32_t ii = 0; ii < file->size; ii++)
+                printf("%c", read_data[ii]);
+            printf("\n");
+        }
         else
         {
             printf("Blocks: ");
             int32_t block = file->first_data_block_idx;
             int32_t *fat = jfs_get_fat_ptr(sb);
-            while (-1 != fat[block])
+            while (0 <= block && -1 != fat[block])
             {
                 printf("%d, ", block);
                 block = fat[block];
             }
             printf("%d\n", block);
+            if (NULL != jfs_file_tail(file))
+                printf("Tail: block %d, offset %u, len %u\n",
+                       jfs_file_tail(file)->block, jfs_file_tail(file)->offset, jfs_file_tail(file)->len);
+            if (NULL != jfs_file_comp(file))
+                printf("Compressed: %u bytes stored, clusters of %u\n",
+                       jfs_file_comp(file)->stored, jfs_file_comp(file)->cluster);
 
             for (int32_t ii = 0; ii < file->size; ii++)
                 printf("%c", read_data[ii]);
@@ -349,126 +613,85 @@ void fat_dump(struct JSuper *sb)
 
     printf("FAT:\n");
     printf("\t-1: %d\n", sb->first_free_block);
-    for (int ii = 0; ii < 11/*sb->blocks_count*/; ii++)
+    for (int ii = 0; ii < 11 && ii < (int)sb->blocks_count; ii++)
         printf("\t%d: %d\n", ii, fat[ii]);
     return;
 }
 
-/*
-inline uint32_t blocks_of_dir(uint32_t block_size, uint32_t files_cnt)
+///Dir entries never straddle a block
+uint32_t blocks_of_dir(uint32_t block_size, uint32_t files_cnt)
 {
-    return sizeof(struct JFile) * files_cnt / block_size +
-           ((sizeof(struct JFile) * files_cnt) % block_size != 0);
+    uint32_t fit = block_size / jfs_image_entry_size();
+
+    if (0 == fit)
+        return files_cnt;
+
+    return files_cnt / fit + (files_cnt % fit != 0);
 }
 
-uint32_t files_of_dir(char *path)
+///Inline files take none. tail_fill - state of the plan for JFS_FLAG_TAILPACK
+///images, files must come in build order
+uint32_t jfs_image_file_blocks(uint32_t size, uint32_t block_size, uint32_t *tail_fill)
 {
-    struct dirent *files;
-    DIR *dp = opendir(path);
-    uint32_t ret = 0;
+    if ((image_flags & JFS_FLAG_INLINE) && size <= JFS_INLINE_SIZE)
+        return 0;
+    if (image_flags & JFS_FLAG_TAILPACK)
+        return size / block_size + jfs_tail_plan(tail_fill, size % block_size, block_size);
 
-    while (NULL != (files = readdir(dp)))
-    {
-        char newp[1000];
-        struct stat buf;
-        if (!strcmp(files->d_name, ".") || !strcmp(files->d_name, ".."))
-        {
-            continue;
-        }
+    return size / block_size + (size % block_size != 0);
+}
 
-        strcpy(newp, path);
-        strcat(newp, "/");
-        strcat(newp, files->d_name);
+uint32_t files_of_dir(char *path)
+{
+    struct JSrcNode *node = jfs_src_node(path, 1);
+    uint32_t ret = 0;
 
-        if (-1 == stat(newp, &buf))
-        {
-            perror("Can't get stat!");
-            return -1;
-        }
-        if (S_ISDIR(buf.st_mode) || S_ISREG(buf.st_mode))
-            ret++;
-    }
+    if (NULL != node && 0 == jfs_list_dir(node))
+        ret = node->children_cnt;
 
+    jfs_free_tree(node);
     return ret;
 }
 
-struct Dir_explore explore_dir(char *pth, uint32_t block_size)
+///Planning pass, stat only. Adds the counts of the tree under pth to *ret
+int32_t explore_dir(char *pth, uint32_t block_size, struct Dir_explore *ret)
 {
-    char path[1000];
-    strcpy(path, pth);
-    DIR *dp;
-    struct dirent *files;
-    struct Dir_explore ret;
-    uint32_t dir_file_size, total = 0;
-
-    ret.files = 0;
-    ret.dirs = 0;
-    ret.file_blocks = 0;
-    ret.dir_blocks = 0;
+    struct JSrcNode *node = jfs_src_node(pth, 1);
+    int32_t err = 0;
 
-    if (NULL == (dp = opendir(path)))
+    if (NULL == node || 0 != jfs_list_dir(node))
     {
         perror("Can't open directory!");
+        jfs_free_tree(node);
+        return -1;
     }
 
-    char newp[1000];
-    struct stat buf;
-    while (NULL != (files = readdir(dp)))
+    ///Build order: files of the dir, then subdirs
+    ret->dir_blocks += blocks_of_dir(block_size, node->children_cnt);
+    for (uint32_t ii = 0; ii < node->children_cnt; ii++)
     {
-        if (!strcmp(files->d_name, ".") || !strcmp(files->d_name, ".."))
-        {
-            continue;
-        }
-
-        strcpy(newp, path);
-        strcat(newp, "/");
-        strcat(newp, files->d_name);
-        //~ printf("%s\n", newp);
-
-        if (-1 == stat(newp, &buf))
-        {
-            perror("Can't get stat!");
-        }
-
-        if (S_ISDIR(buf.st_mode))
-        {
-            struct Dir_explore sub_ret;
-            ret.dirs++;
-            total++;
-
-            // if directory, then add a "/" to current path
-            strcat(path,"/");
-            strcat(path,files->d_name);
-            sub_ret = explore_dir(path, block_size);
-            strcpy(path, pth);
-
-            ret.files += sub_ret.files;
-            ret.dirs += sub_ret.dirs;
-            ret.file_blocks += sub_ret.file_blocks;
-            ret.dir_blocks += sub_ret.dir_blocks;
-        }
-        else if (S_ISREG(buf.st_mode))
+        struct JSrcNode *child = node->children[ii];
+        if (!child->is_dir)
         {
-            total++;
-            ret.files++;
-            ret.file_blocks += buf.st_size / block_size +
-                               (buf.st_size % block_size != 0);
-            //~ printf("size: %d\n", buf.st_size);
+            ret->files++;
+            ret->file_blocks += jfs_image_file_blocks(child->size, block_size, &(ret->tail_fill));
         }
-        else
+    }
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == err; ii++)
+    {
+        struct JSrcNode *child = node->children[ii];
+        if (child->is_dir)
         {
-            printf("Not a file!\n");
+            ret->dirs++;
+            err = explore_dir(child->path, block_size, ret);
         }
     }
 
-    //~ printf("total = %d, size = %d, blocks = %d\n", total,
-                //~ dir_file_size, blocks_of_dir(block_size, total));
-    ret.dir_blocks += blocks_of_dir(block_size, total);
-
-    closedir(dp);
-    return ret;
+    jfs_free_tree(node);
+    return err;
 }
 
+/*
 void hexdump(const void* addr, int len)
 {
     int                  i;
@@ -5,21 +5,39 @@
 #include "jfs.h"
 
 #define BLOCK_SIZE 256
-#define BLOCKS_CNT 40
+#define BLOCKS_CNT 0 //0 - exactly as many as the source tree needs
+#define JFS_STREAM_CHUNK (8u << 20) //Data bytes gathered per write in streaming builds
 
 struct Dir_explore
 {
-    uint16_t files;
-    uint16_t dirs;
-    uint16_t file_blocks;
-    uint16_t dir_blocks;
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t file_blocks;
+    uint32_t dir_blocks;
+    uint32_t tail_fill; //Bytes of the open tail block while planning JFS_FLAG_TAILPACK images
 };
 
+//Format of the images the builders make. flags: JFS_FLAG_ITABLE, JFS_FLAG_COMPACT,
+//JFS_FLAG_INLINE, JFS_FLAG_TAILPACK, JFS_FLAG_COMPRESS (all imply the table),
+//0 - classic. inodes 0 - exactly as many as the source has entries. With
+//JFS_FLAG_TAILPACK every file is packed (jfs_pack_tail) once written. With
+//JFS_FLAG_COMPRESS create_jfs_image compresses every file (jfs_compress_file)
+//before that and, for BLOCKS_CNT 0, compacts the image to the blocks it uses;
+//the streaming and parallel builders keep files plain
+void jfs_set_image_format(uint32_t flags, uint32_t inodes);
+uint32_t jfs_image_inodes(uint32_t entries_count);
+uint32_t jfs_image_entry_size(void);
+uint32_t jfs_image_system_size(uint32_t data_blocks_count, uint32_t inodes_count);
+void jfs_image_format(struct JSuper *sb, uint32_t block_size, uint32_t data_blocks_count, uint32_t inodes_count);
+
 //Should set up BLOCK_SIZE, BLOCKS_CNT instead of block_size, data_blocks_count
 int create_jfs_image(char *file_name, char *inst_name, char *src_path, uint32_t block_size, uint32_t data_blocks_count);
-struct Dir_explore explore_dir(char *pth, uint32_t block_size);
+int create_jfs_image_stream(char *file_name, char *src_path, uint32_t block_size, uint32_t data_blocks_count);
+int create_jfs_image_parallel(char *file_name, char *src_path, uint32_t block_size, uint32_t data_blocks_count, uint32_t threads);
+int32_t explore_dir(char *pth, uint32_t block_size, struct Dir_explore *ret);
 //void hexdump(const void* addr, int len);
 uint32_t blocks_of_dir(uint32_t block_size, uint32_t files_cnt);
+uint32_t jfs_image_file_blocks(uint32_t size, uint32_t block_size, uint32_t *tail_fill);
 uint32_t files_of_dir(char *name);
 int fill_jfs_image(char *path, int32_t *fat, struct JSuper *sb, uint8_t *data, struct JFile *meta, struct JCoord *parent);
 int32_t write_file_name(char *path, struct JFile *meta);
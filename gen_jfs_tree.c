@@ -0,0 +1,471 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include "gen_jfs_image.h"
+#include "gen_jfs_tree.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+///Parallel scan: workers take nodes from a shared stack. A directory job lists
+///and stats its entries and pushes them back, a file job reads the content.
+
+struct Scan
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct JSrcNode **stack;
+    uint32_t top;
+    uint32_t cap;
+    uint32_t pending; //Jobs queued or being processed
+    int error;
+};
+
+struct JSrcNode *jfs_src_node(char *path, uint8_t is_dir)
+{
+    struct JSrcNode *node = calloc(1, sizeof(struct JSrcNode));
+    struct JFile name_holder;
+
+    if (NULL == node)
+        return NULL;
+
+    node->path = strdup(path);
+    if (NULL == node->path || 0 != write_file_name(path, &name_holder))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Incorrect file name: %s!\n", path);
+        free(node->path);
+        free(node);
+        return NULL;
+    }
+    strcpy(node->name, name_holder.name);
+    node->is_dir = is_dir;
+
+    return node;
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct JSrcNode **)a)->name, (*(struct JSrcNode **)b)->name);
+}
+
+static int32_t scan_push(struct Scan *scan, struct JSrcNode **nodes, uint32_t cnt)
+{
+    pthread_mutex_lock(&(scan->lock));
+    if (scan->top + cnt > scan->cap)
+    {
+        uint32_t cap = scan->cap ? scan->cap : 256;
+        while (cap < scan->top + cnt)
+            cap *= 2;
+        struct JSrcNode **stack = realloc(scan->stack, cap * sizeof(struct JSrcNode *));
+        if (NULL == stack)
+        {
+            scan->error = 1;
+            pthread_cond_broadcast(&(scan->cond));
+            pthread_mutex_unlock(&(scan->lock));
+            return -1;
+        }
+        scan->stack = stack;
+        scan->cap = cap;
+    }
+    memcpy(scan->stack + scan->top, nodes, cnt * sizeof(struct JSrcNode *));
+    scan->top += cnt;
+    scan->pending += cnt;
+    pthread_cond_broadcast(&(scan->cond));
+    pthread_mutex_unlock(&(scan->lock));
+
+    return 0;
+}
+
+///Stat one level of node->path into node->children, sorted by name
+int32_t jfs_list_dir(struct JSrcNode *node)
+{
+    struct dirent *files;
+    DIR *dp = opendir(node->path);
+    if (NULL == dp)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "Cant open directory: %s\n", node->path);
+        return -1;
+    }
+
+    while (NULL != (files = readdir(dp)))
+    {
+        struct stat buf;
+        if (!strcmp(files->d_name, ".") || !strcmp(files->d_name, ".."))
+        {
+            continue;
+        }
+
+        size_t len = strlen(node->path) + 1 + strlen(files->d_name) + 1;
+        char *newp = malloc(len);
+        if (NULL == newp)
+        {
+            closedir(dp);
+            return -1;
+        }
+        snprintf(newp, len, "%s/%s", node->path, files->d_name);
+
+        if (-1 == stat(newp, &buf))
+        {
+            perror("Can't get stat!");
+            free(newp);
+            closedir(dp);
+            return -1;
+        }
+
+        if (!S_ISDIR(buf.st_mode) && !S_ISREG(buf.st_mode))
+        {
+            free(newp);
+            continue;
+        }
+
+        if (S_ISREG(buf.st_mode) && buf.st_size > UINT32_MAX)
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_FBIG, "Too big file: %s!\n", newp);
+            free(newp);
+            closedir(dp);
+            return -1;
+        }
+
+        struct JSrcNode *child = jfs_src_node(newp, S_ISDIR(buf.st_mode));
+        free(newp);
+        if (NULL == child)
+        {
+            closedir(dp);
+            return -1;
+        }
+        child->size = child->is_dir ? 0 : buf.st_size;
+
+        if (node->children_cnt == node->children_cap)
+        {
+            uint32_t cap = node->children_cap ? 2 * node->children_cap : 16;
+            struct JSrcNode **children = realloc(node->children, cap * sizeof(struct JSrcNode *));
+            if (NULL == children)
+            {
+                jfs_free_tree(child);
+                closedir(dp);
+                return -1;
+            }
+            node->children = children;
+            node->children_cap = cap;
+        }
+        node->children[node->children_cnt++] = child;
+    }
+    closedir(dp);
+
+    qsort(node->children, node->children_cnt, sizeof(struct JSrcNode *), node_cmp);
+    for (uint32_t ii = 1; ii < node->children_cnt; ii++)
+    {
+        if (0 == strcmp(node->children[ii - 1]->name, node->children[ii]->name))
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_EXIST, "File %s already exists!\n", node->children[ii]->path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t scan_dir(struct Scan *scan, struct JSrcNode *node)
+{
+    if (0 != jfs_list_dir(node))
+        return -1;
+
+    return node->children_cnt ? scan_push(scan, node->children, node->children_cnt) : 0;
+}
+
+static int32_t scan_file(struct JSrcNode *node)
+{
+    uint32_t was_read = 0;
+
+    if (0 == node->size)
+        return 0;
+
+    node->data = malloc(node->size);
+    int fd = open(node->path, O_RDONLY);
+    if (NULL == node->data || fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't read data file %s!\n", node->path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    while (was_read < node->size)
+    {
+        ssize_t ret = read(fd, node->data + was_read, node->size - was_read);
+        if (0 > ret && EINTR == errno)
+            continue;
+        if (0 > ret)
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't read data file %s!\n", node->path);
+            close(fd);
+            return -1;
+        }
+        if (0 == ret)
+            break; //File shrank, keep what is there
+        was_read += ret;
+    }
+    close(fd);
+    node->size = was_read;
+
+    return 0;
+}
+
+static void *scan_worker(void *arg)
+{
+    struct Scan *scan = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&(scan->lock));
+        while (0 == scan->top && 0 != scan->pending && !scan->error)
+            pthread_cond_wait(&(scan->cond), &(scan->lock));
+        if (0 == scan->top || scan->error)
+        {
+            pthread_mutex_unlock(&(scan->lock));
+            return NULL;
+        }
+        struct JSrcNode *node = scan->stack[--scan->top];
+        pthread_mutex_unlock(&(scan->lock));
+
+        int32_t ret = node->is_dir ? scan_dir(scan, node) : scan_file(node);
+
+        pthread_mutex_lock(&(scan->lock));
+        if (0 != ret)
+            scan->error = 1;
+        scan->pending--;
+        if (0 == scan->pending || scan->error)
+            pthread_cond_broadcast(&(scan->cond));
+        pthread_mutex_unlock(&(scan->lock));
+    }
+}
+
+///Read the whole source tree, content included, with threads workers
+struct JSrcNode *jfs_scan_tree(char *src_path, uint32_t threads)
+{
+    struct Scan scan;
+    pthread_t *workers;
+    uint32_t started = 0;
+
+    struct JSrcNode *root = jfs_src_node(src_path, 1);
+    if (NULL == root)
+        return NULL;
+
+    if (0 == threads)
+        threads = 1;
+    workers = malloc(threads * sizeof(pthread_t));
+    if (NULL == workers)
+    {
+        jfs_free_tree(root);
+        return NULL;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&(scan.lock), NULL);
+    pthread_cond_init(&(scan.cond), NULL);
+    scan_push(&scan, &root, 1);
+
+    for (; started < threads; started++)
+    {
+        if (0 != pthread_create(&(workers[started]), NULL, scan_worker, &scan))
+            break;
+    }
+    if (0 == started)
+        scan_worker(&scan);
+    for (uint32_t ii = 0; ii < started; ii++)
+        pthread_join(workers[ii], NULL);
+
+    pthread_mutex_destroy(&(scan.lock));
+    pthread_cond_destroy(&(scan.cond));
+    free(scan.stack);
+    free(workers);
+
+    if (scan.error)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOENT, "Can't scan %s!\n", src_path);
+        jfs_free_tree(root);
+        return NULL;
+    }
+
+    return root;
+}
+
+void jfs_free_tree(struct JSrcNode *node)
+{
+    if (NULL == node)
+        return;
+
+    for (uint32_t ii = 0; ii < node->children_cnt; ii++)
+        jfs_free_tree(node->children[ii]);
+    free(node->children);
+    free(node->data);
+    free(node->path);
+    free(node);
+}
+
+///Layout order of layout_dir: files of the dir, then subdirs
+static uint32_t plan_dir(struct JSrcNode *node, uint32_t block_size, uint32_t *tail_fill)
+{
+    uint32_t blocks = blocks_of_dir(block_size, node->children_cnt);
+
+    for (uint32_t ii = 0; ii < node->children_cnt; ii++)
+        if (!node->children[ii]->is_dir)
+            blocks += jfs_image_file_blocks(node->children[ii]->size, block_size, tail_fill);
+    for (uint32_t ii = 0; ii < node->children_cnt; ii++)
+        if (node->children[ii]->is_dir)
+            blocks += plan_dir(node->children[ii], block_size, tail_fill);
+
+    return blocks;
+}
+
+///Exact data blocks the tree takes: entry blocks of every dir plus file chains,
+///and tail blocks with one spare block to write a tail before it is packed
+uint32_t jfs_plan_tree(struct JSrcNode *node, uint32_t block_size)
+{
+    uint32_t tail_fill = 0;
+    uint32_t blocks = plan_dir(node, block_size, &tail_fill);
+
+    return blocks + (0 != tail_fill);
+}
+
+///Files and dirs below node
+static uint32_t count_tree(struct JSrcNode *node)
+{
+    uint32_t cnt = node->children_cnt;
+
+    for (uint32_t ii = 0; ii < node->children_cnt; ii++)
+        cnt += count_tree(node->children[ii]);
+
+    return cnt;
+}
+
+///On a fresh image every allocation comes from the head of one free extent,
+///so creating all entries first keeps the dir chain sequential, then each
+///file chain follows it, then subdirs are laid out depth-first.
+static int32_t layout_dir(struct JSrcNode *node, struct JFile *dir, struct JSuper *sb)
+{
+    struct JFile **files = malloc((node->children_cnt + 1) * sizeof(struct JFile *));
+    int32_t ret = 0;
+
+    if (NULL == files)
+        return -1;
+
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        files[ii] = jfs_create_file(dir, sb, node->children[ii]->name, node->children[ii]->is_dir);
+        if (NULL == files[ii])
+        {
+            JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Can't create %s!\n", node->children[ii]->path);
+            ret = -1;
+        }
+    }
+
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        struct JSrcNode *child = node->children[ii];
+        if (!child->is_dir && 0 != child->size && (0 > jfs_write_file(files[ii], sb, 0, child->data, child->size) ||
+                                                   ((sb->flags & JFS_FLAG_TAILPACK) && 0 != jfs_pack_tail(files[ii], sb))))
+        {
+            JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Can't write file data of %s!\n", child->path);
+            ret = -1;
+        }
+    }
+
+    for (uint32_t ii = 0; ii < node->children_cnt && 0 == ret; ii++)
+    {
+        if (node->children[ii]->is_dir)
+            ret = layout_dir(node->children[ii], files[ii], sb);
+    }
+
+    free(files);
+    return ret;
+}
+
+///Serial and deterministic: same tree gives byte-identical images
+int32_t jfs_layout_tree(struct JSrcNode *root, struct JSuper *sb)
+{
+    strcpy(sb->root.name, root->name);
+
+    return layout_dir(root, jfs_get_root_dir(sb), sb);
+}
+
+int create_jfs_image_parallel(char *name, char *src_path, uint32_t block_size, uint32_t data_blocks_count, uint32_t threads)
+{
+    int32_t ret = -1;
+
+    if (block_size < jfs_image_entry_size())
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Too small block size - can't create any file!\n");
+        return -1;
+    }
+
+    struct JSrcNode *root = jfs_scan_tree(src_path, threads);
+    if (NULL == root)
+        return -1;
+
+    uint32_t need = jfs_plan_tree(root, block_size);
+    if (0 == data_blocks_count)
+    {
+        data_blocks_count = need ? need : 1;
+    }
+    else if (need > data_blocks_count)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOSPC, "Source needs %u blocks, image has %u!\n", need, data_blocks_count);
+        jfs_free_tree(root);
+        return -1;
+    }
+
+    uint32_t entries = count_tree(root);
+    uint32_t inodes = jfs_image_inodes(entries);
+    if (inodes && inodes < entries)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOSPC, "Source needs %u inodes, image has %u!\n", entries, inodes);
+        jfs_free_tree(root);
+        return -1;
+    }
+
+    uint32_t system_data_size = jfs_image_system_size(data_blocks_count, inodes);
+    uint64_t image_size = system_data_size + (uint64_t)data_blocks_count * block_size;
+
+    uint8_t *image = calloc(image_size, sizeof(uint8_t));
+    if (NULL == image)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't alloc memory for jfs!\n");
+        jfs_free_tree(root);
+        return -1;
+    }
+
+    struct JSuper *sb = (struct JSuper *)image;
+    jfs_image_format(sb, block_size, data_blocks_count, inodes);
+    jfs_attach(sb);
+    jfs_set_alloc_cache(sb, 0); //Written out while attached, keep the free list whole
+
+    if (0 != jfs_layout_tree(root, sb))
+    {
+        JFS_LOG(JFS_LOG_ERROR, JFS_LOG_IMAGE, "Image cannot be created, see comments above!\n");
+    }
+    else
+    {
+        FILE *jfs_image = fopen(name, "wb");
+        if (NULL == jfs_image)
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create data file!\n");
+        else if (fwrite(image, sizeof(uint8_t), image_size, jfs_image) < image_size)
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't write image to file!\n");
+        else
+            ret = 0;
+        if (NULL != jfs_image && 0 != fclose(jfs_image))
+            ret = -1;
+    }
+
+    jfs_detach(sb);
+    free(image);
+    jfs_free_tree(root);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef __GEN_JFS_TREE_H__
+#define __GEN_JFS_TREE_H__
+
+#include <stdint.h>
+#include "jfs.h"
+
+//Source tree as seen by the image builders. Children are sorted by name,
+//so the image layout does not depend on readdir order or thread timing.
+struct JSrcNode
+{
+    char name[JFS_FILE_NAME_SIZE];
+    char *path;
+    uint8_t is_dir;
+    uint32_t size;
+    uint8_t *data;                  //File content, NULL for dirs and empty files
+    uint32_t children_cnt;
+    uint32_t children_cap;
+    struct JSrcNode **children;
+};
+
+struct JSrcNode *jfs_src_node(char *path, uint8_t is_dir);
+int32_t jfs_list_dir(struct JSrcNode *node);
+struct JSrcNode *jfs_scan_tree(char *src_path, uint32_t threads);
+uint32_t jfs_plan_tree(struct JSrcNode *node, uint32_t block_size);
+void jfs_free_tree(struct JSrcNode *node);
+int32_t jfs_layout_tree(struct JSrcNode *root, struct JSuper *sb);
+
+#endif
@@ -1,411 +1,2264 @@
 #include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
+uint32_t jfs_log_level = JFS_LOG_LEVEL;
+uint32_t jfs_log_mask = JFS_LOG_ALL;
+static FILE *log_out;
+static __thread int32_t last_error;
+
+///Set before the threads start, messages are not ordered against a change
+void jfs_set_log(uint32_t level, uint32_t mask, FILE *out)
+{
+    jfs_log_level = level;
+    jfs_log_mask = mask;
+    if (NULL != out)
+        log_out = out;
+}
+
+void jfs_log_write(uint32_t level, uint32_t category, const char *fmt, ...)
+{
+    va_list args;
+
+    (void)level;
+    (void)category;
+    va_start(args, fmt);
+    vfprintf(NULL == log_out ? stdout : log_out, fmt, args);
+    va_end(args);
+}
+
+void jfs_set_error(int32_t code)
+{
+    last_error = code;
+}
+
+int32_t jfs_last_error(void)
+{
+    return last_error;
+}
+
+const char *jfs_strerror(int32_t code)
+{
+    static const char *const text[] = {
+        [JFS_OK] = "Success",
+        [JFS_ERR_NOMEM] = "Out of memory",
+        [JFS_ERR_NOSPC] = "No free blocks left",
+        [JFS_ERR_EXIST] = "File exists",
+        [JFS_ERR_NOENT] = "No such file",
+        [JFS_ERR_ROFS] = "Image is mounted read-only",
+        [JFS_ERR_INVAL] = "Invalid argument",
+        [JFS_ERR_TYPE] = "Wrong file type",
+        [JFS_ERR_FBIG] = "File too big",
+        [JFS_ERR_BUSY] = "Namespace or image busy",
+        [JFS_ERR_IO] = "I/O error",
+        [JFS_ERR_CORRUPT] = "Broken image",
+    };
+
+    if (code < 0 || (uint32_t)code >= sizeof(text) / sizeof(text[0]))
+        return "Unknown error";
+    return text[code];
+}
+
+///Namespace mutators hold the namespace exclusively. A thread inside only
+///jfs_ns_read_lock() would wait for itself, so it is refused instead
+static int32_t ns_write_enter(struct JSuper *sb)
+{
+    if (jfs_ns_in_read(sb))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_BUSY, "Namespace is pinned by this thread, can't change it!\n");
+        return -1;
+    }
+
+    jfs_ns_write_lock(sb);
+    return 0;
+}
+
+///Superblock, FAT and reverse FAT
+uint32_t jfs_system_size(uint32_t blocks_count)
+{
+    return jfs_system_size_inodes(blocks_count, 0);
+}
+
+///Superblock, FAT, reverse FAT and inode table
+uint32_t jfs_system_size_inodes(uint32_t blocks_count, uint32_t inodes_count)
+{
+    return jfs_system_size_opts(blocks_count, inodes_count, 0);
+}
+
+uint32_t jfs_system_size_opts(uint32_t blocks_count, uint32_t inodes_count, uint32_t flags)
+{
+    return sizeof(struct JSuper) + 2 * blocks_count * sizeof(int32_t) + inodes_count * jfs_inode_size(flags);
+}
+
+///Bytes of one inode table record, JFS_FLAG_INLINE ones carry the data area,
+///JFS_FLAG_TAILPACK and JFS_FLAG_COMPRESS ones at least a JTail (a JComp is
+///smaller). A file has one of them or none
+uint32_t jfs_inode_size(uint32_t flags)
+{
+    if (flags & JFS_FLAG_INLINE)
+        return sizeof(struct JFile) + JFS_INLINE_SIZE;
+    return sizeof(struct JFile) + (flags & (JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS) ? sizeof(struct JTail) : 0);
+}
+
+void jfs_format(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count)
+{
+    jfs_format_inodes(sb, block_size, blocks_count, 0);
+}
+
+///inodes_count 0 - no inode table, entries live in the directory blocks
+void jfs_format_inodes(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count, uint32_t inodes_count)
+{
+    jfs_format_opts(sb, block_size, blocks_count, inodes_count, 0);
+}
+
+///flags - JFS_FLAG_COMPACT, JFS_FLAG_INLINE, JFS_FLAG_TAILPACK, JFS_FLAG_COMPRESS or 0, they are dropped without an inode table
+void jfs_format_opts(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count, uint32_t inodes_count, uint32_t flags)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat;
+
+    sb->magic = JFS_MAGIC;
+    sb->version = JFS_VERSION;
+    sb->block_size = block_size;
+    sb->blocks_count = blocks_count;
+    sb->flags = 0 != inodes_count ? JFS_FLAG_ITABLE | (flags & (JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS)) : 0;
+    sb->system_bytes = jfs_system_size_opts(blocks_count, inodes_count, sb->flags);
+    sb->total_bytes = (uint64_t)blocks_count * block_size + sb->system_bytes;
+
+    ///Whole data area is one free extent
+    rfat = jfs_get_rfat_ptr(sb);
+    fat[0] = -1; // -1 is for no next
+    rfat[0] = blocks_count;
+    sb->first_free_block = 0;
+    sb->free_blocks = blocks_count;
+    sb->data_bytes = 0;
+    sb->journal_bytes = 0;
+    sb->tail_block = -1;
+
+    sb->root.size = 0;
+    sb->root.first_data_block_idx = -1;
+    sb->root.last_data_block_idx = -1;
+    sb->root.flags = JFS_FILE_DIR;
+    sb->root.coord.my_jfile_block = -1;
+    sb->root.coord.my_jfile_offset = 0;
+    sb->root.coord.parent_jfile_block = -1;
+    sb->root.coord.parent_jfile_offset = 0;
+
+    ///All inodes are free, chained in order
+    sb->inodes_count = inodes_count;
+    sb->free_inode = 0 != inodes_count ? 0 : -1;
+    for (uint32_t ii = 0; ii < inodes_count; ii++)
+    {
+        struct JFile *inode = jfs_get_inode(sb, ii);
+        inode->flags = JFS_INODE_FREE;
+        inode->first_data_block_idx = ii + 1 < inodes_count ? (int32_t)ii + 1 : -1;
+    }
+}
+
+///Free space is a list of extents (runs of contiguous free blocks).
+///For the first block of each extent fat[] keeps the next extent and
+///rfat[] keeps the extent length; other free blocks hold garbage.
+
+static uint32_t take_from_extent(struct JSuper *sb, int32_t start, uint32_t count);
+
+///Longest free run the free map knows of, up to want blocks. The list is
+///relinked first when frees left touching extents in it
+static int32_t get_free_run(struct JSuper *sb, uint32_t want, uint32_t *got)
+{
+    struct JState *st = jfs_get_state(sb);
+    uint32_t largest = jfs_largest_free_run(sb);
+
+    if (st->free_split)
+        jfs_free_list_relink(sb);
+
+    int32_t start = jfs_find_free_run(sb, largest < want ? largest : want);
+    *got = 0 > start ? 0 : take_from_extent(sb, start, largest < want ? largest : want);
+    if (0 == *got)
+        return -1;
+
+    __atomic_sub_fetch(&(sb->free_blocks), *got, __ATOMIC_RELAXED);
+    jfs_free_map_update(sb, start, *got, 0);
+    return start;
+}
+
+///Take up to want contiguous blocks, prefer the first extent that fits whole
+static int32_t get_free_extent(struct JSuper *sb, uint32_t want, uint32_t *got)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    int32_t prev = -1, best = -1, best_prev = -1;
+    int32_t ext = sb->first_free_block;
+
+    if (0 == want)
+        want = 1;
+
+    for (int ii = 0; ii < JFS_EXTENT_SCAN && 0 <= ext; ii++)
+    {
+        if (0 > best || rfat[ext] > rfat[best])
+        {
+            best = ext;
+            best_prev = prev;
+        }
+        if ((uint32_t)rfat[ext] >= want)
+            break;
+
+        prev = ext;
+        ext = jfs_fat_next(fat, ext);
+    }
+
+    if (0 > best)
+    {
+        *got = 0;
+        return -1;
+    }
+
+    ///The scanned extents are short of want, the free map may know a longer run
+    if ((uint32_t)rfat[best] < want && NULL != jfs_get_state(sb) &&
+        jfs_largest_free_run(sb) > (uint32_t)rfat[best])
+        return get_free_run(sb, want, got);
+
+    uint32_t len = rfat[best];
+    int32_t rest = fat[best];
+
+    *got = len > want ? want : len;
+    if (len > *got) ///Split: the tail stays free
+    {
+        rest = best + *got;
+        fat[rest] = fat[best];
+        rfat[rest] = len - *got;
+        jfs_dirty_fat(sb, rest, 1);
+    }
+
+    if (0 > best_prev)
+        sb->first_free_block = rest;
+    else
+        fat[best_prev] = rest;
+    jfs_dirty_fat(sb, best_prev, 1);
+
+    __atomic_sub_fetch(&(sb->free_blocks), *got, __ATOMIC_RELAXED);
+    jfs_free_map_update(sb, best, *got, 0);
+
+    return best;
+}
+
+///Only the head extent merges here, walking the list for other neighbours
+///would cost every free. Touching extents are left for get_free_run
+static void return_free_extent(struct JSuper *sb, int32_t start, uint32_t count)
+{
+    struct JState *st = jfs_get_state(sb);
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    int32_t head = sb->first_free_block;
+
+    if (start < 0 || 0 == count)
+    {
+        return;
+    }
+
+    __atomic_add_fetch(&(sb->free_blocks), count, __ATOMIC_RELAXED);
+    if (NULL != st && (1 == jfs_free_map_test(sb, start - 1) || 1 == jfs_free_map_test(sb, start + count)))
+        st->free_split = 1;
+    jfs_free_map_update(sb, start, count, 1);
+
+    if (0 <= head && (uint32_t)(head + rfat[head]) == (uint32_t)start) ///Grow head extent forward
+    {
+        rfat[head] += count;
+        jfs_dirty_fat(sb, head, 1);
+        return;
+    }
+
+    if (0 <= head && (uint32_t)start + count == (uint32_t)head) ///Grow head extent backward
+    {
+        fat[start] = fat[head];
+        rfat[start] = count + rfat[head];
+    }
+    else
+    {
+        fat[start] = head;
+        rfat[start] = count;
+    }
+    jfs_dirty_fat(sb, start, 1);
+    sb->first_free_block = start;
+}
+
+///Take start..start+count-1 out of the extent that holds start, at most up to
+///its end. Returns blocks taken, 0 if start is not free
+static uint32_t take_from_extent(struct JSuper *sb, int32_t start, uint32_t count)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    int32_t prev = -1;
+
+    for (int32_t ext = sb->first_free_block; 0 <= ext; prev = ext, ext = jfs_fat_next(fat, ext))
+    {
+        if (start < ext || start >= ext + rfat[ext])
+            continue;
+
+        uint32_t len = rfat[ext];
+        int32_t next = fat[ext];
+        int32_t rest = start + count;
+
+        if ((uint32_t)(rest - ext) >= len)
+        {
+            rest = ext + len;
+        }
+        else ///Tail stays free
+        {
+            fat[rest] = next;
+            rfat[rest] = len - (rest - ext);
+            jfs_dirty_fat(sb, rest, 1);
+            next = rest;
+        }
+
+        if (start > ext) ///Head stays free
+        {
+            rfat[ext] = start - ext;
+            fat[ext] = next;
+            jfs_dirty_fat(sb, ext, 1);
+        }
+        else if (0 > prev)
+        {
+            sb->first_free_block = next;
+        }
+        else
+        {
+            fat[prev] = next;
+            jfs_dirty_fat(sb, prev, 1);
+        }
+
+        return rest - start;
+    }
+
+    return 0;
+}
+
+///Take exactly start..start+count-1, all of it must be free. Walks the extent
+///list, meant for callers that picked the place themselves (jfs_find_free_run)
+int32_t jfs_take_free_range(struct JSuper *sb, int32_t start, uint32_t count)
+{
+    jfs_alloc_lock(sb);
+    for (uint32_t done = 0; done < count; )
+    {
+        uint32_t got = take_from_extent(sb, start + done, count - done);
+        if (0 == got)
+        {
+            return_free_extent(sb, start, done);
+            jfs_alloc_unlock(sb);
+            return -1;
+        }
+        __atomic_sub_fetch(&(sb->free_blocks), got, __ATOMIC_RELAXED);
+        jfs_free_map_update(sb, start + done, got, 0);
+        done += got;
+    }
+
+    jfs_alloc_unlock(sb);
+    JFS_STAT(blocks_allocated, count);
+    return start;
+}
+
+///Thread caches. Small requests are served from the caller's magazine; the
+///free list lock is taken once per refill or drain of JFS_MAG_BATCH blocks
+
+///Hand magazine extents back to the free list, all but keep of them
+static void mag_drain(struct JSuper *sb, struct JMagazine *mag, uint32_t keep)
+{
+    if (mag->cnt <= keep)
+        return;
+
+    jfs_alloc_lock(sb);
+    for (; mag->cnt > keep; mag->cnt--)
+    {
+        return_free_extent(sb, mag->start[mag->cnt - 1], mag->len[mag->cnt - 1]);
+        __atomic_sub_fetch(&(mag->blocks), mag->len[mag->cnt - 1], __ATOMIC_RELAXED);
+    }
+    jfs_alloc_unlock(sb);
+}
+
+static int32_t mag_take(struct JMagazine *mag, uint32_t want, uint32_t *got)
+{
+    uint32_t best = 0;
+
+    if (0 == mag->cnt)
+        return -1;
+
+    for (uint32_t ii = 1; ii < mag->cnt && mag->len[best] < want; ii++)
+        if (mag->len[ii] > mag->len[best])
+            best = ii;
+
+    int32_t start = mag->start[best];
+    *got = mag->len[best] > want ? want : mag->len[best];
+    mag->start[best] += *got;
+    mag->len[best] -= *got;
+    if (0 == mag->len[best])
+    {
+        mag->cnt--;
+        mag->start[best] = mag->start[mag->cnt];
+        mag->len[best] = mag->len[mag->cnt];
+    }
+    __atomic_sub_fetch(&(mag->blocks), *got, __ATOMIC_RELAXED);
+
+    return start;
+}
+
+static void mag_put(struct JSuper *sb, struct JMagazine *mag, int32_t start, uint32_t count)
+{
+    for (uint32_t ii = 0; ii < mag->cnt; ii++)
+    {
+        if ((uint32_t)(mag->start[ii] + mag->len[ii]) != (uint32_t)start &&
+            (uint32_t)start + count != (uint32_t)mag->start[ii])
+            continue;
+
+        if ((uint32_t)start + count == (uint32_t)mag->start[ii])
+            mag->start[ii] = start;
+        mag->len[ii] += count;
+        __atomic_add_fetch(&(mag->blocks), count, __ATOMIC_RELAXED);
+        if (mag->blocks > JFS_MAG_MAX) ///Merged pieces count against the cap too
+            mag_drain(sb, mag, 0);
+        return;
+    }
+
+    if (JFS_MAG_EXTENTS == mag->cnt || mag->blocks + count > JFS_MAG_MAX)
+        mag_drain(sb, mag, 0);
+
+    mag->start[mag->cnt] = start;
+    mag->len[mag->cnt] = count;
+    mag->cnt++;
+    __atomic_add_fetch(&(mag->blocks), count, __ATOMIC_RELAXED);
+}
+
+///Take up to want contiguous blocks
+int32_t jfs_get_free_extent(struct JSuper *sb, uint32_t want, uint32_t *got)
+{
+    struct JState *st = jfs_get_state(sb);
+    int32_t ret;
+
+    if (0 == want)
+        want = 1;
+
+    if (NULL != st && !st->mag_off && want <= JFS_MAG_BATCH / 2)
+    {
+        struct JMagazine *mag = &(st->mags[jfs_thread_slot()]);
+
+        pthread_mutex_lock(&(mag->lock));
+        ret = mag_take(mag, want, got);
+        if (0 <= ret && *got < want) ///Short piece, keep it for later and refill
+        {
+            mag_put(sb, mag, ret, *got);
+            ret = -1;
+        }
+        if (0 > ret && JFS_MAG_EXTENTS == mag->cnt)
+            mag_drain(sb, mag, 0);
+        if (0 > ret)
+        {
+            uint32_t batch;
+            jfs_alloc_lock(sb);
+            int32_t start = get_free_extent(sb, JFS_MAG_BATCH, &batch);
+            jfs_alloc_unlock(sb);
+            if (0 <= start)
+                mag_put(sb, mag, start, batch);
+            ret = mag_take(mag, want, got);
+        }
+        pthread_mutex_unlock(&(mag->lock));
+
+        if (0 <= ret)
+        {
+            JFS_STAT(blocks_allocated, *got);
+            return ret;
+        }
+
+        jfs_alloc_drain(sb); ///Free list is dry, the rest may sit in other threads' caches
+    }
+
+    jfs_alloc_lock(sb);
+    ret = get_free_extent(sb, want, got);
+    jfs_alloc_unlock(sb);
+    if (0 <= ret)
+        JFS_STAT(blocks_allocated, *got);
+    return ret;
+}
+
+///Changes of the image go through a journal
+static inline uint8_t is_journaled(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    return (sb->flags & JFS_FLAG_JOURNAL) && NULL != st && NULL != st->journal;
+}
+
+///Journaled: blocks freed in the open transaction stay off the free list until
+///its commit. The last record may still point at them, data written there by
+///this transaction would go home ahead of the record that frees them
+static int32_t free_hold(struct JSuper *sb, int32_t start, uint32_t count)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JJournal *j = NULL == st ? NULL : st->journal;
+
+    if (!is_journaled(sb) || j->aborted)
+        return -1;
+
+    jfs_alloc_lock(sb);
+    if (0 != j->held_cnt && j->held[2 * j->held_cnt - 2] + j->held[2 * j->held_cnt - 1] == (uint32_t)start)
+    {
+        j->held[2 * j->held_cnt - 1] += count;
+        jfs_alloc_unlock(sb);
+        return 0;
+    }
+    if (j->held_cnt == j->held_cap)
+    {
+        uint32_t cap = j->held_cap ? 2 * j->held_cap : 64;
+        uint32_t *held = realloc(j->held, 2 * cap * sizeof(uint32_t));
+        if (NULL == held)
+        {
+            jfs_alloc_unlock(sb);
+            JFS_WARN(JFS_LOG_ALLOC, "Can't hold %u freed blocks until the commit, they are free at once!\n", count);
+            return -1;
+        }
+        j->held = held;
+        j->held_cap = cap;
+    }
+    j->held[2 * j->held_cnt] = start;
+    j->held[2 * j->held_cnt + 1] = count;
+    j->held_cnt++;
+    jfs_alloc_unlock(sb);
+    return 0;
+}
+
+///Held extents to the free list. The commit calls it with every operation
+///stopped, the free list changes go with the record
+void jfs_free_release(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JJournal *j = NULL == st ? NULL : st->journal;
+
+    if (NULL == j)
+        return;
+
+    jfs_alloc_lock(sb);
+    for (uint32_t ii = 0; ii < j->held_cnt; ii++)
+        return_free_extent(sb, j->held[2 * ii], j->held[2 * ii + 1]);
+    j->held_cnt = 0;
+    jfs_alloc_unlock(sb);
+}
+
+void jfs_return_free_extent(struct JSuper *sb, int32_t start, uint32_t count)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (start < 0 || 0 == count)
+        return;
+    JFS_STAT(blocks_freed, count);
+
+    if (0 == free_hold(sb, start, count))
+        return;
+
+    if (NULL != st && !st->mag_off && count <= JFS_MAG_BATCH)
+    {
+        struct JMagazine *mag = &(st->mags[jfs_thread_slot()]);
+
+        ///Blocks in use are already out of the free map, cached ones stay out
+        pthread_mutex_lock(&(mag->lock));
+        mag_put(sb, mag, start, count);
+        pthread_mutex_unlock(&(mag->lock));
+        return;
+    }
+
+    jfs_alloc_lock(sb);
+    return_free_extent(sb, start, count);
+    jfs_alloc_unlock(sb);
+}
+
+///Chain from block back to the free list, a call per run of contiguous blocks.
+///Each run's last link is read before the run is reused
+void jfs_return_free_chain(struct JSuper *sb, int32_t block)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+
+    while (0 <= block)
+    {
+        uint32_t run = jfs_contig_blocks(fat, block, sb->blocks_count);
+        int32_t next = jfs_fat_next(fat, block + run - 1);
+        jfs_return_free_extent(sb, block, run);
+        block = next;
+    }
+}
+
+///Move every cached block back to the free list. Before the image is written
+///out and before anything walks the free list or the free map as a whole
+void jfs_alloc_drain(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st)
+        return;
+
+    for (int ii = 0; ii < JFS_LOCK_SLOTS; ii++)
+    {
+        pthread_mutex_lock(&(st->mags[ii].lock));
+        mag_drain(sb, &(st->mags[ii]), 0);
+        pthread_mutex_unlock(&(st->mags[ii].lock));
+    }
+}
+
+///on: 1 - thread caches (default), 0 - every allocation takes the free list lock
+int32_t jfs_set_alloc_cache(struct JSuper *sb, uint8_t on)
+{
+    struct JState *st = jfs_attach(sb);
+
+    if (NULL == st)
+        return -1;
+
+    jfs_alloc_drain(sb);
+    st->mag_off = !on;
+
+    return 0;
+}
+
+///Free blocks, thread caches included
+uint32_t jfs_free_blocks(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    uint32_t free_blocks = __atomic_load_n(&(sb->free_blocks), __ATOMIC_RELAXED);
+
+    if (NULL != st)
+        for (int ii = 0; ii < JFS_LOCK_SLOTS; ii++)
+            free_blocks += __atomic_load_n(&(st->mags[ii].blocks), __ATOMIC_RELAXED);
+
+    return free_blocks;
+}
+
 int32_t jfs_get_free_block(int32_t *fat, struct JSuper *sb)
 {
-    int32_t ret = sb->first_free_block;
+    uint32_t got;
+
+    return jfs_get_free_extent(sb, 1, &got);
+}
+
+void jfs_return_free_block(struct JSuper *sb, int32_t free_block)
+{
+    jfs_return_free_extent(sb, free_block, 1);
+}
+
+inline int32_t *jfs_get_fat_ptr(struct JSuper *sb)
+{
+    return (int32_t *)(sb + 1);
+}
+
+///rfat[block] is the previous block of the same chain, -1 for the first one
+inline int32_t *jfs_get_rfat_ptr(struct JSuper *sb)
+{
+    return jfs_get_fat_ptr(sb) + sb->blocks_count;
+}
+
+inline uint8_t *jfs_get_data_ptr(struct JSuper *sb)
+{
+    return (uint8_t *)(sb) + sb->system_bytes;
+}
+
+inline uint8_t *jfs_block_idx_to_ptr(int32_t block_idx, struct JSuper *sb)
+{
+    return jfs_get_data_ptr(sb) + (uint64_t)block_idx * sb->block_size;
+}
+
+///Inode table right after the reverse FAT, empty without JFS_FLAG_ITABLE
+struct JFile *jfs_get_itable_ptr(struct JSuper *sb)
+{
+    return (struct JFile *)(jfs_get_rfat_ptr(sb) + sb->blocks_count);
+}
+
+static inline uint8_t has_itable(struct JSuper *sb)
+{
+    return 0 != (sb->flags & JFS_FLAG_ITABLE);
+}
+
+static inline uint8_t has_compact(struct JSuper *sb)
+{
+    return 0 != (sb->flags & JFS_FLAG_COMPACT);
+}
+
+static inline uint8_t has_inline(struct JSuper *sb)
+{
+    return 0 != (sb->flags & JFS_FLAG_INLINE);
+}
+
+static inline uint8_t has_tailpack(struct JSuper *sb)
+{
+    return 0 != (sb->flags & JFS_FLAG_TAILPACK);
+}
+
+static inline uint8_t has_compress(struct JSuper *sb)
+{
+    return 0 != (sb->flags & JFS_FLAG_COMPRESS);
+}
+
+struct JFile *jfs_get_inode(struct JSuper *sb, uint32_t ino)
+{
+    return (struct JFile *)((uint8_t *)jfs_get_itable_ptr(sb) + (uint64_t)ino * jfs_inode_size(sb->flags));
+}
+
+///The inline area follows the JFile in its inode record
+uint8_t *jfs_inline_data(struct JFile *file)
+{
+    return jfs_is_inline(file) ? (uint8_t *)(file + 1) : NULL;
+}
+
+///The tail descriptor takes the same place
+struct JTail *jfs_file_tail(struct JFile *file)
+{
+    return file->flags & JFS_FILE_TAIL ? (struct JTail *)(file + 1) : NULL;
+}
+
+///And so does the stream descriptor
+struct JComp *jfs_file_comp(struct JFile *file)
+{
+    return file->flags & JFS_FILE_COMP ? (struct JComp *)(file + 1) : NULL;
+}
+
+uint8_t *jfs_tail_data(struct JFile *file, struct JSuper *sb)
+{
+    struct JTail *tail = jfs_file_tail(file);
+
+    return NULL == tail ? NULL : jfs_block_idx_to_ptr(tail->block, sb) + tail->offset;
+}
+
+///Packing as the builders see it: blocks the last len bytes of a file take
+///when they follow the tails packed so far into a fresh image. fill - bytes
+///of the open tail block, 0 - none yet. Tails too big for a tail block keep
+///their own block, like jfs_pack_tail does
+uint32_t jfs_tail_plan(uint32_t *fill, uint32_t len, uint32_t block_size)
+{
+    if (0 == len)
+        return 0;
+    if (len > block_size - sizeof(struct JTailBlock))
+        return 1;
+    if (0 != *fill && *fill + len <= block_size)
+    {
+        *fill += len;
+        return 0;
+    }
+
+    *fill = sizeof(struct JTailBlock) + len;
+    return 1;
+}
+
+///Bytes of one directory entry in an image of these format flags
+uint32_t jfs_dir_entry_size(uint32_t flags)
+{
+    if (flags & JFS_FLAG_COMPACT)
+        return sizeof(struct JDirentCompact);
+    if (flags & JFS_FLAG_ITABLE)
+        return sizeof(struct JDirent);
+    return sizeof(struct JFile);
+}
+
+static inline uint8_t *dirent_at(struct JSuper *sb, int32_t block, uint32_t slot)
+{
+    return jfs_block_idx_to_ptr(block, sb) + slot * jfs_dir_entry_size(sb->flags);
+}
+
+static inline uint32_t dirent_ino(struct JSuper *sb, int32_t block, uint32_t slot)
+{
+    if (has_compact(sb))
+        return ((struct JDirentCompact *)dirent_at(sb, block, slot))->ino;
+    return ((struct JDirent *)dirent_at(sb, block, slot))->ino;
+}
+
+///Write the entry naming inode ino into a slot of an inode table image
+static void dirent_set(struct JSuper *sb, int32_t block, uint32_t slot, const char *name, uint32_t ino)
+{
+    if (has_compact(sb))
+    {
+        struct JDirentCompact *dirent = (struct JDirentCompact *)dirent_at(sb, block, slot);
+        uint32_t len = strlen(name);
+        dirent->ino = ino;
+        dirent->name_len = len;
+        memset(dirent->name, 0, JFS_DIRENT_INLINE);
+        memcpy(dirent->name, name, len < JFS_DIRENT_INLINE ? len : JFS_DIRENT_INLINE);
+        jfs_dirty_meta(sb, dirent, sizeof(struct JDirentCompact));
+    }
+    else
+    {
+        struct JDirent *dirent = (struct JDirent *)dirent_at(sb, block, slot);
+        memset(dirent->name, 0, JFS_FILE_NAME_SIZE);
+        strcpy(dirent->name, name);
+        dirent->ino = ino;
+        jfs_dirty_meta(sb, dirent, sizeof(struct JDirent));
+    }
+}
+
+///Does the entry in a slot carry name (of length len)
+static inline uint8_t dirent_match(struct JSuper *sb, int32_t block, uint32_t slot, const char *name, uint32_t len)
+{
+    if (has_compact(sb))
+    {
+        struct JDirentCompact *dirent = (struct JDirentCompact *)dirent_at(sb, block, slot);
+        if (dirent->name_len != len || 0 != memcmp(dirent->name, name, len < JFS_DIRENT_INLINE ? len : JFS_DIRENT_INLINE))
+            return 0;
+        return len <= JFS_DIRENT_INLINE || 0 == strcmp(jfs_get_inode(sb, dirent->ino)->name, name);
+    }
+    if (has_itable(sb))
+        return 0 == strcmp(((struct JDirent *)dirent_at(sb, block, slot))->name, name);
+    return 0 == strcmp(((struct JFile *)jfs_block_idx_to_ptr(block, sb) + slot)->name, name);
+}
+
+///Entry in a slot of a directory block: the JFile itself, or the inode its dirent names
+struct JFile *jfs_dir_entry(struct JSuper *sb, int32_t block, uint32_t slot)
+{
+    if (has_itable(sb))
+        return jfs_get_inode(sb, dirent_ino(sb, block, slot));
+    return (struct JFile *)jfs_block_idx_to_ptr(block, sb) + slot;
+}
+
+///-1 for the root, it lives in the superblock
+static int32_t inode_number(struct JSuper *sb, struct JFile *file)
+{
+    return file == &(sb->root) ? -1 : (int32_t)(((uint8_t *)file - (uint8_t *)jfs_get_itable_ptr(sb)) / jfs_inode_size(sb->flags));
+}
+
+///Caller fills the inode in and marks it dirty
+static struct JFile *inode_alloc(struct JSuper *sb)
+{
+    if (0 > sb->free_inode)
+        return NULL;
+
+    struct JFile *inode = jfs_get_inode(sb, sb->free_inode);
+    sb->free_inode = inode->first_data_block_idx;
+    return inode;
+}
+
+static void inode_free(struct JSuper *sb, struct JFile *inode)
+{
+    inode->flags = JFS_INODE_FREE;
+    inode->first_data_block_idx = sb->free_inode;
+    sb->free_inode = inode_number(sb, inode);
+    jfs_dirty_meta(sb, inode, sizeof(struct JFile));
+}
+
+///Length of the run of blocks linked as i -> i+1 starting at block, at most max
+uint32_t jfs_contig_blocks(int32_t *fat, int32_t block, uint32_t max)
+{
+    uint32_t run = 1;
+
+    while (run < max && fat[block] == block + 1)
+    {
+        block++;
+        run++;
+        JFS_HOPS(1);
+    }
+
+    return run;
+}
+
+inline int32_t jfs_files_fit_in_block(struct JSuper *sb)
+{
+    return sb->block_size / jfs_dir_entry_size(sb->flags);
+}
+
+void jfs_add_new_block(struct JFile *file, struct JSuper *sb, int32_t new_block_idx)
+{
+    jfs_add_new_extent(file, sb, new_block_idx, 1);
+}
+
+///Append count contiguous blocks starting from start to the file's chain
+void jfs_add_new_extent(struct JFile *file, struct JSuper *sb, int32_t start, uint32_t count)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+
+    if (-1 == file->first_data_block_idx)
+    {
+        file->first_data_block_idx = start;
+    }
+    else
+    {
+        fat[file->last_data_block_idx] = start;
+        jfs_dirty_fat(sb, file->last_data_block_idx, 1);
+    }
+    rfat[start] = file->last_data_block_idx;
+
+    for (int32_t block = start + 1; block < start + (int32_t)count; block++)
+    {
+        fat[block - 1] = block;
+        rfat[block] = block - 1;
+    }
+
+    fat[start + count - 1] = -1;
+    file->last_data_block_idx = start + count - 1;
+    jfs_dirty_fat(sb, start, count);
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+
+    return;
+}
+
+///Slot for one more entry of parent, at the end. parent->size is left to the caller
+static int32_t dir_add_slot(struct JFile *parent, struct JSuper *sb, int32_t *block, uint32_t *offset)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t fit = jfs_files_fit_in_block(sb);
+
+    if (0 == parent->size % fit) //need new block
+    {
+        int32_t new_block = jfs_get_free_block(fat, sb);
+        if (-1 == new_block)
+        {
+            JFS_ERROR(JFS_LOG_DIR, JFS_ERR_NOSPC, "No free blocks left!\n");
+            return -1;
+        }
+
+        jfs_add_new_block(parent, sb, new_block);
+        *block = new_block;
+        *offset = 0;
+    }
+    else //last block has enough free space
+    {
+        *block = parent->last_data_block_idx;
+        *offset = parent->size % fit;
+    }
+
+    return 0;
+}
+
+static struct JFile *_jfs_create_file(struct JFile *parent, struct JSuper *sb, char *name, uint8_t flags)
+{
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return NULL;
+    }
+
+    int32_t block;
+    uint32_t offset;
+
+    int32_t files_fit_in_block = jfs_files_fit_in_block(sb);
+    if (0 == files_fit_in_block)
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_INVAL, "Too small block size - can't create any file!\n");
+        return NULL;
+    }
+
+    if (NULL != name && NULL != jfs_lookup(parent, sb, name))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_EXIST, "File %s already exists!\n", name);
+        return NULL;
+    }
+
+    if (has_itable(sb) && 0 > sb->free_inode)
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_NOSPC, "No free inodes left!\n");
+        return NULL;
+    }
+
+    jfs_generation_bump(sb);
+    if (0 != dir_add_slot(parent, sb, &block, &offset))
+        return NULL;
+
+    struct JFile *new_file;
+    if (has_itable(sb))
+        new_file = inode_alloc(sb);
+    else
+        new_file = (struct JFile *)jfs_block_idx_to_ptr(block, sb) + offset;
+
+    if (name != NULL)
+    {
+        if (strlen(name) > JFS_FILE_NAME_SIZE - 1)
+            JFS_WARN(JFS_LOG_DIR, "Too long file name! Only 63 bytes will be written!\n");
+        strncpy(new_file->name, name, JFS_FILE_NAME_SIZE - 1);
+        new_file->name[JFS_FILE_NAME_SIZE - 1] = '\0';
+    }
+    else
+        new_file->name[0] = '\0';
+    new_file->size = 0;
+    new_file->first_data_block_idx = -1;
+    new_file->last_data_block_idx = -1;
+    new_file->flags = flags & ~(JFS_FILE_INLINE | JFS_FILE_TAIL | JFS_FILE_COMP);
+    if (has_inline(sb) && !jfs_is_dir(new_file)) ///Small files start in the inode
+        new_file->flags |= JFS_FILE_INLINE;
+    new_file->coord.my_jfile_block = block;
+    new_file->coord.my_jfile_offset = offset;
+    if (has_itable(sb))
+    {
+        dirent_set(sb, block, offset, new_file->name, inode_number(sb, new_file));
+        new_file->coord.parent_jfile_block = inode_number(sb, parent);
+        new_file->coord.parent_jfile_offset = 0;
+    }
+    else
+    {
+        new_file->coord.parent_jfile_block = parent->coord.my_jfile_block;
+        new_file->coord.parent_jfile_offset = parent->coord.my_jfile_offset;
+    }
+
+    parent->size++;
+    jfs_dirty_meta(sb, new_file, sizeof(struct JFile));
+    jfs_dirty_meta(sb, parent, sizeof(struct JFile));
+    jfs_dir_index_insert(parent, sb, new_file);
+
+    return new_file;
+}
+
+struct JFile *jfs_create_file(struct JFile *parent, struct JSuper *sb, char *name, uint8_t flags)
+{
+    if (0 != ns_write_enter(sb))
+        return NULL;
+
+    JFS_STAT_OP(JFS_OP_CREATE);
+    struct JFile *ret = _jfs_create_file(parent, sb, name, flags);
+    JFS_STAT_OP_END();
+    jfs_ns_write_unlock(sb);
+    if (NULL != ret && 0 != jfs_journal_commit(sb))
+        return NULL;
+    return ret;
+}
+
+static struct JFile *_jfs_lookup(struct JFile *dir, struct JSuper *sb, char *name)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t fit = jfs_files_fit_in_block(sb);
+    int32_t block = dir->first_data_block_idx;
+    struct JFile *found;
+
+    if (!jfs_is_dir(dir) || 0 == dir->size)
+        return NULL;
+
+    if (0 == jfs_dir_index_find(dir, sb, name, &found))
+        return found;
+
+    ///No side tables or no memory for them, scan the chain. Names are in the
+    ///entries in every format, inodes are only read on a match
+    uint32_t len = strlen(name);
+    for (uint32_t ii = 0; ii < dir->size; ii++)
+    {
+        if (0 != ii && 0 == ii % fit)
+            block = jfs_fat_next(fat, block);
+
+        if (dirent_match(sb, block, ii % fit, name, len))
+        {
+            JFS_STAT(dir_entries_scanned, ii + 1);
+            return jfs_dir_entry(sb, block, ii % fit);
+        }
+    }
+
+    JFS_STAT(dir_entries_scanned, dir->size);
+    return NULL;
+}
+
+struct JFile *jfs_lookup(struct JFile *dir, struct JSuper *sb, char *name)
+{
+    JFS_STAT_OP(JFS_OP_LOOKUP);
+    struct JFile *ret = _jfs_lookup(dir, sb, name);
+    JFS_STAT_OP_END();
+    return ret;
+}
+
+///Path is relative to the root, "a/b/c", extra slashes are ignored
+struct JFile *jfs_resolve_path(struct JSuper *sb, const char *path)
+{
+    struct JFile *file = jfs_get_root_dir(sb);
+    char name[JFS_FILE_NAME_SIZE];
+
+    while ('\0' != *path)
+    {
+        size_t len = strcspn(path, "/");
+
+        if (0 != len)
+        {
+            if (len >= JFS_FILE_NAME_SIZE)
+            {
+                jfs_set_error(JFS_ERR_INVAL);
+                return NULL;
+            }
+
+            memcpy(name, path, len);
+            name[len] = '\0';
+            file = jfs_lookup(file, sb, name);
+            if (NULL == file)
+            {
+                jfs_set_error(JFS_ERR_NOENT);
+                return NULL;
+            }
+        }
+
+        path += len;
+        if ('/' == *path)
+            path++;
+    }
+
+    return file;
+}
+
+struct JFile *jfs_get_root_dir(struct JSuper *sb)
+{
+    return &(sb->root);
+}
+
+int32_t jfs_read_dir(struct JFile *dir, struct JSuper *sb, uint32_t offset, struct JFile **ret)
+{
+    int32_t block_pos;
+
+    if (offset >= dir->size)
+    {
+        *ret = NULL;
+        return 0;
+    }
+
+    JFS_STAT_OP(JFS_OP_READ_DIR);
+    block_pos = jfs_seek_block(dir, sb, offset / jfs_files_fit_in_block(sb));
+    JFS_STAT_OP_END();
+
+    *ret = jfs_dir_entry(sb, block_pos, offset % jfs_files_fit_in_block(sb));
+
+    return 0;
+}
+
+///Use jfs_dir_iter_* to list a whole directory, jfs_read_dir seeks from the start on every call
+void jfs_dir_iter_init(struct JDirIter *it, struct JFile *dir, struct JSuper *sb)
+{
+    it->dir = dir;
+    it->block = dir->first_data_block_idx;
+    it->slot = 0;
+    it->pos = 0;
+}
+
+struct JFile *jfs_dir_iter_next(struct JDirIter *it, struct JSuper *sb)
+{
+    struct JFile *ret;
+
+    if (it->pos >= it->dir->size)
+        return NULL;
+
+    if (it->slot == (uint32_t)jfs_files_fit_in_block(sb))
+    {
+        it->block = jfs_fat_next(jfs_get_fat_ptr(sb), it->block);
+        it->slot = 0;
+    }
+
+    ret = jfs_dir_entry(sb, it->block, it->slot);
+    it->slot++;
+    it->pos++;
+
+    return ret;
+}
+
+///Return up to max entries, never crossing a block boundary. 0 - directory is over
+uint32_t jfs_dir_iter_next_block(struct JDirIter *it, struct JSuper *sb, struct JFile **out, uint32_t max)
+{
+    uint32_t fit = jfs_files_fit_in_block(sb);
+    uint32_t cnt = 0;
+
+    if (it->pos >= it->dir->size)
+        return 0;
+
+    if (it->slot == fit)
+    {
+        it->block = jfs_fat_next(jfs_get_fat_ptr(sb), it->block);
+        it->slot = 0;
+    }
+
+    for (; cnt < max && it->slot < fit && it->pos < it->dir->size; cnt++, it->slot++, it->pos++)
+        out[cnt] = jfs_dir_entry(sb, it->block, it->slot);
+
+    return cnt;
+}
+
+static int32_t _jfs_write_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *data, uint32_t data_size);
+static void free_file_chain(struct JFile *file, struct JSuper *sb);
+
+///Data of inline files is metadata: it goes through the journal with the inode
+static void inline_write(struct JFile *file, struct JSuper *sb, uint32_t offset, const uint8_t *data, uint32_t size)
+{
+    uint8_t *dst = jfs_inline_data(file) + offset;
+
+    if (NULL == data)
+        memset(dst, FILL_CHAR, size);
+    else
+        memcpy(dst, data, size);
+    jfs_dirty_meta(sb, dst, size);
+
+    if (offset + size > file->size)
+    {
+        __atomic_add_fetch(&(sb->data_bytes), offset + size - file->size, __ATOMIC_RELAXED);
+        file->size = offset + size;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    }
+}
+
+///Inline file grows to end bytes, past the inode: its data moves out to blocks
+static int32_t inline_spill(struct JFile *file, struct JSuper *sb, uint32_t end)
+{
+    uint8_t buf[JFS_INLINE_SIZE];
+    uint32_t size = file->size;
+
+    if ((end + sb->block_size - 1) / sb->block_size > jfs_free_blocks(sb))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "No free blocks left!\n");
+        return -1;
+    }
+
+    memcpy(buf, jfs_inline_data(file), size);
+    file->flags &= ~JFS_FILE_INLINE;
+    file->size = 0;
+    __atomic_sub_fetch(&(sb->data_bytes), size, __ATOMIC_RELAXED);
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+
+    return 0 == size ? 0 : _jfs_write_file(file, sb, 0, buf, size);
+}
+
+///Tail keeps its first len bytes, at 0 the file has no tail any more. Bytes
+///cut off stay where they are, the block is freed once all its tails are gone
+static void tail_trim(struct JFile *file, struct JSuper *sb, uint32_t len)
+{
+    struct JTail *tail = jfs_file_tail(file);
+    struct JTailBlock *head = (struct JTailBlock *)jfs_block_idx_to_ptr(tail->block, sb);
+    int32_t free_block = -1;
+
+    jfs_tail_lock(sb);
+    head->used -= tail->len - len;
+    if (0 == head->used && tail->block == sb->tail_block) ///Open one starts over
+        head->fill = sizeof(struct JTailBlock);
+    else if (0 == head->used)
+        free_block = tail->block;
+    jfs_dirty_meta(sb, head, sizeof(struct JTailBlock));
+    jfs_tail_unlock(sb);
+
+    jfs_return_free_block(sb, free_block);
+    tail->len = len;
+    if (0 == len)
+        file->flags &= ~JFS_FILE_TAIL;
+    jfs_dirty_meta(sb, file, sizeof(struct JFile) + sizeof(struct JTail));
+}
+
+///Tail goes back to a block at the end of the chain, before the file changes
+static int32_t tail_unpack(struct JFile *file, struct JSuper *sb)
+{
+    uint32_t len = jfs_file_tail(file)->len;
+    uint32_t got;
+    int32_t block = jfs_get_free_extent(sb, 1, &got);
+
+    if (0 > block)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "No free blocks left!\n");
+        return -1;
+    }
+
+    memcpy(jfs_block_idx_to_ptr(block, sb), jfs_tail_data(file, sb), len);
+    jfs_dirty_data(sb, jfs_block_idx_to_ptr(block, sb), len);
+    tail_trim(file, sb, 0);
+    jfs_add_new_extent(file, sb, block, 1);
+
+    return 0;
+}
+
+///Compressed file goes back to plain blocks before it changes. The new chain
+///is written before the stream is freed, on failure the file stays as it was
+static int32_t comp_unpack(struct JFile *file, struct JSuper *sb)
+{
+    struct JFile stream = *file;
+    uint32_t size = file->size;
+    uint8_t *buf = malloc(size);
+
+    if (NULL == buf)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOMEM, "Can't alloc memory for %s!\n", file->name);
+        return -1;
+    }
+    if (0 != jfs_comp_read(file, sb, 0, buf, size))
+    {
+        free(buf);
+        return -1;
+    }
+
+    file->flags &= ~JFS_FILE_COMP;
+    file->first_data_block_idx = -1;
+    file->last_data_block_idx = -1;
+    file->size = 0;
+    __atomic_sub_fetch(&(sb->data_bytes), size, __ATOMIC_RELAXED);
+    int32_t ret = _jfs_write_file(file, sb, 0, buf, size);
+    free(buf);
+
+    if (0 != ret)
+    {
+        free_file_chain(file, sb);
+        __atomic_add_fetch(&(sb->data_bytes), size - file->size, __ATOMIC_RELAXED);
+        file->flags = stream.flags;
+        file->first_data_block_idx = stream.first_data_block_idx;
+        file->last_data_block_idx = stream.last_data_block_idx;
+        file->size = size;
+    }
+    else
+    {
+        free_file_chain(&stream, sb);
+    }
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+
+    return ret;
+}
+
+static int32_t _jfs_write_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *data, uint32_t data_size)
+{
+    JFS_DEBUG(JFS_LOG_DATA, "\tWrite file %s!\n", file->name);
+    int32_t *fat = jfs_get_fat_ptr(sb);
+
+    ///Error handle
+    if (!jfs_is_file(file))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_TYPE, "Eww, it is not a file!\n");
+        return -1;
+    }
+
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
+
+    if (offset > file->size)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Bad offset value!\n");
+        return -1;
+    }
+    jfs_generation_bump(sb);
+
+    uint32_t end = offset + data_size > file->size ? offset + data_size : file->size;
+    if (jfs_is_inline(file))
+    {
+        if (end <= JFS_INLINE_SIZE)
+        {
+            inline_write(file, sb, offset, data, data_size);
+            return 0;
+        }
+        if (0 != inline_spill(file, sb, end))
+            return -1;
+    }
+    if (0 != data_size && NULL != jfs_file_tail(file) && 0 != tail_unpack(file, sb))
+        return -1;
+    if (0 != data_size && NULL != jfs_file_comp(file) && 0 != comp_unpack(file, sb))
+        return -1;
+
+    ///Don't start a write that can't be finished
+    uint32_t have_blocks = file->first_data_block_idx < 0 ? 0 :
+                           (0 == file->size ? 1 : (file->size - 1) / sb->block_size + 1);
+    uint32_t need_blocks = (end + sb->block_size - 1) / sb->block_size;
+    if (need_blocks > have_blocks && need_blocks - have_blocks > jfs_free_blocks(sb))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "No free blocks left!\n");
+        return -1;
+    }
+
+    ///Set pointers
+    uint8_t *write_ptr = NULL;
+    uint32_t pos = offset;
+    int32_t cnt_to_write = data_size;
+    int32_t curr_block = -1;
+    int32_t ret = 0;
 
-    if (0 <= ret)
-        sb->first_free_block = fat[ret];
+    ///Write data
+    for(;;)
+    {
+        ///Error happens
+        if (ret < 0)
+        {
+            JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "Error while write in file!\n");
+            return ret;
+        }
+        ///All done!
+        else if (0 == cnt_to_write)
+        {
+            break;
+        }
+        ///File is empty
+        else if (file->first_data_block_idx < 0)
+        {
+            uint32_t got;
+            int32_t new_block = jfs_get_free_extent(sb, (cnt_to_write + sb->block_size - 1) / sb->block_size, &got);
+            if (0 > new_block)
+            {
+                ret = -1;
+                continue;
+            }
+
+            jfs_add_new_extent(file, sb, new_block, got);
+            curr_block = new_block;
+            write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
+        }
+        ///Append: start right from the tail block
+        else if (NULL == write_ptr && offset == file->size)
+        {
+            curr_block = file->last_data_block_idx;
+            write_ptr = jfs_block_idx_to_ptr(curr_block, sb) +
+                        (0 == offset ? 0 : offset - (offset - 1) / sb->block_size * sb->block_size);
+        }
+        ///file is not empty, block and place to write is unset
+        else if (NULL == write_ptr)
+        {
+            curr_block = jfs_seek_block(file, sb, offset / sb->block_size);
+            write_ptr = jfs_block_idx_to_ptr(curr_block, sb) + offset % sb->block_size;
+        }
+        ///Reach the end of the block
+        else if (jfs_block_idx_to_ptr(curr_block, sb) + sb->block_size == write_ptr)
+        {
+            ///Two cases: EOF or not
+            if (fat[curr_block] >= 0)
+            {
+                curr_block = jfs_fat_next(fat, curr_block);
+                write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
+            }
+            else
+            {
+                uint32_t got;
+                int32_t new_block = jfs_get_free_extent(sb, (cnt_to_write + sb->block_size - 1) / sb->block_size, &got);
+                if (0 > new_block)
+                {
+                    ret = -1;
+                    continue;
+                }
+
+                jfs_add_new_extent(file, sb, new_block, got);
+                curr_block = new_block;
+                write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
+            }
+        }
+        ///All is set, can write
+        else
+        {
+            uint32_t left_in_block = sb->block_size - (write_ptr - jfs_block_idx_to_ptr(curr_block, sb));
+            uint32_t write_in_block = cnt_to_write > left_in_block ? left_in_block : cnt_to_write;
+
+            if (NULL == data)
+            {
+                memset(write_ptr, FILL_CHAR, write_in_block);
+            }
+            else
+            {
+                memcpy(write_ptr, data - cnt_to_write + data_size, write_in_block);
+            }
+            jfs_dirty_data(sb, write_ptr, write_in_block);
+            write_ptr += write_in_block;
+            cnt_to_write -= write_in_block;
+            pos += write_in_block;
+            if (pos > file->size)
+            {
+                __atomic_add_fetch(&(sb->data_bytes), pos - file->size, __ATOMIC_RELAXED);
+                file->size = pos;
+                jfs_dirty_meta(sb, file, sizeof(struct JFile));
+            }
+        }
+    }
 
     return ret;
 }
 
-void jfs_return_free_block(struct JSuper *sb, int32_t free_block)
+int32_t jfs_write_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *data, uint32_t data_size)
+{
+    JFS_STAT_OP(JFS_OP_WRITE);
+    jfs_file_lock(file, sb, 1);
+    int32_t ret = _jfs_write_file(file, sb, offset, data, data_size);
+    jfs_file_unlock(file, sb);
+    if (0 == ret)
+        JFS_STAT(bytes_written, data_size);
+    JFS_STAT_OP_END();
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
+}
+
+///Bytes of offset..offset+size (inside the file) that are in the chain, the rest is in the tail
+static uint32_t chain_part(struct JFile *file, uint32_t offset, uint32_t size)
+{
+    struct JTail *tail = jfs_file_tail(file);
+    uint32_t chain_end = file->size - (NULL == tail ? 0 : tail->len);
+
+    if (offset >= chain_end)
+        return 0;
+    return size > chain_end - offset ? chain_end - offset : size;
+}
+
+///Byte pos of the file, one in its tail
+static inline uint8_t *tail_at(struct JFile *file, struct JSuper *sb, uint32_t pos)
+{
+    return jfs_tail_data(file, sb) + pos - (file->size - jfs_file_tail(file)->len);
+}
+
+static int32_t _jfs_read_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size)
 {
+    struct JState *st = jfs_get_state(sb);
     int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t block;
+    uint32_t offset_block = offset % sb->block_size;
+    uint32_t read = 0;
 
-    if (free_block < 0)
+    if (offset >= file->size)
     {
-        return;
+        if (NULL != ret_size)
+            *ret_size = 0;
+        return 0;
+    }
+
+    size = size >= file->size - offset ? file->size - offset : size;
+
+    if (jfs_is_inline(file)) ///One copy out of the inode, no FAT
+    {
+        memcpy(dst, jfs_inline_data(file) + offset, size);
+        *ret_size = size;
+        return 0;
+    }
+
+    if (NULL != jfs_file_comp(file)) ///Clusters it touches are decompressed
+    {
+        int32_t ret = jfs_comp_read(file, sb, offset, dst, size);
+        if (NULL != ret_size)
+            *ret_size = 0 == ret ? size : 0;
+        return ret;
+    }
+
+    ///Tail blocks are in memory even on pread mounts, they are read in at mount
+    uint32_t in_chain = chain_part(file, offset, size);
+    if (in_chain < size)
+        memcpy(dst + in_chain, tail_at(file, sb, offset + in_chain), size - in_chain);
+    *ret_size = size;
+    if (0 == in_chain)
+        return 0;
+    if (NULL != st && NULL != st->cache)
+        return jfs_cache_read(file, sb, offset, dst, in_chain, NULL);
+
+    size = in_chain;
+    block = jfs_seek_block(file, sb, offset / sb->block_size);
+
+    for (;size > 0;) ///One memcpy per run of contiguous blocks
+    {
+        uint32_t run = jfs_contig_blocks(fat, block, (offset_block + size - 1) / sb->block_size + 1);
+        uint32_t read_from_run = run * sb->block_size - offset_block > size ? size : run * sb->block_size - offset_block;
+        memcpy(dst + read, jfs_block_idx_to_ptr(block, sb) + offset_block, read_from_run);
+        size -= read_from_run;
+        read += read_from_run;
+        block = jfs_fat_next(fat, block + run - 1);
+        offset_block = 0;
     }
 
-    fat[free_block] = sb->first_free_block;
-    sb->first_free_block = free_block;
+    return 0;
 }
 
-inline int32_t *jfs_get_fat_ptr(struct JSuper *sb)
+int32_t jfs_read_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size)
 {
-    return (int32_t *)(sb + 1);
+    JFS_STAT_OP(JFS_OP_READ);
+    jfs_file_lock(file, sb, 0);
+    int32_t ret = _jfs_read_file(file, sb, offset, dst, size, ret_size);
+    jfs_file_unlock(file, sb);
+    if (0 == ret && NULL != ret_size)
+        JFS_STAT(bytes_read, *ret_size);
+    JFS_STAT_OP_END();
+    return ret;
 }
 
-inline uint8_t *jfs_get_data_ptr(struct JSuper *sb)
+///File data of pread mounts is not in memory to point at
+static int32_t zero_copy_check(struct JSuper *sb)
 {
-    return (uint8_t *)(sb) + sb->system_bytes;
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st && NULL != st->cache)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Zero-copy reads need a mapped image!\n");
+        return -1;
+    }
+
+    return 0;
 }
 
-inline uint8_t *jfs_block_idx_to_ptr(int32_t block_idx, struct JSuper *sb)
+///Describe a file range as iovecs over the image, one per run of contiguous blocks
+static int32_t _jfs_read_file_iov(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                                  struct iovec *iov, int iovcnt, int *ret_cnt, uint32_t *ret_size)
 {
-    return jfs_get_data_ptr(sb) + block_idx * sb->block_size;
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t offset_block = offset % sb->block_size;
+    uint32_t read = 0;
+    int cnt = 0;
+    int32_t block;
+
+    if (NULL != jfs_file_comp(file))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Data of compressed file %s is not in place!\n", file->name);
+        return -1;
+    }
+
+    if (offset < file->size && jfs_is_inline(file) && 0 < iovcnt)
+    {
+        read = size >= file->size - offset ? file->size - offset : size;
+        iov[0].iov_base = jfs_inline_data(file) + offset;
+        iov[0].iov_len = read;
+        cnt = 1;
+    }
+    else if (offset < file->size && !jfs_is_inline(file))
+    {
+        size = size >= file->size - offset ? file->size - offset : size;
+        uint32_t in_tail = size - chain_part(file, offset, size);
+        size -= in_tail;
+        block = 0 == size ? -1 : jfs_seek_block(file, sb, offset / sb->block_size);
+
+        for (; size > 0 && cnt < iovcnt; cnt++)
+        {
+            uint32_t run = jfs_contig_blocks(fat, block, (offset_block + size - 1) / sb->block_size + 1);
+            uint32_t read_from_run = run * sb->block_size - offset_block > size ? size : run * sb->block_size - offset_block;
+            iov[cnt].iov_base = jfs_block_idx_to_ptr(block, sb) + offset_block;
+            iov[cnt].iov_len = read_from_run;
+            size -= read_from_run;
+            read += read_from_run;
+            block = jfs_fat_next(fat, block + run - 1);
+            offset_block = 0;
+        }
+        if (0 != in_tail && 0 == size && cnt < iovcnt) ///Tail is one more piece
+        {
+            iov[cnt].iov_base = tail_at(file, sb, offset + read);
+            iov[cnt++].iov_len = in_tail;
+            read += in_tail;
+        }
+    }
+
+    if (NULL != ret_cnt)
+        *ret_cnt = cnt;
+    if (NULL != ret_size)
+        *ret_size = read;
+    return 0;
 }
 
-inline int32_t jfs_files_fit_in_block(struct JSuper *sb)
+int32_t jfs_read_file_iov(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                          struct iovec *iov, int iovcnt, int *ret_cnt, uint32_t *ret_size)
 {
-    return sb->block_size / sizeof(struct JFile);
+    if (0 != zero_copy_check(sb))
+        return -1;
+
+    JFS_STAT_OP(JFS_OP_READ);
+    jfs_file_lock(file, sb, 0);
+    int32_t ret = _jfs_read_file_iov(file, sb, offset, size, iov, iovcnt, ret_cnt, ret_size);
+    jfs_file_unlock(file, sb);
+    JFS_STAT_OP_END();
+    return ret;
 }
 
-void jfs_add_new_block(struct JFile *file, struct JSuper *sb, int32_t new_block_idx)
+///Vectored write: blocks for the whole request are allocated before any data is copied
+static int32_t _jfs_writev(struct JFile *file, struct JSuper *sb, uint32_t offset, const struct iovec *iov, int iovcnt)
 {
     int32_t *fat = jfs_get_fat_ptr(sb);
-    int32_t last_file_block = file->first_data_block_idx;
+    uint64_t total = 0;
 
-    if (-1 == file->first_data_block_idx)
+    ///Error handle
+    if (!jfs_is_file(file))
     {
-        file->first_data_block_idx = new_block_idx;
-        fat[new_block_idx] = -1;
-        return;
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_TYPE, "Eww, it is not a file!\n");
+        return -1;
     }
 
-    while (fat[last_file_block] != -1)
+    if (jfs_is_read_only(sb))
     {
-        last_file_block = fat[last_file_block];
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
     }
 
-    fat[last_file_block] = new_block_idx;
-    fat[new_block_idx] = -1;
+    if (offset > file->size)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Bad offset value!\n");
+        return -1;
+    }
 
-    return;
+    for (int ii = 0; ii < iovcnt; ii++)
+        total += iov[ii].iov_len;
+    if (offset + total > UINT32_MAX)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_FBIG, "Too big file!\n");
+        return -1;
+    }
+    if (0 == total)
+        return 0;
+    jfs_generation_bump(sb);
+
+    uint32_t end = offset + total > file->size ? offset + total : file->size;
+    if (jfs_is_inline(file))
+    {
+        if (end <= JFS_INLINE_SIZE)
+        {
+            for (int ii = 0; ii < iovcnt; offset += iov[ii].iov_len, ii++)
+                inline_write(file, sb, offset, iov[ii].iov_base, iov[ii].iov_len);
+            return 0;
+        }
+        if (0 != inline_spill(file, sb, end))
+            return -1;
+    }
+    if (NULL != jfs_file_tail(file) && 0 != tail_unpack(file, sb))
+        return -1;
+    if (NULL != jfs_file_comp(file) && 0 != comp_unpack(file, sb))
+        return -1;
+
+    ///Allocate
+    uint32_t have_blocks = file->first_data_block_idx < 0 ? 0 :
+                           (0 == file->size ? 1 : (file->size - 1) / sb->block_size + 1);
+    uint32_t need_blocks = (end + sb->block_size - 1) / sb->block_size;
+    if (need_blocks > have_blocks && need_blocks - have_blocks > jfs_free_blocks(sb))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "No free blocks left!\n");
+        return -1;
+    }
+
+    ///Seek before the chain grows: size still describes the old chain
+    int32_t block = offset / sb->block_size < have_blocks ? jfs_seek_block(file, sb, offset / sb->block_size) : -1;
+
+    while (have_blocks < need_blocks)
+    {
+        uint32_t got;
+        int32_t start = jfs_get_free_extent(sb, need_blocks - have_blocks, &got);
+        if (0 > start)
+        {
+            JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOSPC, "No free blocks left!\n");
+            return -1;
+        }
+        jfs_add_new_extent(file, sb, start, got);
+        if (0 > block)
+            block = start;
+        have_blocks += got;
+    }
+
+    ///Copy, one memcpy per buffer piece that lands on contiguous blocks
+    uint32_t offset_block = offset % sb->block_size;
+    for (int ii = 0; ii < iovcnt; ii++)
+    {
+        const uint8_t *src = iov[ii].iov_base;
+        uint32_t left = iov[ii].iov_len;
+
+        while (left > 0)
+        {
+            uint32_t run = jfs_contig_blocks(fat, block, (offset_block + left - 1) / sb->block_size + 1);
+            uint32_t n = run * sb->block_size - offset_block > left ? left : run * sb->block_size - offset_block;
+
+            memcpy(jfs_block_idx_to_ptr(block, sb) + offset_block, src, n);
+            jfs_dirty_data(sb, jfs_block_idx_to_ptr(block, sb) + offset_block, n);
+            src += n;
+            left -= n;
+            offset_block += n;
+            for (; offset_block >= sb->block_size && 0 <= block; offset_block -= sb->block_size)
+                block = jfs_fat_next(fat, block);
+        }
+    }
+
+    if (end > file->size)
+    {
+        __atomic_add_fetch(&(sb->data_bytes), end - file->size, __ATOMIC_RELAXED);
+        file->size = end;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    }
+
+    return 0;
 }
 
-struct JFile *jfs_create_file(struct JFile *parent, struct JSuper *sb, char *name, uint8_t flags)
+int32_t jfs_writev(struct JFile *file, struct JSuper *sb, uint32_t offset, const struct iovec *iov, int iovcnt)
+{
+    JFS_STAT_OP(JFS_OP_WRITE);
+    jfs_file_lock(file, sb, 1);
+    int32_t ret = _jfs_writev(file, sb, offset, iov, iovcnt);
+    jfs_file_unlock(file, sb);
+    for (int ii = 0; 0 == ret && ii < iovcnt; ii++)
+        JFS_STAT(bytes_written, iov[ii].iov_len);
+    JFS_STAT_OP_END();
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
+}
+
+///Zero-copy read: point spans at file data in place, one span per block touched
+static int32_t _jfs_read_file_spans(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                                    struct JSpan *spans, uint32_t max_spans, uint32_t *ret_spans, uint32_t *ret_size)
 {
-    //TODO: check, does file with that name already exist?
-    uint8_t *where_to_add = NULL; //В какое место добавить новую запись
     int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t offset_block = offset % sb->block_size;
+    uint32_t cnt = 0, read = 0;
     int32_t block;
-    uint32_t offset;
 
-    int32_t files_fit_in_block = jfs_files_fit_in_block(sb);
-    if (0 == files_fit_in_block)
+    if (NULL != jfs_file_comp(file))
     {
-        printf("Too small block size - can't create any file!\n");
-        return NULL;
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Data of compressed file %s is not in place!\n", file->name);
+        return -1;
     }
 
-    if (0 == parent->size % files_fit_in_block) //need new block
+    if (offset < file->size && jfs_is_inline(file) && 0 < max_spans)
     {
-        int32_t new_block = jfs_get_free_block(fat, sb);
-        if (-1 == new_block)
+        read = size >= file->size - offset ? file->size - offset : size;
+        spans[0].ptr = jfs_inline_data(file) + offset;
+        spans[0].len = read;
+        cnt = 1;
+    }
+    else if (offset < file->size && !jfs_is_inline(file))
+    {
+        size = size >= file->size - offset ? file->size - offset : size;
+        uint32_t in_tail = size - chain_part(file, offset, size);
+        size -= in_tail;
+        block = 0 == size ? -1 : jfs_seek_block(file, sb, offset / sb->block_size);
+
+        for (; size > 0 && cnt < max_spans; cnt++)
+        {
+            uint32_t read_from_block = sb->block_size - offset_block > size ? size : sb->block_size - offset_block;
+            spans[cnt].ptr = jfs_block_idx_to_ptr(block, sb) + offset_block;
+            spans[cnt].len = read_from_block;
+            size -= read_from_block;
+            read += read_from_block;
+            block = jfs_fat_next(fat, block);
+            offset_block = 0;
+        }
+        if (0 != in_tail && 0 == size && cnt < max_spans) ///Tail is one more piece
         {
-            printf("No free blocks left!\n");
-            return NULL;
+            spans[cnt].ptr = tail_at(file, sb, offset + read);
+            spans[cnt++].len = in_tail;
+            read += in_tail;
         }
+    }
 
-        jfs_add_new_block(parent, sb, new_block);
+    if (NULL != ret_spans)
+        *ret_spans = cnt;
+    if (NULL != ret_size)
+        *ret_size = read;
+    return 0;
+}
+
+int32_t jfs_read_file_spans(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                            struct JSpan *spans, uint32_t max_spans, uint32_t *ret_spans, uint32_t *ret_size)
+{
+    if (0 != zero_copy_check(sb))
+        return -1;
+
+    JFS_STAT_OP(JFS_OP_READ);
+    jfs_file_lock(file, sb, 0);
+    int32_t ret = _jfs_read_file_spans(file, sb, offset, size, spans, max_spans, ret_spans, ret_size);
+    jfs_file_unlock(file, sb);
+    JFS_STAT_OP_END();
+    return ret;
+}
+
+///Blocks and tail of a regular file go back, the rest of the JFile is left as is
+static void free_file_chain(struct JFile *file, struct JSuper *sb)
+{
+    if (NULL != jfs_file_tail(file))
+        tail_trim(file, sb, 0);
+
+    jfs_seek_index_truncate(sb, file->first_data_block_idx, 0);
+    jfs_return_free_chain(sb, file->first_data_block_idx);
+}
+
+///File shrinks to new_size that fits its inode: the data moves in, blocks are freed
+static int32_t inline_pull(struct JFile *file, struct JSuper *sb, uint32_t new_size)
+{
+    uint8_t buf[JFS_INLINE_SIZE];
+    uint32_t got = 0;
+
+    _jfs_read_file(file, sb, 0, buf, new_size, &got);
+    free_file_chain(file, sb);
+    __atomic_sub_fetch(&(sb->data_bytes), file->size, __ATOMIC_RELAXED);
+    file->first_data_block_idx = -1;
+    file->last_data_block_idx = -1;
+    file->flags |= JFS_FILE_INLINE;
+    file->size = 0;
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    inline_write(file, sb, 0, buf, got);
+
+    return 0;
+}
+
+///Chain keeps its first blocks_left blocks, the rest goes back
+static void chain_truncate(struct JFile *file, struct JSuper *sb, uint32_t blocks_left)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t block = jfs_seek_block(file, sb, blocks_left - 1);
+
+    if (-1 == fat[block]) ///Only last block is resized
+        return;
+
+    jfs_return_free_chain(sb, jfs_fat_next(fat, block));
+    fat[block] = -1;
+    jfs_dirty_fat(sb, block, 1);
+    file->last_data_block_idx = block;
+    jfs_seek_index_truncate(sb, file->first_data_block_idx, blocks_left);
+}
+
+static int32_t _jfs_resize_file(struct JFile *file, struct JSuper *sb, uint32_t new_size)
+{
+    ///Error handle
+    if (!jfs_is_file(file))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_TYPE, "Eww, it is not a file!\n");
+        return -1;
+    }
 
-        block = new_block;
-        offset = 0;
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
+
+    if (new_size == file->size) ///Same size
+        return 0;
+    jfs_generation_bump(sb);
+
+    if (NULL != jfs_file_comp(file) && 0 != comp_unpack(file, sb)) ///Plain blocks first
+    {
+        return -1;
+    }
+    else if (new_size > file->size) ///Bigger size
+    {
+        uint32_t fill_size = new_size - file->size;
 
-        where_to_add = jfs_get_data_ptr(sb) + new_block * sb->block_size;
+        if (0 > _jfs_write_file(file, sb, file->size, NULL, fill_size))
+            return -1;
+    }
+    else if (jfs_is_inline(file)) ///Smaller, the data stays in the inode
+    {
+        __atomic_sub_fetch(&(sb->data_bytes), file->size - new_size, __ATOMIC_RELAXED);
+        file->size = new_size;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
     }
-    else //last block has enough free space
+    else if (has_inline(sb) && new_size <= JFS_INLINE_SIZE)
     {
-        int32_t last_file_block = parent->first_data_block_idx;
-
-        while (-1 != fat[last_file_block])
-        {
-            last_file_block = fat[last_file_block];
-        }
-
-        block = last_file_block;
-        offset = parent->size % files_fit_in_block;
-
-        where_to_add = jfs_get_data_ptr(sb) + last_file_block * sb->block_size +
-                       (parent->size % files_fit_in_block) * sizeof(struct JFile);
+        return inline_pull(file, sb, new_size);
     }
-
-    struct JFile *new_file = (struct JFile *)where_to_add;
-    if (name != NULL)
+    else if (NULL != jfs_file_tail(file) && new_size >= file->size - jfs_file_tail(file)->len) ///Smaller, the tail is cut
     {
-        if (strlen(name) > 63)
-            printf("Too long file name! Only 63 bytes will be written!\n");
-        strcpy(new_file->name, name);
+        tail_trim(file, sb, new_size - (file->size - jfs_file_tail(file)->len));
+        __atomic_sub_fetch(&(sb->data_bytes), file->size - new_size, __ATOMIC_RELAXED);
+        file->size = new_size;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
     }
-    else
-        new_file->name[0] = '\0';
-    new_file->size = 0;
-    new_file->first_data_block_idx = -1;
-    new_file->flags = flags;
-    new_file->coord.my_jfile_block = block;
-    new_file->coord.my_jfile_offset = offset;
-    new_file->coord.parent_jfile_block = parent->coord.my_jfile_block;
-    new_file->coord.parent_jfile_offset = parent->coord.my_jfile_offset;
+    else ///Smaller size
+    {
+        if (NULL != jfs_file_tail(file)) ///Cut goes into the chain
+            tail_trim(file, sb, 0);
 
-    parent->size++;
+        __atomic_sub_fetch(&(sb->data_bytes), file->size - new_size, __ATOMIC_RELAXED);
+        chain_truncate(file, sb, 0 == new_size ? 1 : (new_size - 1) / sb->block_size + 1);
+        file->size = new_size;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    }
 
-    return new_file;
+    return 0;
 }
 
-struct JFile *jfs_get_root_dir(struct JSuper *sb)
+int32_t jfs_resize_file(struct JFile *file, struct JSuper *sb, uint32_t new_size)
 {
-    return &(sb->root);
+    JFS_STAT_OP(JFS_OP_RESIZE);
+    jfs_file_lock(file, sb, 1);
+    int32_t ret = _jfs_resize_file(file, sb, new_size);
+    jfs_file_unlock(file, sb);
+    JFS_STAT_OP_END();
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
 }
 
-int32_t jfs_read_dir(struct JFile *dir, struct JSuper *sb, uint32_t offset, struct JFile **ret)
+///Last block of the chain leaves it. to_free - back to the free list as well
+static void chain_drop_last(struct JFile *file, struct JSuper *sb, uint8_t to_free)
 {
-    int32_t block_pos = dir->first_data_block_idx;
-    int32_t loop_offset = 0;
     int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t last = file->last_data_block_idx;
+    int32_t prev = jfs_get_rfat_ptr(sb)[last];
 
-    if (offset >= dir->size)
+    jfs_seek_index_truncate(sb, file->first_data_block_idx, file->size / sb->block_size);
+    if (0 > prev)
     {
-        *ret = NULL;
-        return 0;
+        file->first_data_block_idx = -1;
     }
-
-    while (offset - loop_offset >= jfs_files_fit_in_block(sb))
+    else
     {
-        block_pos = fat[block_pos];
-        loop_offset += jfs_files_fit_in_block(sb);
+        fat[prev] = -1;
+        jfs_dirty_fat(sb, prev, 1);
     }
-
-    uint8_t *global_pos = jfs_get_data_ptr(sb) +
-                          block_pos * sb->block_size +
-                          (offset - loop_offset) * sizeof(struct JFile);
-
-
-    *ret = (struct JFile *)global_pos;
-
-    return 0;
+    file->last_data_block_idx = prev;
+    if (to_free)
+        jfs_return_free_block(sb, last);
 }
 
-int32_t jfs_write_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *data, uint32_t data_size)
+///Partial last block moves to the open tail block, or becomes the open tail
+///block itself if it does not fit there. Never takes a block. Tails are
+///metadata: they land in blocks the last commit still reads, the file's own
+///last block or space of tails trimmed since, so they go through the journal
+static int32_t _jfs_pack_tail(struct JFile *file, struct JSuper *sb)
 {
-    printf("\tWrite file %s!\n", file->name);
-    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t len = file->size % sb->block_size;
+    struct JTail *tail = (struct JTail *)(file + 1);
 
-    ///Error handle
     if (!jfs_is_file(file))
     {
-        printf("Eww, it is not a file!\n");
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_TYPE, "Eww, it is not a file!\n");
         return -1;
     }
 
-    if (offset < 0 || offset > file->size)
+    if (jfs_is_read_only(sb))
     {
-        printf("Bad offset value!\n");
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_ROFS, "Image is mounted read-only!\n");
         return -1;
     }
 
-    ///Set pointers
-    uint8_t *write_ptr = NULL;
-    int32_t cnt_to_write = data_size;
-    int32_t curr_block = -1;
-    int32_t ret = 0;
-
-    ///Write data
-    for(;;)
-    {
-        ///Error happens
-        if (ret < 0)
-        {
-            printf("Error while write in file!\n");
-            return ret;
-        }
-        ///All done!
-        else if (0 == cnt_to_write)
-        {
-            break;
-        }
-        ///File is empty
-        else if (file->first_data_block_idx < 0)
-        {
-            int32_t new_block = jfs_get_free_block(fat, sb);
-            if (0 >= new_block)
-            {
-                ret = -1;
-                continue;
-            }
-
-            jfs_add_new_block(file, sb, new_block);
-            curr_block = new_block;
-            write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
-        }
-        ///file is not empty, block and place to write is unset
-        else if (NULL == write_ptr)
-        {
-            uint32_t ii;
-            curr_block = file->first_data_block_idx;
+    ///Nothing to pack
+    if (!has_tailpack(sb) || jfs_is_inline(file) || NULL != jfs_file_tail(file) || NULL != jfs_file_comp(file) ||
+        0 == len || len > sb->block_size - sizeof(struct JTailBlock))
+        return 0;
+    jfs_generation_bump(sb);
 
-            for (ii = offset; ii > sb->block_size; ii -= sb->block_size)
-            {
-                curr_block = fat[curr_block];
-            }
+    int32_t last = file->last_data_block_idx;
+    uint8_t *src = jfs_block_idx_to_ptr(last, sb);
 
-            write_ptr = jfs_block_idx_to_ptr(curr_block, sb) + ii;
-        }
-        ///Reach the end of the block
-        else if (jfs_block_idx_to_ptr(curr_block, sb) + sb->block_size == write_ptr)
-        {
-            ///Two cases: EOF or not
-            if (fat[curr_block] >= 0)
-            {
-                curr_block = fat[curr_block];
-                write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
-            }
-            else
-            {
-                int32_t new_block = jfs_get_free_block(fat, sb);
-                if (0 >= new_block)
-                {
-                    ret = -1;
-                    continue;
-                }
+    jfs_tail_lock(sb);
+    struct JTailBlock *head = 0 > sb->tail_block ? NULL : (struct JTailBlock *)jfs_block_idx_to_ptr(sb->tail_block, sb);
+    if (NULL != head && head->fill + len <= sb->block_size)
+    {
+        tail->block = sb->tail_block;
+        tail->offset = head->fill;
+        memcpy((uint8_t *)head + head->fill, src, len);
+        jfs_dirty_meta(sb, (uint8_t *)head + head->fill, len);
+        head->fill += len;
+        head->used += len;
+        jfs_dirty_meta(sb, head, sizeof(struct JTailBlock));
+    }
+    else
+    {
+        head = (struct JTailBlock *)src;
+        memmove(src + sizeof(struct JTailBlock), src, len);
+        head->used = len;
+        head->fill = sizeof(struct JTailBlock) + len;
+        jfs_dirty_meta(sb, head, sizeof(struct JTailBlock) + len);
+        sb->tail_block = last;
+        jfs_dirty_meta(sb, &(sb->tail_block), sizeof(sb->tail_block));
+        tail->block = last;
+        tail->offset = sizeof(struct JTailBlock);
+    }
+    jfs_tail_unlock(sb);
 
-                jfs_add_new_block(file, sb, new_block);
-                curr_block = new_block;
-                write_ptr = jfs_block_idx_to_ptr(curr_block, sb);
-            }
-        }
-        ///All is set, can write
-        else
-        {
-            uint32_t left_in_block = sb->block_size - (write_ptr - jfs_block_idx_to_ptr(curr_block, sb));
-            uint32_t write_in_block = cnt_to_write > left_in_block ? left_in_block : cnt_to_write;
+    chain_drop_last(file, sb, tail->block != last);
+    tail->len = len;
+    file->flags |= JFS_FILE_TAIL;
+    jfs_dirty_meta(sb, file, sizeof(struct JFile) + sizeof(struct JTail));
 
-            if (NULL == data)
-            {
-                memset(write_ptr, FILL_CHAR, write_in_block);
-            }
-            else
-            {
-                memcpy(write_ptr, data - cnt_to_write + data_size, write_in_block);
-            }
-            write_ptr += write_in_block;
-            cnt_to_write -= write_in_block;
-            file->size += write_in_block;
-        }
-    }
+    return 0;
+}
 
+///Images of JFS_FLAG_TAILPACK: the last size % block_size bytes of the file go
+///to a shared tail block. Other files, inline ones and tails too big for a
+///tail block are left as they are. Writes move the tail back first
+int32_t jfs_pack_tail(struct JFile *file, struct JSuper *sb)
+{
+    JFS_STAT_OP(JFS_OP_WRITE);
+    jfs_file_lock(file, sb, 1);
+    int32_t ret = _jfs_pack_tail(file, sb);
+    jfs_file_unlock(file, sb);
+    JFS_STAT_OP_END();
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
     return ret;
 }
 
-int32_t jfs_read_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size)
+///Data of the file becomes a cluster index and the clusters, each compressed
+///on its own, unless that doesn't save a block. On journaled images the
+///stream goes to a new chain, otherwise over the start of the old one
+static int32_t _jfs_compress_file(struct JFile *file, struct JSuper *sb, uint32_t cluster)
 {
-    int32_t *fat = jfs_get_fat_ptr(sb);
-    int32_t block = file->first_data_block_idx;
-    uint32_t offset_block = 0;
-    uint32_t read = 0;
+    uint32_t bs = sb->block_size;
 
-    if (offset >= file->size)
+    if (!jfs_is_file(file))
     {
-        if (NULL != ret_size)
-            *ret_size = 0;
-        return 0;
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_TYPE, "Eww, it is not a file!\n");
+        return -1;
     }
 
-    for (offset_block = offset; offset_block >= sb->block_size; offset_block -= sb->block_size)
+    if (jfs_is_read_only(sb))
     {
-        block = fat[block];
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
     }
 
-    size = size >= file->size - offset ? file->size - offset : size;
-
-    for (;size > 0;)
+    if (0 == cluster)
     {
-        uint32_t read_from_block = sb->block_size - offset_block > size ? size : sb->block_size - offset_block;
-        memcpy(dst + read, jfs_block_idx_to_ptr(block, sb) + offset_block, read_from_block);
-        size -= read_from_block;
-        read += read_from_block;
-        block = fat[block];
-        offset_block = 0;
+        cluster = JFS_CLUSTER_SIZE > bs ? JFS_CLUSTER_SIZE / bs * bs : bs;
+    }
+    else if (0 != cluster % bs)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_INVAL, "Cluster must be a multiple of the block size!\n");
+        return -1;
     }
 
-    *ret_size = read;
-    return 0;
-}
+    ///Nothing to compress
+    if (!has_compress(sb) || jfs_is_inline(file) || NULL != jfs_file_tail(file) || NULL != jfs_file_comp(file) ||
+        file->size <= bs)
+        return 0;
+    jfs_generation_bump(sb);
 
-int32_t jfs_resize_file(struct JFile *file, struct JSuper *sb, uint32_t new_size)
-{
-    int32_t *fat = jfs_get_fat_ptr(sb);
-    ///Error handle
-    if (!jfs_is_file(file))
+    uint32_t clusters = (file->size - 1) / cluster + 1;
+    uint32_t cap = (file->size - 1) / bs * bs; ///A block less than the data takes
+    uint32_t pos = clusters * sizeof(uint32_t);
+    uint8_t *plain = malloc(cluster);
+    uint8_t *stream = malloc(cap);
+    int32_t ret = pos < cap ? 0 : 1; ///1 - not worth it
+
+    if (NULL == plain || NULL == stream)
     {
-        printf("Eww, it is not a file!\n");
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOMEM, "Can't alloc memory to compress %s!\n", file->name);
+        free(plain);
+        free(stream);
         return -1;
     }
 
-    if (new_size == file->size) ///Same size
+    ///Shorter than its data or stored as is, so readers tell the two apart by length
+    for (uint32_t ii = 0; 0 == ret && ii < clusters; ii++)
     {
-        return 0;
+        uint32_t got = 0;
+        _jfs_read_file(file, sb, ii * cluster, plain, cluster, &got);
+        uint32_t n = jfs_lz_compress(plain, got, stream + pos, cap - pos < got - 1 ? cap - pos : got - 1);
+        if (0 == n && cap - pos < got)
+        {
+            ret = 1;
+            continue;
+        }
+        if (0 == n)
+        {
+            memcpy(stream + pos, plain, got);
+            n = got;
+        }
+        pos += n;
+        ((uint32_t *)stream)[ii] = pos;
     }
-    else if (new_size > file->size) ///Bigger size
-    {
-        uint32_t fill_size = new_size - file->size;
 
-        jfs_write_file(file, sb, file->size, NULL, fill_size);
+    ///Journaled, the stream goes to a new chain: its data goes home ahead of
+    ///the record, the plain chain stays whole until the inode points away from
+    ///it. Otherwise it is written over the start of the chain, builders size
+    ///images for the plain data and leave no room for both
+    struct JFile old = *file;
+    uint8_t moved = 0 == ret && is_journaled(sb);
+    if (0 == ret && !moved)
+        ret = _jfs_write_file(file, sb, 0, stream, pos);
+    if (moved)
+    {
+        file->first_data_block_idx = -1;
+        file->last_data_block_idx = -1;
+        file->size = 0;
+        __atomic_sub_fetch(&(sb->data_bytes), old.size, __ATOMIC_RELAXED);
+        ret = _jfs_write_file(file, sb, 0, stream, pos);
+        __atomic_add_fetch(&(sb->data_bytes), old.size - file->size, __ATOMIC_RELAXED);
     }
-    else ///Smaller size
+    if (0 > ret && moved)
     {
-        int32_t block = file->first_data_block_idx;
-        uint32_t ii = 0;
+        free_file_chain(file, sb);
+        file->first_data_block_idx = old.first_data_block_idx;
+        file->last_data_block_idx = old.last_data_block_idx;
+        file->size = old.size;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    }
+    if (0 == ret)
+    {
+        struct JComp *comp = (struct JComp *)(file + 1);
+        if (moved)
+            free_file_chain(&old, sb);
+        else
+            chain_truncate(file, sb, (pos - 1) / bs + 1);
+        file->size = old.size;
+        comp->stored = pos;
+        comp->cluster = cluster;
+        file->flags |= JFS_FILE_COMP;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile) + sizeof(struct JComp));
+    }
+    free(plain);
+    free(stream);
 
-        while (new_size - ii > sb->block_size)
-        {
-            block = fat[block];
+    return 0 > ret ? -1 : 0;
+}
 
-            ii += sb->block_size;
-        }
+///Images of JFS_FLAG_COMPRESS: the file is stored as clusters of cluster bytes
+///of its data (0 - JFS_CLUSTER_SIZE), each compressed. Files that wouldn't get
+///a block shorter, inline and tail packed ones are left as they are. Reads
+///decompress the clusters they touch, writes make the file plain again first
+int32_t jfs_compress_file(struct JFile *file, struct JSuper *sb, uint32_t cluster)
+{
+    JFS_STAT_OP(JFS_OP_WRITE);
+    jfs_file_lock(file, sb, 1);
+    int32_t ret = _jfs_compress_file(file, sb, cluster);
+    jfs_file_unlock(file, sb);
+    JFS_STAT_OP_END();
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
+}
 
-        if (-1 == fat[block]) ///Only last block is resized
-        {
-            file->size = new_size;
-            return 0;
-        }
+static int32_t _jfs_rename_file(struct JFile *file, struct JSuper *sb, char *new_name)
+{
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
 
-        int32_t last_block = block;
-        block = fat[block];
+    if (strlen(new_name) >= JFS_FILE_NAME_SIZE || strlen(new_name) <= 0)
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_INVAL, "Incorrect new name!\n");
+        return -1;
+    }
 
-        do
-        {
-            int32_t block_to_remove = block;
-            block = fat[block];
-            jfs_return_free_block(sb, block_to_remove);
-        }
-        while (-1 != block);
+    if (file == &(sb->root)) ///Root has no parent to be indexed in
+    {
+        jfs_generation_bump(sb);
+        strcpy(file->name, new_name);
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+        return 0;
+    }
 
-        fat[last_block] = -1;
+    struct JFile *parent = get_parent(file, sb);
+    if (NULL != jfs_lookup(parent, sb, new_name))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_EXIST, "File %s already exists!\n", new_name);
+        return -1;
+    }
 
-        file->size = new_size;
+    jfs_generation_bump(sb);
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    jfs_dir_index_remove(parent, sb, file);
+    strcpy(file->name, new_name);
+    if (has_itable(sb))
+    {
+        dirent_set(sb, file->coord.my_jfile_block, file->coord.my_jfile_offset, new_name, inode_number(sb, file));
     }
+    jfs_dir_index_insert(parent, sb, file);
 
     return 0;
 }
 
 int32_t jfs_rename_file(struct JFile *file, struct JSuper *sb, char *new_name)
 {
-    //TODO: check, does file with that name already exist?
-    if (strlen(new_name) >= 64 || strlen(new_name) <= 0)
-    {
-        //printf("Incorrect new name!\n");
+    if (0 != ns_write_enter(sb))
         return -1;
-    }
-
-    strcpy(file->name, new_name);
 
-    return 0;
+    JFS_STAT_OP(JFS_OP_RENAME);
+    int32_t ret = _jfs_rename_file(file, sb, new_name);
+    JFS_STAT_OP_END();
+    jfs_ns_write_unlock(sb);
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
 }
 
 void update_child_coord(struct JFile *file, struct JSuper *sb)
 {
     int32_t *fat = jfs_get_fat_ptr(sb);
 
+    if (has_itable(sb)) ///Children name their parent by inode number, it does not move
+        return;
+
     if (jfs_is_dir(file))
     {
         int32_t block = file->first_data_block_idx;
         struct JFile *to_update = (struct JFile *)jfs_block_idx_to_ptr(block, sb);
         uint32_t size = file->size;
 
+        JFS_STAT(child_fixups, size);
         while (0 != size)
         {
             size--;
             to_update->coord.parent_jfile_block = file->coord.my_jfile_block;
             to_update->coord.parent_jfile_offset = file->coord.my_jfile_offset;
+            jfs_dirty_meta(sb, &(to_update->coord), sizeof(struct JCoord));
 
             if ((struct JFile *)to_update - (struct JFile *)jfs_block_idx_to_ptr(block, sb) == jfs_files_fit_in_block(sb) - 1) ///Last in block
             {
-                block = fat[block];
+                block = jfs_fat_next(fat, block);
                 to_update = (struct JFile *)jfs_block_idx_to_ptr(block, sb);
             }
             else
@@ -421,10 +2274,11 @@ void update_child_coord(struct JFile *file, struct JSuper *sb)
 //TODO: get parent
 struct JFile *get_parent(struct JFile *file, struct JSuper *sb)
 {
-    return (-1 == file->coord.parent_jfile_block) ?
-           &(sb->root) :
-           (struct JFile *) (jfs_get_data_ptr(sb) +
-           sb->block_size * file->coord.parent_jfile_block +
+    if (-1 == file->coord.parent_jfile_block)
+        return &(sb->root);
+    if (has_itable(sb))
+        return jfs_get_inode(sb, file->coord.parent_jfile_block);
+    return (struct JFile *) (jfs_block_idx_to_ptr(file->coord.parent_jfile_block, sb) +
            sizeof(struct JFile) * file->coord.parent_jfile_offset);
 }
 
@@ -434,56 +2288,123 @@ void remove_file_object(struct JFile *file, struct JSuper *sb)
 
     struct JFile *parent = get_parent(file, sb);
 
+    jfs_dir_index_remove(parent, sb, file);
     parent->size--; //Where?..
-    printf("Parent: %s\n", parent->name);
+    jfs_dirty_meta(sb, parent, sizeof(struct JFile));
+    JFS_DEBUG(JFS_LOG_DIR, "Parent: %s\n", parent->name);
 
-    int32_t block = parent->first_data_block_idx;
-    int32_t penult_block = -1;
-    while (-1 != fat[block]) ///Reach last parent's block
-    {
-        penult_block = block;
-        block = fat[block];
-    }
+    int32_t block = parent->last_data_block_idx;
+    int32_t penult_block = jfs_get_rfat_ptr(sb)[block];
+    uint32_t last_slot = parent->size % jfs_files_fit_in_block(sb); ///p->size is already decreased
 
-    struct JFile *last_parents_fobj =
-        (struct JFile *)jfs_block_idx_to_ptr(block, sb) + (parent->size % jfs_files_fit_in_block(sb)); ///p->size is already decreased
+    struct JFile *last_parents_fobj = (struct JFile *)jfs_block_idx_to_ptr(block, sb) + last_slot;
 
-    if (last_parents_fobj != file) ///Move last fobj to cur's place
+    if (has_itable(sb))
+    {
+        ///Last entry moves into the hole, its inode learns the new place
+        if (block != file->coord.my_jfile_block || last_slot != file->coord.my_jfile_offset)
+        {
+            JFS_STAT(entry_swaps, 1);
+            uint8_t *hole = dirent_at(sb, file->coord.my_jfile_block, file->coord.my_jfile_offset);
+            struct JFile *moved = jfs_dir_entry(sb, block, last_slot);
+            memcpy(hole, dirent_at(sb, block, last_slot), jfs_dir_entry_size(sb->flags));
+            jfs_dirty_meta(sb, hole, jfs_dir_entry_size(sb->flags));
+            moved->coord.my_jfile_block = file->coord.my_jfile_block;
+            moved->coord.my_jfile_offset = file->coord.my_jfile_offset;
+            jfs_dirty_meta(sb, &(moved->coord), sizeof(struct JCoord));
+            jfs_dir_index_relocate(parent, sb, block, last_slot, moved);
+        }
+    }
+    else if (last_parents_fobj != file) ///Move last fobj to cur's place
     {
+        JFS_STAT(entry_swaps, 1);
         struct JCoord jc_file;
         memcpy(&jc_file, &(file->coord), sizeof(struct JCoord));
         memcpy(file, last_parents_fobj, sizeof(struct JFile));
         memcpy(&(file->coord), &jc_file, sizeof(struct JCoord));
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
+        jfs_dir_index_relocate(parent, sb, last_parents_fobj->coord.my_jfile_block,
+                               last_parents_fobj->coord.my_jfile_offset, file);
         update_child_coord(file, sb);
     }
 
-    if ((void *)last_parents_fobj == (void *)jfs_block_idx_to_ptr(block, sb)) ///Last fobj is 1st in block
+    if (0 == last_slot) ///Last fobj is 1st in block
     {
         if (0 > penult_block)
         {
+            jfs_dir_index_drop(sb, parent->first_data_block_idx);
+            jfs_seek_index_truncate(sb, parent->first_data_block_idx, 0);
             parent->first_data_block_idx = -1;
         }
         else
         {
+            jfs_seek_index_truncate(sb, parent->first_data_block_idx, parent->size / jfs_files_fit_in_block(sb));
             fat[penult_block] = -1;
+            jfs_dirty_fat(sb, penult_block, 1);
         }
+        parent->last_data_block_idx = penult_block;
 
         jfs_return_free_block(sb, block);
     }
 }
 
-int32_t jfs_move_file(struct JFile *file, struct JSuper *sb, struct JFile *new_parent)
+///Entry goes over to new_parent, the inode and everything below it stay in place
+static int32_t move_dirent(struct JFile *file, struct JSuper *sb, struct JFile *new_parent)
+{
+    int32_t block;
+    uint32_t offset;
+
+    if (NULL != jfs_lookup(new_parent, sb, file->name))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_EXIST, "File %s already exists!\n", file->name);
+        return -1;
+    }
+    jfs_generation_bump(sb);
+    if (0 != dir_add_slot(new_parent, sb, &block, &offset))
+        return -1;
+
+    dirent_set(sb, block, offset, file->name, inode_number(sb, file));
+
+    remove_file_object(file, sb);
+
+    file->coord.my_jfile_block = block;
+    file->coord.my_jfile_offset = offset;
+    file->coord.parent_jfile_block = inode_number(sb, new_parent);
+    new_parent->size++;
+    jfs_dirty_meta(sb, file, sizeof(struct JFile));
+    jfs_dirty_meta(sb, new_parent, sizeof(struct JFile));
+    jfs_dir_index_insert(new_parent, sb, file);
+
+    return 0;
+}
+
+static int32_t _jfs_move_file(struct JFile *file, struct JSuper *sb, struct JFile *new_parent)
 {
-    //TODO: Check, does file already exist in new_parent? (It is for jfs_create_file)
-    ///Copy to new directory
-    struct JFile *new_place = jfs_create_file(new_parent, sb, file->name, file->flags);
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
+
+    if (new_parent == get_parent(file, sb))
+    {
+        return 0;
+    }
+
+    if (has_itable(sb))
+        return move_dirent(file, sb, new_parent);
+
+    ///Copy to new directory, fails if the name is taken there. Bumps the generation
+    struct JFile *new_place = _jfs_create_file(new_parent, sb, file->name, file->flags);
     if (NULL == new_place)
     {
         return -1;
     }
 
     new_place->first_data_block_idx = file->first_data_block_idx;
+    new_place->last_data_block_idx = file->last_data_block_idx;
     new_place->size = file->size;
+    jfs_dirty_meta(sb, new_place, sizeof(struct JFile));
 
     ///Update child's coord.parent_*
     update_child_coord(new_place, sb);
@@ -494,51 +2415,77 @@ int32_t jfs_move_file(struct JFile *file, struct JSuper *sb, struct JFile *new_p
     return 0;
 }
 
+int32_t jfs_move_file(struct JFile *file, struct JSuper *sb, struct JFile *new_parent)
+{
+    if (0 != ns_write_enter(sb))
+        return -1;
+
+    JFS_STAT_OP(JFS_OP_MOVE);
+    int32_t ret = _jfs_move_file(file, sb, new_parent);
+    JFS_STAT_OP_END();
+    jfs_ns_write_unlock(sb);
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
+}
+
 int32_t jfs_remove_file(struct JFile *file, struct JSuper *sb)
 {
+    if (jfs_is_read_only(sb))
+    {
+        JFS_ERROR(JFS_LOG_DIR, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
+    if (0 != ns_write_enter(sb))
+        return -1;
+    jfs_generation_bump(sb);
+
+    int32_t ret;
+    JFS_STAT_OP(JFS_OP_REMOVE);
     if (file == &(sb->root) || file->coord.my_jfile_block == -1) ///Is root
-        return _jfs_remove_file(file, sb, 0);
+        ret = _jfs_remove_file(file, sb, 0);
     else
-        return _jfs_remove_file(file, sb, 1);
+        ret = _jfs_remove_file(file, sb, 1);
+    JFS_STAT_OP_END();
+
+    jfs_ns_write_unlock(sb);
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+    return ret;
 }
 
 ///Mode = 0 - dont replase with last, mode = 1 - replace
 int32_t _jfs_remove_file(struct JFile *file, struct JSuper *sb, uint8_t mode)
 {
-    printf("free %s\n", file->name);
+    JFS_DEBUG(JFS_LOG_DIR, "free %s\n", file->name);
 
     int32_t *fat = jfs_get_fat_ptr(sb);
 
     if (jfs_is_dir(file)) ///Remove directory content
     {
+        jfs_dir_index_drop(sb, file->first_data_block_idx);
+        jfs_seek_index_truncate(sb, file->first_data_block_idx, 0);
         int32_t block = file->first_data_block_idx;
-        struct JFile *to_remove = (struct JFile *)jfs_block_idx_to_ptr(block, sb);
+        uint32_t slot = 0;
         while (0 != file->size)
         {
             file->size--;
-            _jfs_remove_file(to_remove, sb, 0);
-            if ((struct JFile *)to_remove - (struct JFile *)jfs_block_idx_to_ptr(block, sb) == jfs_files_fit_in_block(sb) - 1 || ///Last in block
-                0 == file->size) ///Or last in parent directory
-            {
-                int32_t that_block = block;
-                block = fat[block];
-                to_remove = (struct JFile *)jfs_block_idx_to_ptr(block, sb);
-                jfs_return_free_block(sb, that_block);
-            }
-            else
+            _jfs_remove_file(jfs_dir_entry(sb, block, slot), sb, 0);
+            if (++slot == (uint32_t)jfs_files_fit_in_block(sb)) ///Last in block
             {
-                to_remove++;
+                block = jfs_fat_next(fat, block);
+                slot = 0;
             }
         }
+        jfs_return_free_chain(sb, file->first_data_block_idx); ///Entries are gone, blocks go back run by run
+        file->first_data_block_idx = -1;
+        file->last_data_block_idx = -1;
+        jfs_dirty_meta(sb, file, sizeof(struct JFile));
     }
     else ///Remove file content
     {
-        for (int32_t block = file->first_data_block_idx; block != -1; )
-        {
-            int32_t block_next = fat[block];
-            jfs_return_free_block(sb, block);
-            block = block_next;
-        }
+        __atomic_sub_fetch(&(sb->data_bytes), file->size, __ATOMIC_RELAXED);
+        free_file_chain(file, sb);
     }
 
     ///Remove JFile object
@@ -546,18 +2493,37 @@ int32_t _jfs_remove_file(struct JFile *file, struct JSuper *sb, uint8_t mode)
     {
         remove_file_object(file, sb);
     }
+    if (has_itable(sb) && file != &(sb->root))
+        inode_free(sb, file);
 
     return 0;
 }
 
-//TODO: should be implemented other way, if another flags fill appear
 inline int8_t jfs_is_dir(struct JFile *file)
 {
-    return file->flags;
+    return file->flags & JFS_FILE_DIR;
 }
 
-//TODO: should be implemented other way, if another flags fill appear
 inline int8_t jfs_is_file(struct JFile *file)
 {
-    return !file->flags;
+    return !(file->flags & JFS_FILE_DIR);
+}
+
+inline int8_t jfs_is_inline(struct JFile *file)
+{
+    return 0 != (file->flags & JFS_FILE_INLINE);
+}
+
+int32_t jfs_statfs(struct JSuper *sb, struct JStatfs *st)
+{
+    jfs_alloc_lock(sb);
+    st->block_size = sb->block_size;
+    st->blocks_count = sb->blocks_count;
+    st->free_blocks = jfs_free_blocks(sb);
+    st->largest_free_run = jfs_largest_free_run(sb);
+    st->used_bytes = (uint64_t)(sb->blocks_count - st->free_blocks) * sb->block_size + sb->system_bytes;
+    st->data_bytes = __atomic_load_n(&(sb->data_bytes), __ATOMIC_RELAXED);
+    jfs_alloc_unlock(sb);
+
+    return 0;
 }
@@ -2,10 +2,36 @@
 #define __JFS_H__
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #define JFS_FILE_NAME_SIZE  64
 #define JFS_FAT_EOF         -1
 #define FILL_CHAR           '\0'
+#define JFS_EXTENT_SCAN     8   //How many free extents to look through for one that fits
+#define JFS_MAGIC           0x3153464a //"JFS1"
+#define JFS_VERSION         5
+#define JFS_FLAG_JOURNAL    0x1 //Image ends with a redo journal of metadata changes
+#define JFS_FLAG_ITABLE     0x2 //Files live in an inode table, directory blocks hold JDirent
+#define JFS_FLAG_COMPACT    0x4 //Directory blocks hold JDirentCompact, needs JFS_FLAG_ITABLE
+#define JFS_FLAG_INLINE     0x8 //Inodes carry the data of small files, needs JFS_FLAG_ITABLE
+#define JFS_FLAG_TAILPACK   0x10 //Last partial blocks of files may share tail blocks, needs JFS_FLAG_ITABLE
+#define JFS_FLAG_COMPRESS   0x20 //Files may keep their data as compressed clusters, needs JFS_FLAG_ITABLE
+#define JFS_FILE_DIR        0x1 //JFile flags: directory
+#define JFS_FILE_INLINE     0x2 //JFile flags: data is in the inode, no blocks
+#define JFS_FILE_TAIL       0x4 //JFile flags: the last size % block_size bytes are in a tail block
+#define JFS_FILE_COMP       0x8 //JFile flags: the chain holds a cluster index and compressed clusters
+#define JFS_INODE_FREE      0x80 //flags of an unused inode table record
+#define JFS_DIRENT_INLINE   19  //Name bytes of a JDirentCompact, longer names end in the inode
+#define JFS_INLINE_SIZE     160 //Data bytes an inode of JFS_FLAG_INLINE images holds, records are 256 bytes
+#define JFS_CLUSTER_SIZE    (32u << 10) //Default bytes of file data compressed as one piece
+#define JFS_JOURNAL_BYTES   (4u << 20) //Default journal size
+
+//jfs_mount flags
+#define JFS_MOUNT_RDONLY    0x0
+#define JFS_MOUNT_RDWR      0x1 //Changes go straight to the image file (MAP_SHARED), or through the journal
+#define JFS_MOUNT_PREAD     0x2 //No mmap of the image: tree read in at mount, file data through a block cache. Read-only
+#define JFS_CACHE_MIB       64  //Default block cache of pread mounts
+#define JFS_READAHEAD       64  //Default blocks read ahead along a chain
 //#define JFS_BLOCK_SIZE 128
 
 enum JFileType
@@ -27,42 +53,288 @@ struct JFile
     char name[JFS_FILE_NAME_SIZE];
     uint32_t size; //if is dir, size is cnt of files in
     int32_t first_data_block_idx;
-    uint8_t flags; //0 - is file, 1 - is dir
+    int32_t last_data_block_idx; //Tail of the chain, so appends don't walk the FAT
+    uint8_t flags; //JFS_FILE_*, 0 - is file
     //enum JFileType type; //TODO: Causes crash. Explore why
     //create_time
     //update_time
-    struct JCoord coord;
+    struct JCoord coord; //With an inode table: my_* is the JDirent, parent_jfile_block the parent's inode (-1 root)
+};
+
+//Directory entry of images with an inode table. Moves and removes edit
+//entries and one inode, children refer to their parent by inode number.
+struct JDirent
+{
+    char name[JFS_FILE_NAME_SIZE];
+    uint32_t ino;
+};
+
+//Directory entry of compact images, 24 bytes against 68 of JDirent and 96 of
+//JFile. Scans compare the length and the inline bytes, the inode is read only
+//for names longer than JFS_DIRENT_INLINE whose start matches.
+struct JDirentCompact
+{
+    uint32_t ino;
+    uint8_t name_len;
+    char name[JFS_DIRENT_INLINE]; //No terminating zero when full
+};
+
+//Where the tail of a JFS_FILE_TAIL file is. Kept in its inode record right
+//after the JFile, in the place of the inline data. The chain holds only
+//the full blocks before it.
+struct JTail
+{
+    int32_t block;
+    uint32_t offset; //From the block start, past the JTailBlock head
+    uint32_t len;    //size % block_size of the file
+};
+
+//Head of a tail block. Tails are appended at fill and never move, used
+//counts the live bytes: at 0 the block is freed, or refilled if it is open.
+struct JTailBlock
+{
+    uint32_t used;
+    uint32_t fill;
+};
+
+//Data of a JFS_FILE_COMP file, kept in its inode record like a JTail. The
+//chain starts with uint32_t ends[clusters], the stream offset where each
+//cluster ends, then the clusters. The first one starts right after the
+//index; a cluster as long as its data is stored as is.
+struct JComp
+{
+    uint32_t stored;  //Bytes of the stream, index included
+    uint32_t cluster; //Bytes of file data per cluster, a multiple of block_size
 };
 
 struct JSuper
 {
+    uint32_t magic;
+    uint32_t version;
     uint32_t block_size;
     uint32_t blocks_count;
     uint32_t system_bytes; //Bytes before 1st data block
-    uint32_t total_bytes;
     int32_t first_free_block;
+    uint32_t free_blocks;
+    uint32_t flags;        //Format options, JFS_FLAG_*
+    uint64_t total_bytes;
+    uint64_t data_bytes;   //Sum of regular files sizes
+    uint64_t journal_bytes; //Journal after the data blocks, 0 - none
+    uint32_t inodes_count;  //Inode table after the reverse FAT, 0 - none
+    int32_t free_inode;     //First unused inode, they are chained by first_data_block_idx
+    int32_t tail_block;     //Tail block new tails are appended to, -1 - none
     struct JFile root;
 };
 
+//Piece of file data inside a mounted image, valid until the file is changed
+struct JSpan
+{
+    const uint8_t *ptr;
+    uint32_t len;
+};
+
+//Stateful directory listing, remembers where it stopped.
+//Directory must not be changed while it is iterated.
+struct JDirIter
+{
+    struct JFile *dir;
+    int32_t block; //Current block of the directory chain
+    uint32_t slot; //Next entry in that block
+    uint32_t pos;  //Entries returned so far
+};
+
+struct JDefragFrame
+{
+    struct JDirIter it;
+    uint8_t phase;  //0 - own chain, 1 - file chains, 2 - subdirectories
+};
+
+//Online compaction cursor, walks the tree depth-first and moves chains
+//down into the lowest free runs. Any other mutation restarts the pass.
+struct JDefrag
+{
+    struct JSuper *sb;
+    uint32_t generation;
+    uint32_t depth;
+    uint32_t cap;
+    struct JDefragFrame *stack;
+    uint32_t moved_chains;
+    uint32_t moved_blocks;
+    uint32_t skipped_chains; //No free extent was long enough
+};
+
+struct JStatfs
+{
+    uint32_t block_size;
+    uint32_t blocks_count;
+    uint32_t free_blocks;
+    uint32_t largest_free_run; //Longest run of contiguous free blocks
+    uint64_t used_bytes;       //Bytes of blocks in use, metadata included
+    uint64_t data_bytes;
+};
+
+//Block cache of a pread mount, counters since mount
+struct JCacheStats
+{
+    uint64_t hits;           //Blocks found in the cache
+    uint64_t misses;         //Blocks a read had to wait for the device
+    uint64_t readahead;      //Blocks read ahead of the readers
+    uint64_t readahead_hits; //Blocks read ahead that were used
+    uint64_t reads;          //Device requests
+    uint64_t read_bytes;
+};
+
+uint32_t jfs_system_size(uint32_t blocks_count);
+uint32_t jfs_system_size_inodes(uint32_t blocks_count, uint32_t inodes_count);
+uint32_t jfs_system_size_opts(uint32_t blocks_count, uint32_t inodes_count, uint32_t flags);
+uint32_t jfs_inode_size(uint32_t flags);
+void jfs_format(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count);
+void jfs_format_inodes(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count, uint32_t inodes_count);
+void jfs_format_opts(struct JSuper *sb, uint32_t block_size, uint32_t blocks_count, uint32_t inodes_count, uint32_t flags);
+uint32_t jfs_dir_entry_size(uint32_t flags);
 int32_t jfs_get_free_block(int32_t *fat, struct JSuper *sb);
 void jfs_return_free_block(struct JSuper *sb, int32_t free_block);
+int32_t jfs_get_free_extent(struct JSuper *sb, uint32_t want, uint32_t *got);
+void jfs_return_free_extent(struct JSuper *sb, int32_t start, uint32_t count);
+void jfs_return_free_chain(struct JSuper *sb, int32_t block);
+int32_t jfs_take_free_range(struct JSuper *sb, int32_t start, uint32_t count);
+uint32_t jfs_free_blocks(struct JSuper *sb);
 void jfs_add_new_block(struct JFile *file, struct JSuper *sb, int32_t new_block_idx);
+void jfs_add_new_extent(struct JFile *file, struct JSuper *sb, int32_t start, uint32_t count);
 struct JFile *jfs_create_file(struct JFile *parent, struct JSuper *sb, char *name, uint8_t flags);
 int32_t *jfs_get_fat_ptr(struct JSuper *sb);
+int32_t *jfs_get_rfat_ptr(struct JSuper *sb);
 uint8_t *jfs_get_data_ptr(struct JSuper *sb);
 uint8_t *jfs_block_idx_to_ptr(int32_t block_idx, struct JSuper *sb);
+struct JFile *jfs_get_itable_ptr(struct JSuper *sb);
+struct JFile *jfs_get_inode(struct JSuper *sb, uint32_t ino);
+struct JFile *jfs_dir_entry(struct JSuper *sb, int32_t block, uint32_t slot);
+uint8_t *jfs_inline_data(struct JFile *file); //Data of a JFS_FILE_INLINE file, NULL for others
+struct JTail *jfs_file_tail(struct JFile *file); //Tail of a JFS_FILE_TAIL file, NULL for others
+uint8_t *jfs_tail_data(struct JFile *file, struct JSuper *sb);
+uint32_t jfs_tail_plan(uint32_t *fill, uint32_t len, uint32_t block_size);
+struct JComp *jfs_file_comp(struct JFile *file); //Stream of a JFS_FILE_COMP file, NULL for others
 int32_t jfs_read_dir(struct JFile *dir, struct JSuper *sb, uint32_t offset, struct JFile **ret);
+void jfs_dir_iter_init(struct JDirIter *it, struct JFile *dir, struct JSuper *sb);
+struct JFile *jfs_dir_iter_next(struct JDirIter *it, struct JSuper *sb);
+uint32_t jfs_dir_iter_next_block(struct JDirIter *it, struct JSuper *sb, struct JFile **out, uint32_t max);
 struct JFile *jfs_get_root_dir(struct JSuper *sb);
+struct JFile *get_parent(struct JFile *file, struct JSuper *sb);
+struct JFile *jfs_lookup(struct JFile *dir, struct JSuper *sb, char *name);
+struct JFile *jfs_resolve_path(struct JSuper *sb, const char *path);
 int32_t jfs_files_fit_in_block(struct JSuper *sb);
+uint32_t jfs_contig_blocks(int32_t *fat, int32_t block, uint32_t max);
 int8_t jfs_is_dir(struct JFile *file);
 int8_t jfs_is_file(struct JFile *file);
+int8_t jfs_is_inline(struct JFile *file);
 int32_t jfs_write_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *data, uint32_t data_size);
 int32_t jfs_read_file(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size);
+int32_t jfs_read_file_iov(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                          struct iovec *iov, int iovcnt, int *ret_cnt, uint32_t *ret_size);
+int32_t jfs_writev(struct JFile *file, struct JSuper *sb, uint32_t offset, const struct iovec *iov, int iovcnt);
+int32_t jfs_read_file_spans(struct JFile *file, struct JSuper *sb, uint32_t offset, uint32_t size,
+                            struct JSpan *spans, uint32_t max_spans, uint32_t *ret_spans, uint32_t *ret_size);
 int32_t jfs_rename_file(struct JFile *file, struct JSuper *sb, char *new_name);
 int32_t jfs_resize_file(struct JFile *file, struct JSuper *sb, uint32_t new_size);
+int32_t jfs_pack_tail(struct JFile *file, struct JSuper *sb);
+int32_t jfs_compress_file(struct JFile *file, struct JSuper *sb, uint32_t cluster);
 int32_t jfs_move_file(struct JFile *file, struct JSuper *sb, struct JFile *new_parent);
 int32_t jfs_remove_file(struct JFile *file, struct JSuper *sb);
 int32_t _jfs_remove_file(struct JFile *file, struct JSuper *sb, uint8_t mode); //Used in jfs_remove_file
+int32_t jfs_statfs(struct JSuper *sb, struct JStatfs *st);
+int32_t jfs_check_super(struct JSuper *sb, uint64_t image_size);
+struct JSuper *jfs_mount(const char *path, uint32_t flags);
+int32_t jfs_umount(struct JSuper *sb);
+int32_t jfs_set_block_cache(struct JSuper *sb, uint32_t mib, uint32_t readahead);
+int32_t jfs_cache_stats(struct JSuper *sb, struct JCacheStats *stats);
+int8_t jfs_is_read_only(struct JSuper *sb);
+void update_child_coord(struct JFile *file, struct JSuper *sb);
+int32_t jfs_defrag_begin(struct JDefrag *df, struct JSuper *sb);
+int32_t jfs_defrag_step(struct JDefrag *df, uint32_t max_blocks);
+void jfs_defrag_end(struct JDefrag *df);
+
+//Concurrency, for images with attached state (jfs_mount, jfs_attach).
+//JFile pointers stay valid only inside jfs_ns_read_lock/unlock: lookups,
+//listings and held entries go there. Sections nest and scale across threads.
+//File data ops lock the file themselves and may run in a section; create,
+//rename, move, remove and defrag steps take the namespace exclusively and
+//fail if the calling thread is inside a read section only. Lookup and change
+//at once go in jfs_ns_write_lock/unlock. jfs_attach, jfs_detach,
+//jfs_set_seek_index and jfs_set_block_cache must not race with anything.
+//Without state no locks.
+void jfs_ns_read_lock(struct JSuper *sb);
+void jfs_ns_read_unlock(struct JSuper *sb);
+void jfs_ns_write_lock(struct JSuper *sb);
+void jfs_ns_write_unlock(struct JSuper *sb);
+int32_t jfs_defrag_image(const char *path, uint8_t truncate);
+
+//Durability, for RDWR mounts of images with a journal (jfs_journal_add).
+//Every mutator is committed before it returns, concurrent ones share one
+//sync. Inside a section changes wait for the next commit, jfs_journal_sync
+//after the section makes them durable; blocks freed there are reused only
+//after it. Mount replays finished commits. A commit bigger than the journal
+//fails with JFS_ERR_NOSPC, one that can't be written with JFS_ERR_IO, and
+//every later one with it, the file keeps the last one; the journal always
+//fits the system area.
+int32_t jfs_journal_add(const char *path, uint64_t bytes);
+int32_t jfs_journal_sync(struct JSuper *sb);
+
+//Errors. Calls that fail return -1 (or NULL) and leave the reason for the
+//calling thread in jfs_last_error(); messages are logged as set in jfs_log.h.
+enum JError
+{
+    JFS_OK,
+    JFS_ERR_NOMEM,      //Out of memory
+    JFS_ERR_NOSPC,      //No free blocks left
+    JFS_ERR_EXIST,      //Name already taken
+    JFS_ERR_NOENT,      //No such file or image
+    JFS_ERR_ROFS,       //Read-only mount
+    JFS_ERR_INVAL,      //Bad argument
+    JFS_ERR_TYPE,       //File where a directory is needed, or the other way
+    JFS_ERR_FBIG,       //File would outgrow its size field
+    JFS_ERR_BUSY,       //Namespace pinned by the calling thread, or image in use
+    JFS_ERR_IO,         //Read, write or sync of the image failed
+    JFS_ERR_CORRUPT     //Not a jfs image, or its metadata is broken
+};
+
+int32_t jfs_last_error(void);
+const char *jfs_strerror(int32_t code);
+
+//Statistics, in builds with -DJFS_STATS (otherwise the calls return -1).
+//Threads count into their own counters, jfs_stats_get sums all threads of the
+//process, exited ones included. Work is charged to the outermost call of
+//the thread, JFS_OP_OTHER is work outside of them (iterators, mount, defrag).
+enum JStatOp
+{
+    JFS_OP_OTHER,
+    JFS_OP_CREATE,
+    JFS_OP_LOOKUP,
+    JFS_OP_READ_DIR,
+    JFS_OP_READ,        //jfs_read_file, _iov and _spans
+    JFS_OP_WRITE,       //jfs_write_file, jfs_writev, jfs_pack_tail and jfs_compress_file
+    JFS_OP_RESIZE,
+    JFS_OP_RENAME,
+    JFS_OP_MOVE,
+    JFS_OP_REMOVE,
+    JFS_OP_COUNT
+};
+
+struct JStats
+{
+    uint64_t ops[JFS_OP_COUNT];
+    uint64_t fat_hops[JFS_OP_COUNT];   //fat[] links followed
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t bytes_read;            //Copied out by jfs_read_file
+    uint64_t bytes_written;         //Copied in by jfs_write_file and jfs_writev
+    uint64_t dir_entries_scanned;   //Names compared by lookups
+    uint64_t child_fixups;          //Parent coords rewritten by update_child_coord
+    uint64_t entry_swaps;           //Last entries moved into holes by remove_file_object
+};
+
+int32_t jfs_stats_get(struct JStats *stats);
+int32_t jfs_stats_reset(void); //Later jfs_stats_get count from here
+int32_t jfs_stats_dump(const struct JStats *stats, char *buf, uint32_t size); //"name value" lines, returns the length snprintf would
 
 //TODO: Delete when merge with Jetos
 #ifndef FS_H
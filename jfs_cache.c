@@ -0,0 +1,392 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+///Block cache of pread mounts. Only file data goes through it, the tree is
+///read in whole at mount. A miss reads the rest of the request and readahead
+///reads further, both walk fat[] from the block at hand, so a fragmented
+///file is prefetched in chain order. Every physically contiguous piece of the
+///chain is one device request of up to JFS_CACHE_IO bytes.
+
+static inline struct JCacheShard *cache_shard(struct JCache *c, int32_t block)
+{
+    return &(c->shards[(uint32_t)block % JFS_CACHE_SHARDS]);
+}
+
+static inline uint32_t cache_bucket(struct JCacheShard *sh, int32_t block)
+{
+    return ((uint32_t)block / JFS_CACHE_SHARDS) & (sh->buckets - 1);
+}
+
+///Slot of block or -1. Shard lock held
+static int32_t shard_find(struct JCacheShard *sh, int32_t block)
+{
+    int32_t slot = sh->bucket[cache_bucket(sh, block)];
+
+    while (0 <= slot && sh->block[slot] != block)
+        slot = sh->next[slot];
+
+    return slot;
+}
+
+///Free or evicted slot now holding block. Shard lock held
+static int32_t shard_insert(struct JCacheShard *sh, int32_t block)
+{
+    int32_t slot;
+
+    for (;;)
+    {
+        slot = sh->hand;
+        sh->hand = (sh->hand + 1) % sh->slots;
+        if (0 > sh->block[slot])
+            break;
+        if (0 == (sh->ref[slot] & JFS_CACHE_REF))
+        {
+            int32_t *link = &(sh->bucket[cache_bucket(sh, sh->block[slot])]);
+            while (*link != slot)
+                link = &(sh->next[*link]);
+            *link = sh->next[slot];
+            break;
+        }
+        sh->ref[slot] &= ~JFS_CACHE_REF; //Second chance
+    }
+
+    uint32_t bucket = cache_bucket(sh, block);
+    sh->block[slot] = block;
+    sh->next[slot] = sh->bucket[bucket];
+    sh->bucket[bucket] = slot;
+
+    return slot;
+}
+
+///Copy len bytes from off of a cached block. Returns its flags before the
+///use, 0 - not cached
+static uint8_t cache_copy(struct JCache *c, int32_t block, uint32_t off, uint8_t *dst, uint32_t len)
+{
+    struct JCacheShard *sh = cache_shard(c, block);
+    uint8_t flags = 0;
+
+    pthread_mutex_lock(&(sh->lock));
+    int32_t slot = shard_find(sh, block);
+    if (0 <= slot)
+    {
+        flags = sh->ref[slot] | JFS_CACHE_REF;
+        sh->ref[slot] = JFS_CACHE_REF;
+        sh->hits++;
+        if (flags & JFS_CACHE_AHEAD)
+            sh->readahead_hits++;
+        memcpy(dst, sh->data + (uint64_t)slot * c->block_size + off, len);
+    }
+    pthread_mutex_unlock(&(sh->lock));
+
+    return flags;
+}
+
+static int8_t cache_has(struct JCache *c, int32_t block)
+{
+    struct JCacheShard *sh = cache_shard(c, block);
+
+    pthread_mutex_lock(&(sh->lock));
+    int8_t ret = 0 <= shard_find(sh, block);
+    pthread_mutex_unlock(&(sh->lock));
+
+    return ret;
+}
+
+static void cache_put(struct JCache *c, int32_t block, const uint8_t *src, uint8_t flags)
+{
+    struct JCacheShard *sh = cache_shard(c, block);
+
+    pthread_mutex_lock(&(sh->lock));
+    if (0 > shard_find(sh, block)) ///Another reader may have brought it meanwhile
+    {
+        int32_t slot = shard_insert(sh, block);
+        memcpy(sh->data + (uint64_t)slot * c->block_size, src, c->block_size);
+        sh->ref[slot] = flags;
+    }
+    pthread_mutex_unlock(&(sh->lock));
+}
+
+///Chain blocks from block that are physically contiguous and not cached, at most max
+static uint32_t uncached_run(struct JCache *c, int32_t *fat, int32_t block, uint32_t max)
+{
+    uint32_t run = 0;
+
+    while (run < max && !cache_has(c, block + run))
+    {
+        run++;
+        if (fat[block + run - 1] != block + (int32_t)run)
+            break;
+    }
+
+    return run;
+}
+
+static int32_t device_read(struct JSuper *sb, struct JCache *c, int fd, int32_t block, uint32_t count, uint8_t *buf)
+{
+    uint64_t offset = sb->system_bytes + (uint64_t)block * sb->block_size;
+    uint64_t len = (uint64_t)count * sb->block_size;
+
+    for (uint8_t *ptr = buf; len > 0; )
+    {
+        ssize_t got = pread(fd, ptr, len, offset);
+        if (got <= 0)
+        {
+            JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_IO, "Can't read image!\n");
+            return -1;
+        }
+        __atomic_add_fetch(&(c->reads), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(c->read_bytes), got, __ATOMIC_RELAXED);
+        ptr += got;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+static inline uint32_t max_io_blocks(struct JSuper *sb)
+{
+    return JFS_CACHE_IO > sb->block_size ? JFS_CACHE_IO / sb->block_size : 1;
+}
+
+///Up to window chain blocks from block into the cache, cached ones are skipped
+static int32_t cache_readahead(struct JSuper *sb, struct JCache *c, int fd, int32_t block, uint32_t window, uint8_t *buf)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t max_io = max_io_blocks(sb);
+    uint8_t flags = JFS_CACHE_REF | JFS_CACHE_AHEAD | JFS_CACHE_TRIGGER;
+
+    while (window > 0 && 0 <= block)
+    {
+        uint32_t run = uncached_run(c, fat, block, window < max_io ? window : max_io);
+        if (0 == run)
+        {
+            block = jfs_fat_next(fat, block);
+            window--;
+            continue;
+        }
+
+        if (0 != device_read(sb, c, fd, block, run, buf))
+            return -1;
+        for (uint32_t ii = 0; ii < run; ii++, flags = JFS_CACHE_REF | JFS_CACHE_AHEAD)
+            cache_put(c, block + ii, buf + (uint64_t)ii * sb->block_size, flags);
+        __atomic_add_fetch(&(c->readahead), run, __ATOMIC_RELAXED);
+
+        window -= run;
+        block = jfs_fat_next(fat, block + run - 1);
+    }
+
+    return 0;
+}
+
+int32_t jfs_cache_read(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JCache *c = st->cache;
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t bs = sb->block_size;
+    uint32_t offset_block = offset % bs;
+    uint32_t max_io = max_io_blocks(sb);
+    uint32_t read = 0;
+    uint8_t *buf = NULL;
+    uint8_t trigger = 0;
+    int32_t block;
+    int32_t ret = 0;
+
+    if (offset >= file->size)
+    {
+        if (NULL != ret_size)
+            *ret_size = 0;
+        return 0;
+    }
+
+    block = jfs_seek_block(file, sb, offset / bs);
+    size = size >= file->size - offset ? file->size - offset : size;
+
+    ///Sequential if the chain predecessor was read already (rfat[] links back)
+    int32_t prev = jfs_get_rfat_ptr(sb)[block];
+    uint8_t sequential = 0 > prev || cache_has(c, prev);
+
+    while (size > 0)
+    {
+        uint32_t n = bs - offset_block > size ? size : bs - offset_block;
+        uint8_t flags = cache_copy(c, block, offset_block, dst + read, n);
+
+        if (0 != flags)
+        {
+            trigger |= flags & JFS_CACHE_TRIGGER;
+            size -= n;
+            read += n;
+            block = jfs_fat_next(fat, block);
+            offset_block = 0;
+            continue;
+        }
+
+        ///Miss: the rest of the request in as few device reads as the chain allows
+        if (NULL == buf && NULL == (buf = malloc((uint64_t)max_io * bs)))
+        {
+            JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_NOMEM, "Can't alloc memory for cache read!\n");
+            ret = -1;
+            break;
+        }
+
+        uint32_t want = (offset_block + size - 1) / bs + 1;
+        uint32_t run = uncached_run(c, fat, block, want < max_io ? want : max_io);
+        if (0 == run) ///Brought by another reader meanwhile
+            continue;
+        if (0 != device_read(sb, c, st->fd, block, run, buf))
+        {
+            ret = -1;
+            break;
+        }
+        for (uint32_t ii = 0; ii < run; ii++)
+            cache_put(c, block + ii, buf + (uint64_t)ii * bs, JFS_CACHE_REF);
+        __atomic_add_fetch(&(c->misses), run, __ATOMIC_RELAXED);
+
+        n = run * bs - offset_block > size ? size : run * bs - offset_block;
+        memcpy(dst + read, buf + offset_block, n);
+        size -= n;
+        read += n;
+        block = jfs_fat_next(fat, block + run - 1);
+        offset_block = 0;
+        trigger |= sequential;
+    }
+
+    ///A sequential miss or the start of the last batch: keep ahead of the reader
+    if (0 == ret && 0 != trigger && 0 != c->window && 0 <= block)
+    {
+        if (NULL == buf && NULL == (buf = malloc((uint64_t)max_io * bs)))
+            JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_NOMEM, "Can't alloc memory for cache read!\n");
+        else
+            cache_readahead(sb, c, st->fd, block, c->window, buf);
+    }
+
+    free(buf);
+    if (NULL != ret_size)
+        *ret_size = read;
+    return ret;
+}
+
+static void shard_free(struct JCacheShard *sh)
+{
+    pthread_mutex_destroy(&(sh->lock));
+    free(sh->bucket);
+    free(sh->next);
+    free(sh->block);
+    free(sh->ref);
+    free(sh->data);
+}
+
+void jfs_cache_destroy(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || NULL == st->cache)
+        return;
+
+    for (int ii = 0; ii < JFS_CACHE_SHARDS; ii++)
+        shard_free(&(st->cache->shards[ii]));
+    free(st->cache);
+    st->cache = NULL;
+}
+
+///Cache of mib MiB split over the shards, window blocks of readahead
+int32_t jfs_cache_create(struct JSuper *sb, uint32_t mib, uint32_t window)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JCache *c;
+    uint64_t total = ((uint64_t)mib << 20) / sb->block_size;
+    uint32_t slots = total / JFS_CACHE_SHARDS ? total / JFS_CACHE_SHARDS : 1;
+    int32_t ret = 0;
+
+    if (NULL == st)
+        return -1;
+
+    c = calloc(1, sizeof(struct JCache));
+    if (NULL == c)
+    {
+        JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_NOMEM, "Can't alloc memory for block cache!\n");
+        return -1;
+    }
+    c->block_size = sb->block_size;
+    ///Readahead that doesn't fit evicts itself before it is used
+    c->window = window > slots * JFS_CACHE_SHARDS / 2 ? slots * JFS_CACHE_SHARDS / 2 : window;
+
+    for (int ii = 0; ii < JFS_CACHE_SHARDS; ii++)
+    {
+        struct JCacheShard *sh = &(c->shards[ii]);
+
+        pthread_mutex_init(&(sh->lock), NULL);
+        sh->slots = slots;
+        for (sh->buckets = 1; sh->buckets < slots; sh->buckets *= 2)
+            ;
+        sh->bucket = malloc(sh->buckets * sizeof(int32_t));
+        sh->next = malloc(slots * sizeof(int32_t));
+        sh->block = malloc(slots * sizeof(int32_t));
+        sh->ref = calloc(slots, sizeof(uint8_t));
+        sh->data = malloc((uint64_t)slots * sb->block_size);
+        if (NULL == sh->bucket || NULL == sh->next || NULL == sh->block || NULL == sh->ref || NULL == sh->data)
+        {
+            ret = -1;
+            continue;
+        }
+        memset(sh->bucket, 0xff, sh->buckets * sizeof(int32_t));
+        memset(sh->block, 0xff, slots * sizeof(int32_t));
+    }
+
+    if (0 != ret)
+    {
+        JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_NOMEM, "Can't alloc memory for block cache!\n");
+        for (int ii = 0; ii < JFS_CACHE_SHARDS; ii++)
+            shard_free(&(c->shards[ii]));
+        free(c);
+        return -1;
+    }
+
+    st->cache = c;
+    return 0;
+}
+
+///Resize the cache of a pread mount and set its readahead, contents are dropped
+int32_t jfs_set_block_cache(struct JSuper *sb, uint32_t mib, uint32_t readahead)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || NULL == st->cache)
+    {
+        JFS_ERROR(JFS_LOG_CACHE, JFS_ERR_INVAL, "Image is not mounted with JFS_MOUNT_PREAD!\n");
+        return -1;
+    }
+
+    jfs_cache_destroy(sb);
+    return jfs_cache_create(sb, mib, readahead);
+}
+
+int32_t jfs_cache_stats(struct JSuper *sb, struct JCacheStats *stats)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JCache *c = NULL == st ? NULL : st->cache;
+
+    memset(stats, 0, sizeof(struct JCacheStats));
+    if (NULL == c)
+        return -1;
+
+    for (int ii = 0; ii < JFS_CACHE_SHARDS; ii++)
+    {
+        pthread_mutex_lock(&(c->shards[ii].lock));
+        stats->hits += c->shards[ii].hits;
+        stats->readahead_hits += c->shards[ii].readahead_hits;
+        pthread_mutex_unlock(&(c->shards[ii].lock));
+    }
+    stats->misses = __atomic_load_n(&(c->misses), __ATOMIC_RELAXED);
+    stats->readahead = __atomic_load_n(&(c->readahead), __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&(c->reads), __ATOMIC_RELAXED);
+    stats->read_bytes = __atomic_load_n(&(c->read_bytes), __ATOMIC_RELAXED);
+
+    return 0;
+}
@@ -0,0 +1,385 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+///Compressed files. The codec is LZ77 in the layout of LZ4 blocks: a token
+///with the literal count and the match length in its nibbles (15 - more
+///length bytes follow, 255 - keep adding), the literals, then a 2-byte offset
+///back into the output. The last sequence has literals only. Reads
+///decompress just the clusters they touch, a few clusters stay decompressed
+///in a cache of the attached image.
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    12
+#define LZ_MAX_OFFSET   0xffff
+
+static inline uint32_t lz_hash(const uint8_t *ptr)
+{
+    uint32_t v;
+
+    memcpy(&v, ptr, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+///Length past the 15 of a nibble: 255s and the rest
+static int32_t lz_put_len(uint8_t *dst, uint32_t cap, uint32_t *out, uint32_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (*out >= cap)
+            return -1;
+        dst[(*out)++] = 255;
+    }
+    if (*out >= cap)
+        return -1;
+    dst[(*out)++] = len;
+
+    return 0;
+}
+
+///Literals, then match_len bytes from offset back. offset 0 - literals only
+static int32_t lz_sequence(uint8_t *dst, uint32_t cap, uint32_t *out, const uint8_t *lit, uint32_t lit_len,
+                           uint32_t offset, uint32_t match_len)
+{
+    uint32_t match = 0 == offset ? 0 : match_len - LZ_MIN_MATCH;
+
+    if (*out >= cap)
+        return -1;
+    dst[(*out)++] = (lit_len < 15 ? lit_len : 15) << 4 | (match < 15 ? match : 15);
+    if (lit_len >= 15 && 0 != lz_put_len(dst, cap, out, lit_len - 15))
+        return -1;
+    if (cap - *out < lit_len)
+        return -1;
+    memcpy(dst + *out, lit, lit_len);
+    *out += lit_len;
+    if (0 == offset)
+        return 0;
+
+    if (cap - *out < 2)
+        return -1;
+    dst[(*out)++] = offset & 0xff;
+    dst[(*out)++] = offset >> 8;
+
+    return match >= 15 ? lz_put_len(dst, cap, out, match - 15) : 0;
+}
+
+///Bytes the len bytes of src take compressed into dst, 0 - more than cap
+uint32_t jfs_lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint32_t anchor = 0, pos = 0, out = 0;
+
+    memset(table, 0, sizeof(table));
+    while (len >= LZ_MIN_MATCH && pos <= len - LZ_MIN_MATCH)
+    {
+        uint32_t hash = lz_hash(src + pos);
+        uint32_t cand = table[hash];
+
+        table[hash] = pos;
+        if (cand >= pos || pos - cand > LZ_MAX_OFFSET || 0 != memcmp(src + cand, src + pos, LZ_MIN_MATCH))
+        {
+            pos += 1 + ((pos - anchor) >> 6); ///Data that doesn't repeat is skipped faster and faster
+            continue;
+        }
+
+        uint32_t match = LZ_MIN_MATCH;
+        while (pos + match < len && src[cand + match] == src[pos + match])
+            match++;
+        if (0 != lz_sequence(dst, cap, &out, src + anchor, pos - anchor, pos - cand, match))
+            return 0;
+        pos += match;
+        anchor = pos;
+    }
+
+    if (0 != lz_sequence(dst, cap, &out, src + anchor, len - anchor, 0, 0))
+        return 0;
+
+    return out;
+}
+
+static int32_t lz_get_len(const uint8_t *src, uint32_t len, uint32_t *in, uint32_t *n)
+{
+    uint8_t byte;
+
+    do
+    {
+        if (*in >= len || *n > UINT32_MAX / 2)
+            return -1;
+        byte = src[(*in)++];
+        *n += byte;
+    }
+    while (255 == byte);
+
+    return 0;
+}
+
+///Exactly out_len bytes out of the len bytes of src, -1 - src is broken
+int32_t jfs_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len)
+{
+    uint32_t in = 0, out = 0;
+
+    while (in < len)
+    {
+        uint8_t token = src[in++];
+        uint32_t lit = token >> 4;
+        uint32_t match = token & 15;
+
+        if (15 == lit && 0 != lz_get_len(src, len, &in, &lit))
+            return -1;
+        if (lit > len - in || lit > out_len - out)
+            return -1;
+        if (lit <= 16 && len - in >= 16 && out_len - out >= 16)
+            memcpy(dst + out, src + in, 16); ///Fixed size copies inline, the slack gets overwritten later
+        else
+            memcpy(dst + out, src + in, lit);
+        in += lit;
+        out += lit;
+        if (in == len)
+            break;
+
+        if (len - in < 2)
+            return -1;
+        uint32_t offset = src[in] | (uint32_t)src[in + 1] << 8;
+        in += 2;
+        if (15 == match && 0 != lz_get_len(src, len, &in, &match))
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (0 == offset || offset > out || match > out_len - out)
+            return -1;
+
+        if (offset >= 8 && out_len - out - match >= 8)
+        {
+            for (uint32_t ii = 0; ii < match; ii += 8)
+                memcpy(dst + out + ii, dst + out + ii - offset, 8);
+        }
+        else if (offset >= match)
+        {
+            memcpy(dst + out, dst + out - offset, match);
+        }
+        else ///Overlap: the match repeats what it has just written
+        {
+            for (uint32_t ii = 0; ii < match; ii++)
+                dst[out + ii] = dst[out + ii - offset];
+        }
+        out += match;
+    }
+
+    return out == out_len ? 0 : -1;
+}
+
+///len bytes of the stream of file from pos, through the block cache on pread
+///mounts. The stream is shorter than the file, its size clamps nothing here
+static int32_t stream_read(struct JFile *file, struct JSuper *sb, uint32_t pos, uint8_t *dst, uint32_t len)
+{
+    struct JState *st = jfs_get_state(sb);
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t offset_block = pos % sb->block_size;
+    uint32_t got = 0;
+
+    if (NULL != st && NULL != st->cache)
+        return 0 == jfs_cache_read(file, sb, pos, dst, len, &got) && got == len ? 0 : -1;
+
+    for (int32_t block = jfs_seek_block(file, sb, pos / sb->block_size); len > 0; offset_block = 0)
+    {
+        if (0 > block || (uint32_t)block >= sb->blocks_count)
+            return -1;
+        uint32_t run = jfs_contig_blocks(fat, block, (offset_block + len - 1) / sb->block_size + 1);
+        uint32_t n = run * sb->block_size - offset_block > len ? len : run * sb->block_size - offset_block;
+        memcpy(dst, jfs_block_idx_to_ptr(block, sb) + offset_block, n);
+        dst += n;
+        len -= n;
+        block = jfs_fat_next(fat, block + run - 1);
+    }
+
+    return 0;
+}
+
+///Stream bytes pos..pos+len in place, if the image is mapped and they are in one run of the chain
+static const uint8_t *stream_ptr(struct JFile *file, struct JSuper *sb, uint32_t pos, uint32_t len)
+{
+    struct JState *st = jfs_get_state(sb);
+    uint32_t need = (pos % sb->block_size + len - 1) / sb->block_size + 1;
+
+    if (0 == len || (NULL != st && NULL != st->cache))
+        return NULL;
+
+    int32_t block = jfs_seek_block(file, sb, pos / sb->block_size);
+    if (0 > block || (uint32_t)block + need > sb->blocks_count ||
+        jfs_contig_blocks(jfs_get_fat_ptr(sb), block, need) < need)
+        return NULL;
+
+    return jfs_block_idx_to_ptr(block, sb) + pos % sb->block_size;
+}
+
+///Cluster idx of file, plain bytes of it, into out
+static int32_t cluster_load(struct JFile *file, struct JSuper *sb, uint32_t idx, uint8_t *out, uint32_t plain)
+{
+    struct JComp *comp = jfs_file_comp(file);
+    uint32_t clusters = (file->size - 1) / comp->cluster + 1;
+    uint32_t bounds[2] = {clusters * sizeof(uint32_t), 0};
+    uint8_t *buf = NULL;
+    int32_t ret = -1;
+
+    ///Index entries of this cluster and the one before: where it ends and starts
+    if (0 == idx ? 0 != stream_read(file, sb, 0, (uint8_t *)&(bounds[1]), sizeof(uint32_t)) :
+                   0 != stream_read(file, sb, (idx - 1) * sizeof(uint32_t), (uint8_t *)bounds, sizeof(bounds)))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_IO, "Can't read cluster index of %s!\n", file->name);
+        return -1;
+    }
+
+    uint32_t len = bounds[1] - bounds[0];
+    if (bounds[0] < clusters * sizeof(uint32_t) || bounds[0] > bounds[1] || bounds[1] > comp->stored || len > plain)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_CORRUPT, "Broken cluster index of %s!\n", file->name);
+        return -1;
+    }
+
+    const uint8_t *src = stream_ptr(file, sb, bounds[0], len);
+    if (NULL == src && NULL == (buf = malloc(len ? len : 1)))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOMEM, "Can't alloc memory for cluster of %s!\n", file->name);
+        return -1;
+    }
+    if (NULL == src && 0 != stream_read(file, sb, bounds[0], buf, len))
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_IO, "Can't read cluster %u of %s!\n", idx, file->name);
+        free(buf);
+        return -1;
+    }
+    if (NULL == src)
+        src = buf;
+
+    if (len == plain)
+    {
+        memcpy(out, src, plain);
+        ret = 0;
+    }
+    else
+    {
+        ret = jfs_lz_decompress(src, len, out, plain);
+    }
+    free(buf);
+
+    if (0 != ret)
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_CORRUPT, "Broken cluster %u of %s!\n", idx, file->name);
+    return ret;
+}
+
+///Copy n bytes from in of a cached cluster. Returns 0 if it is not there
+static int8_t zcache_copy(struct JZCache *zc, int32_t block, uint32_t idx, uint32_t generation,
+                          uint32_t in, uint8_t *dst, uint32_t n)
+{
+    int8_t hit = 0;
+
+    pthread_mutex_lock(&(zc->lock));
+    for (uint32_t ii = 0; ii < JFS_ZCACHE_SLOTS; ii++)
+    {
+        struct JZSlot *slot = &(zc->slots[ii]);
+        if (NULL != slot->data && slot->block == block && slot->cluster == idx &&
+            slot->generation == generation && in + n <= slot->len)
+        {
+            memcpy(dst, slot->data + in, n);
+            slot->ref = JFS_CACHE_REF;
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(zc->lock));
+
+    return hit;
+}
+
+///data becomes a slot. Returns the buffer of the slot it took, to be freed
+static uint8_t *zcache_put(struct JZCache *zc, int32_t block, uint32_t idx, uint32_t generation,
+                           uint8_t *data, uint32_t len)
+{
+    struct JZSlot *slot;
+
+    pthread_mutex_lock(&(zc->lock));
+    for (;;)
+    {
+        slot = &(zc->slots[zc->hand]);
+        zc->hand = (zc->hand + 1) % JFS_ZCACHE_SLOTS;
+        if (NULL == slot->data || slot->generation != generation || 0 == (slot->ref & JFS_CACHE_REF))
+            break;
+        slot->ref &= ~JFS_CACHE_REF; //Second chance
+    }
+
+    uint8_t *old = slot->data;
+    slot->block = block;
+    slot->cluster = idx;
+    slot->generation = generation;
+    slot->len = len;
+    slot->ref = JFS_CACHE_REF;
+    slot->data = data;
+    pthread_mutex_unlock(&(zc->lock));
+
+    return old;
+}
+
+void jfs_zcache_free(struct JState *st)
+{
+    for (uint32_t ii = 0; ii < JFS_ZCACHE_SLOTS; ii++)
+    {
+        free(st->zcache.slots[ii].data);
+        st->zcache.slots[ii].data = NULL;
+    }
+}
+
+///size bytes of a JFS_FILE_COMP file from offset, both inside the file. A
+///whole cluster is decompressed straight to dst, parts of one go through the
+///cache of the attached image
+int32_t jfs_comp_read(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JComp *comp = jfs_file_comp(file);
+    uint32_t generation = NULL == st ? 0 : jfs_generation(sb);
+    uint8_t *buf = NULL;
+    int32_t ret = 0;
+
+    if (0 == comp->cluster || 0 != comp->cluster % sb->block_size || comp->stored > file->size ||
+        (uint64_t)((file->size - 1) / comp->cluster + 1) * sizeof(uint32_t) > comp->stored)
+    {
+        JFS_ERROR(JFS_LOG_DATA, JFS_ERR_CORRUPT, "Broken compressed file %s!\n", file->name);
+        return -1;
+    }
+
+    while (0 == ret && size > 0)
+    {
+        uint32_t idx = offset / comp->cluster;
+        uint32_t in = offset % comp->cluster;
+        uint32_t plain = file->size - idx * comp->cluster < comp->cluster ? file->size - idx * comp->cluster : comp->cluster;
+        uint32_t n = plain - in > size ? size : plain - in;
+
+        if (0 == in && n == plain)
+        {
+            ret = cluster_load(file, sb, idx, dst, plain);
+        }
+        else if (NULL == st || !zcache_copy(&(st->zcache), file->first_data_block_idx, idx, generation, in, dst, n))
+        {
+            if (NULL == buf && NULL == (buf = malloc(comp->cluster)))
+            {
+                JFS_ERROR(JFS_LOG_DATA, JFS_ERR_NOMEM, "Can't alloc memory for cluster of %s!\n", file->name);
+                return -1;
+            }
+            ret = cluster_load(file, sb, idx, buf, plain);
+            if (0 == ret)
+                memcpy(dst, buf + in, n);
+            if (0 == ret && NULL != st) ///The slot takes the buffer, clusters of other files may be bigger
+            {
+                free(zcache_put(&(st->zcache), file->first_data_block_idx, idx, generation, buf, plain));
+                buf = NULL;
+            }
+        }
+
+        offset += n;
+        dst += n;
+        size -= n;
+    }
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,460 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+///Compaction. Offline mode rewrites a whole image in builder order (dir
+///entries, file chains of the dir, then subdirs) and can drop the free tail.
+///Online mode moves chains of a mounted image in place to the lowest free run
+///that fits them, a bounded number of blocks per step.
+
+static uint32_t chain_length(int32_t *fat, int32_t block)
+{
+    uint32_t len = 0;
+
+    for (; 0 <= block; block = fat[block])
+        len++;
+
+    return len;
+}
+
+///Copy n blocks of the chain starting at src_block into dst_start..dst_start+n-1
+static void copy_chain(struct JSuper *dst_sb, int32_t dst_start, struct JSuper *src_sb, int32_t src_block, uint32_t n)
+{
+    int32_t *fat = jfs_get_fat_ptr(src_sb);
+
+    for (uint32_t ii = 0; ii < n; )
+    {
+        uint32_t run = jfs_contig_blocks(fat, src_block, n - ii);
+        memcpy(jfs_block_idx_to_ptr(dst_start + ii, dst_sb), jfs_block_idx_to_ptr(src_block, src_sb), run * src_sb->block_size);
+        ii += run;
+        src_block = fat[src_block + run - 1];
+    }
+}
+
+//------------------------------------------------------------------ offline
+
+static int32_t rewrite_dir(struct JFile *dir, struct JSuper *sb, struct JFile *new_dir, struct JSuper *new_sb)
+{
+    struct JFile **copies = malloc((dir->size + 1) * sizeof(struct JFile *));
+    struct JDirIter it;
+    struct JFile *entry;
+    uint32_t ii = 0;
+    int32_t ret = 0;
+
+    if (NULL == copies)
+        return -1;
+
+    ///Entries keep their order, so jfs_read_dir offsets don't change
+    jfs_dir_iter_init(&it, dir, sb);
+    for (; NULL != (entry = jfs_dir_iter_next(&it, sb)); ii++)
+    {
+        copies[ii] = jfs_create_file(new_dir, new_sb, entry->name, entry->flags);
+        if (NULL == copies[ii])
+        {
+            free(copies);
+            return -1;
+        }
+    }
+
+    jfs_dir_iter_init(&it, dir, sb);
+    for (ii = 0; NULL != (entry = jfs_dir_iter_next(&it, sb)); ii++)
+    {
+        if (jfs_is_inline(entry) && 0 != jfs_write_file(copies[ii], new_sb, 0, jfs_inline_data(entry), entry->size))
+        {
+            free(copies);
+            return -1;
+        }
+        if (jfs_is_dir(entry) || jfs_is_inline(entry))
+            continue;
+
+        struct JTail *tail = jfs_file_tail(entry);
+        struct JComp *comp = jfs_file_comp(entry);
+        uint32_t chain_end = entry->size - (NULL == tail ? 0 : tail->len);
+        if (0 <= entry->first_data_block_idx)
+        {
+            uint32_t n = chain_length(jfs_get_fat_ptr(sb), entry->first_data_block_idx), got;
+            int32_t start = jfs_get_free_extent(new_sb, n, &got);
+            if (0 > start || got < n)
+            {
+                JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOSPC, "No free blocks left!\n");
+                free(copies);
+                return -1;
+            }
+            copy_chain(new_sb, start, sb, entry->first_data_block_idx, n);
+            copies[ii]->flags &= ~JFS_FILE_INLINE; ///Created inline, the data stays in blocks
+            jfs_add_new_extent(copies[ii], new_sb, start, n);
+            copies[ii]->size = chain_end;
+            new_sb->data_bytes += chain_end;
+        }
+        if (NULL != comp) ///Stream is copied as is
+        {
+            *(struct JComp *)(copies[ii] + 1) = *comp;
+            copies[ii]->flags |= JFS_FILE_COMP;
+        }
+
+        ///Tails are packed again in rewrite order, the holes of the old tail blocks are gone
+        if (NULL != tail && (0 != jfs_write_file(copies[ii], new_sb, chain_end, jfs_tail_data(entry, sb), tail->len) ||
+                             0 != jfs_pack_tail(copies[ii], new_sb)))
+        {
+            free(copies);
+            return -1;
+        }
+    }
+
+    jfs_dir_iter_init(&it, dir, sb);
+    for (ii = 0; 0 == ret && NULL != (entry = jfs_dir_iter_next(&it, sb)); ii++)
+    {
+        if (jfs_is_dir(entry))
+            ret = rewrite_dir(entry, sb, copies[ii], new_sb);
+    }
+
+    free(copies);
+    return ret;
+}
+
+///Blocks the rewrite of dir takes, tails are packed into fresh tail blocks in
+///rewrite order. fill - of the open tail block, as jfs_tail_plan counts it
+static uint32_t plan_dir(struct JFile *dir, struct JSuper *sb, uint32_t *fill)
+{
+    uint32_t fit = jfs_files_fit_in_block(sb);
+    uint32_t blocks = dir->size / fit + (0 != dir->size % fit);
+    struct JDirIter it;
+    struct JFile *entry;
+
+    jfs_dir_iter_init(&it, dir, sb);
+    while (NULL != (entry = jfs_dir_iter_next(&it, sb)))
+    {
+        struct JTail *tail = jfs_file_tail(entry);
+        if (jfs_is_dir(entry) || jfs_is_inline(entry))
+            continue;
+        if (0 <= entry->first_data_block_idx)
+            blocks += chain_length(jfs_get_fat_ptr(sb), entry->first_data_block_idx);
+        if (NULL != tail && (0 <= entry->first_data_block_idx || !(sb->flags & JFS_FLAG_INLINE) || tail->len > JFS_INLINE_SIZE))
+            blocks += jfs_tail_plan(fill, tail->len, sb->block_size);
+    }
+
+    jfs_dir_iter_init(&it, dir, sb);
+    while (NULL != (entry = jfs_dir_iter_next(&it, sb)))
+        if (jfs_is_dir(entry))
+            blocks += plan_dir(entry, sb, fill);
+
+    return blocks;
+}
+
+///Rewrite the image at path compacted, truncate - shrink it to the blocks in use
+int32_t jfs_defrag_image(const char *path, uint8_t truncate)
+{
+    int32_t ret = -1;
+    char tmp_path[4096];
+
+    struct JSuper *sb = jfs_mount(path, JFS_MOUNT_RDONLY);
+    if (NULL == sb)
+        return -1;
+
+    uint32_t blocks = sb->blocks_count;
+    uint64_t journal_bytes = sb->journal_bytes;
+    if (truncate)
+        blocks = sb->blocks_count - sb->free_blocks ? sb->blocks_count - sb->free_blocks : 1;
+    if (truncate && (sb->flags & JFS_FLAG_TAILPACK))
+    {
+        ///One spare block: a tail is written to a block of its own before it is packed
+        uint32_t fill = 0;
+        blocks = plan_dir(jfs_get_root_dir(sb), sb, &fill) + 1;
+    }
+
+    uint32_t format = sb->flags & (JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS);
+    uint64_t image_size = jfs_system_size_opts(blocks, sb->inodes_count, sb->flags) + (uint64_t)blocks * sb->block_size;
+    uint8_t *image = calloc(image_size, sizeof(uint8_t));
+    if (NULL == image)
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_NOMEM, "Can't alloc memory for jfs!\n");
+        jfs_umount(sb);
+        return -1;
+    }
+
+    struct JSuper *new_sb = (struct JSuper *)image;
+    jfs_format_opts(new_sb, sb->block_size, blocks, sb->inodes_count, format);
+    jfs_attach(new_sb);
+    jfs_set_alloc_cache(new_sb, 0); //Written out while attached, keep the free list whole
+    strcpy(new_sb->root.name, sb->root.name);
+
+    if (0 != rewrite_dir(jfs_get_root_dir(sb), sb, jfs_get_root_dir(new_sb), new_sb))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't compact %s!\n", path);
+    }
+    else if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.defrag", path) >= sizeof(tmp_path))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_INVAL, "Too long image path!\n");
+    }
+    else
+    {
+        ///Write aside and rename over, the old image stays intact on failure
+        FILE *out = fopen(tmp_path, "wb");
+        if (NULL == out)
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't create data file!\n");
+        else if (fwrite(image, sizeof(uint8_t), image_size, out) < image_size)
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't write image to file!\n");
+        else
+            ret = 0;
+
+        if (NULL != out && 0 != fclose(out))
+            ret = -1;
+        if (0 == ret && 0 != rename(tmp_path, path))
+        {
+            JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_IO, "Can't replace %s!\n", path);
+            ret = -1;
+        }
+        if (0 != ret)
+            remove(tmp_path);
+        else if (0 != journal_bytes) ///The copy is written without one, it gets the same journal back
+            ret = jfs_journal_add(path, journal_bytes);
+    }
+
+    jfs_detach(new_sb);
+    free(image);
+    jfs_umount(sb);
+    return ret;
+}
+
+//------------------------------------------------------------------- online
+
+///Relink free space as one list of maximal runs in block order, so the next
+///allocations take the lowest addresses
+static void rebuild_free_list(struct JSuper *sb, struct JState *st)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    int32_t prev = -1;
+    uint32_t block = 0;
+
+    sb->first_free_block = -1;
+    while (block < sb->blocks_count)
+    {
+        if (0 == st->free_map[block / 64] >> (block % 64))
+        {
+            block = (block / 64 + 1) * 64;
+            continue;
+        }
+        if (0 == (st->free_map[block / 64] >> (block % 64) & 1))
+        {
+            block++;
+            continue;
+        }
+
+        uint32_t start = block;
+        while (block < sb->blocks_count && (st->free_map[block / 64] >> (block % 64) & 1))
+            block++;
+
+        fat[start] = -1;
+        rfat[start] = block - start;
+        jfs_dirty_fat(sb, start, 1);
+        if (0 > prev)
+            sb->first_free_block = start;
+        else
+            fat[prev] = start;
+        prev = start;
+    }
+}
+
+static int32_t defrag_push(struct JDefrag *df, struct JFile *dir)
+{
+    if (df->depth == df->cap)
+    {
+        uint32_t cap = df->cap ? 2 * df->cap : 16;
+        struct JDefragFrame *stack = realloc(df->stack, cap * sizeof(struct JDefragFrame));
+        if (NULL == stack)
+            return -1;
+        df->stack = stack;
+        df->cap = cap;
+    }
+
+    df->stack[df->depth].it.dir = dir;
+    df->stack[df->depth].phase = 0;
+    df->depth++;
+
+    return 0;
+}
+
+///Move a chain into the lowest free run that holds it whole, when the chain
+///is fragmented or such a run lies before it. Returns blocks moved
+static uint32_t relocate_chain(struct JDefrag *df, struct JFile *file)
+{
+    struct JSuper *sb = df->sb;
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t old_first = file->first_data_block_idx;
+    uint32_t n;
+
+    if (0 > old_first)
+        return 0;
+
+    n = chain_length(fat, old_first);
+    int32_t start = jfs_find_free_run(sb, n);
+    if (jfs_contig_blocks(fat, old_first, n) == n && (0 > start || start > old_first))
+        return 0;
+
+    if (0 > start || start != jfs_take_free_range(sb, start, n))
+    {
+        df->skipped_chains++;
+        return 0;
+    }
+
+    ///Journaled, file data goes home ahead of the step's record. The run was
+    ///free at the last commit, and the old chain stays held until this step
+    ///commits, so no later move of the step lands on committed blocks
+    copy_chain(sb, start, sb, old_first, n);
+    ///Entries are metadata, they must not land before the links
+    if (jfs_is_dir(file))
+        jfs_dirty_meta(sb, jfs_block_idx_to_ptr(start, sb), (uint64_t)n * sb->block_size);
+    else
+        jfs_dirty_data(sb, jfs_block_idx_to_ptr(start, sb), (uint64_t)n * sb->block_size);
+
+    jfs_return_free_chain(sb, old_first);
+
+    jfs_seek_index_truncate(sb, old_first, 0);
+    file->first_data_block_idx = -1;
+    file->last_data_block_idx = -1;
+    jfs_add_new_extent(file, sb, start, n);
+
+    if (jfs_is_dir(file))
+    {
+        ///Entries moved: fix their own place and their children's parent refs
+        uint32_t fit = jfs_files_fit_in_block(sb);
+        jfs_dir_index_drop(sb, old_first); //Rebuilt on next lookup
+        for (uint32_t ii = 0; ii < file->size; ii++)
+        {
+            struct JFile *entry = jfs_dir_entry(sb, start + ii / fit, ii % fit);
+            entry->coord.my_jfile_block = start + ii / fit;
+            jfs_dirty_meta(sb, entry, sizeof(struct JFile));
+            update_child_coord(entry, sb);
+        }
+    }
+
+    df->moved_chains++;
+    df->moved_blocks += n;
+    return n;
+}
+
+static int32_t defrag_restart(struct JDefrag *df)
+{
+    struct JState *st = jfs_get_state(df->sb);
+
+    if (jfs_is_read_only(df->sb))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_ROFS, "Image is mounted read-only!\n");
+        return -1;
+    }
+    if (NULL == st || NULL == st->free_map)
+        return -1;
+
+    df->depth = 0;
+    jfs_alloc_drain(df->sb);
+    jfs_alloc_lock(df->sb);
+    rebuild_free_list(df->sb, st);
+    jfs_alloc_unlock(df->sb);
+    jfs_generation_bump(df->sb);
+    df->generation = jfs_generation(df->sb);
+
+    return defrag_push(df, jfs_get_root_dir(df->sb));
+}
+
+///Steps move entries under everyone's feet, so they own the namespace
+static int32_t defrag_enter(struct JSuper *sb)
+{
+    if (jfs_ns_in_read(sb))
+    {
+        JFS_ERROR(JFS_LOG_IMAGE, JFS_ERR_BUSY, "Namespace is pinned by this thread, can't change it!\n");
+        return -1;
+    }
+
+    jfs_ns_write_lock(sb);
+    return 0;
+}
+
+int32_t jfs_defrag_begin(struct JDefrag *df, struct JSuper *sb)
+{
+    memset(df, 0, sizeof(struct JDefrag));
+    df->sb = sb;
+    jfs_attach(sb);
+
+    if (0 != defrag_enter(sb))
+        return -1;
+    int32_t ret = defrag_restart(df);
+    jfs_ns_write_unlock(sb);
+    if (0 == ret)
+        ret = jfs_journal_commit(sb);
+
+    return ret;
+}
+
+static int32_t defrag_step(struct JDefrag *df, uint32_t max_blocks)
+{
+    struct JSuper *sb = df->sb;
+    uint32_t done = 0;
+
+    ///Cursor holds entry pointers, after a foreign change anything could have moved
+    if (df->generation != jfs_generation(sb) && 0 != defrag_restart(df))
+        return -1;
+
+    while (0 != df->depth && done < max_blocks)
+    {
+        struct JDefragFrame *frame = &(df->stack[df->depth - 1]);
+        struct JFile *entry;
+
+        if (0 == frame->phase)
+        {
+            done += relocate_chain(df, frame->it.dir);
+            jfs_dir_iter_init(&(frame->it), frame->it.dir, sb);
+            frame->phase = 1;
+            continue;
+        }
+
+        entry = jfs_dir_iter_next(&(frame->it), sb);
+        if (NULL == entry)
+        {
+            if (1 == frame->phase)
+            {
+                jfs_dir_iter_init(&(frame->it), frame->it.dir, sb);
+                frame->phase = 2;
+            }
+            else
+            {
+                df->depth--;
+            }
+            continue;
+        }
+
+        if (1 == frame->phase && jfs_is_file(entry))
+            done += relocate_chain(df, entry);
+        else if (2 == frame->phase && jfs_is_dir(entry) && 0 != defrag_push(df, entry))
+            return -1;
+    }
+
+    if (0 != done)
+        jfs_generation_bump(sb);
+    df->generation = jfs_generation(sb);
+
+    return 0 != df->depth;
+}
+
+///Do about max_blocks of copying (at least one chain). 1 - call again, 0 - pass is over
+int32_t jfs_defrag_step(struct JDefrag *df, uint32_t max_blocks)
+{
+    if (0 != defrag_enter(df->sb))
+        return -1;
+    int32_t ret = defrag_step(df, max_blocks);
+    jfs_alloc_drain(df->sb); //Cached blocks go to the free map for the next step's runs
+    jfs_ns_write_unlock(df->sb);
+    if (0 <= ret && 0 != jfs_journal_commit(df->sb))
+        ret = -1;
+
+    return ret;
+}
+
+void jfs_defrag_end(struct JDefrag *df)
+{
+    free(df->stack);
+    memset(df, 0, sizeof(struct JDefrag));
+}
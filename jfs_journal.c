@@ -0,0 +1,589 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+///Redo journal of a file-backed image. A journaled mount maps the image
+///privately, so nothing reaches the file by itself. A commit stops all
+///operations for a moment and takes every page they marked. Data pages go
+///home first and drop their private copies, metadata pages go to the journal
+///as one record, one sync, and only then home. Mount replays the records that
+///are whole, so the tree on disk is always as of some commit. Blocks freed in
+///a transaction are held off the free list until its commit, so its data never
+///lands on blocks the last record still uses. A record that can't fit the
+///journal is never written around it, nor is one written after a failed one:
+///the journal aborts.
+
+#define JFS_JOURNAL_MAGIC 0x4c4e524a //"JRNL"
+
+//First page of the journal region, records after it are replayed from seq on
+struct JJournalHead
+{
+    uint32_t magic;
+    uint32_t page; //JFS_JOURNAL_PAGE the journal was written with
+    uint64_t seq;
+    uint64_t check;
+};
+
+//Record: this header, page numbers (uint32_t, padded to 8 bytes), page images
+struct JJournalRec
+{
+    uint32_t magic;
+    uint32_t pages;
+    uint64_t seq;
+    uint64_t bytes; //Whole record
+    uint64_t check; //Of the whole record with check = 0
+};
+
+static uint64_t journal_hash(const void *data, uint64_t len)
+{
+    const uint8_t *ptr = data;
+    uint64_t hash = JFS_JOURNAL_MAGIC, word;
+
+    for (; len >= 8; ptr += 8, len -= 8)
+    {
+        memcpy(&word, ptr, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    for (; len > 0; ptr++, len--)
+        hash = (hash ^ *ptr) * 0x100000001b3ull;
+
+    return hash;
+}
+
+static inline uint64_t rec_index_bytes(uint32_t pages)
+{
+    return sizeof(struct JJournalRec) + ((uint64_t)pages * sizeof(uint32_t) + 7) / 8 * 8;
+}
+
+static inline uint64_t rec_bytes(uint32_t pages)
+{
+    return rec_index_bytes(pages) + (uint64_t)pages * JFS_JOURNAL_PAGE;
+}
+
+static inline uint64_t journal_offset(struct JSuper *sb)
+{
+    return sb->system_bytes + (uint64_t)sb->blocks_count * sb->block_size;
+}
+
+///Bytes of the page that belong to the image, the last one is cut by the journal
+static inline uint32_t page_len(uint64_t end, uint32_t page)
+{
+    uint64_t from = (uint64_t)page * JFS_JOURNAL_PAGE;
+
+    return end - from < JFS_JOURNAL_PAGE ? end - from : JFS_JOURNAL_PAGE;
+}
+
+static int32_t pread_all(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+    for (uint8_t *ptr = buf; len > 0; )
+    {
+        ssize_t got = pread(fd, ptr, len, offset);
+        if (got <= 0)
+            return -1;
+        ptr += got;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+static int32_t pwrite_all(int fd, const void *buf, uint64_t len, uint64_t offset)
+{
+    for (const uint8_t *ptr = buf; len > 0; )
+    {
+        ssize_t put = pwrite(fd, ptr, len, offset);
+        if (put <= 0)
+            return -1;
+        ptr += put;
+        offset += put;
+        len -= put;
+    }
+
+    return 0;
+}
+
+static int32_t write_head(int fd, uint64_t offset, uint64_t seq)
+{
+    struct JJournalHead head = {JFS_JOURNAL_MAGIC, JFS_JOURNAL_PAGE, seq, 0};
+
+    head.check = journal_hash(&head, sizeof(head));
+    return pwrite_all(fd, &head, sizeof(head), offset);
+}
+
+static int32_t read_head(int fd, uint64_t offset, uint64_t *seq)
+{
+    struct JJournalHead head;
+
+    if (0 != pread_all(fd, &head, sizeof(head), offset))
+        return -1;
+
+    uint64_t check = head.check;
+    head.check = 0;
+    if (JFS_JOURNAL_MAGIC != head.magic || JFS_JOURNAL_PAGE != head.page || journal_hash(&head, sizeof(head)) != check)
+        return -1;
+
+    *seq = head.seq;
+    return 0;
+}
+
+static int32_t add_journal(int fd, const char *path, uint64_t bytes)
+{
+    struct JSuper sb;
+    struct stat st_buf;
+
+    if (0 != fstat(fd, &st_buf) || st_buf.st_size < (off_t)sizeof(struct JSuper) || 0 != pread_all(fd, &sb, sizeof(sb), 0))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_INVAL, "Image %s is too small!\n", path);
+        return -1;
+    }
+    if (0 != jfs_check_super(&sb, st_buf.st_size))
+        return -1;
+    if (sb.flags & JFS_FLAG_JOURNAL)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_EXIST, "Image %s already has a journal!\n", path);
+        return -1;
+    }
+
+    ///A record of every page before the data blocks always fits
+    uint64_t least = JFS_JOURNAL_PAGE + rec_bytes((sb.system_bytes + JFS_JOURNAL_PAGE - 1) / JFS_JOURNAL_PAGE);
+    if (bytes < least)
+        bytes = (least + JFS_JOURNAL_PAGE - 1) / JFS_JOURNAL_PAGE * JFS_JOURNAL_PAGE;
+
+    uint64_t offset = journal_offset(&sb);
+    sb.flags |= JFS_FLAG_JOURNAL;
+    sb.journal_bytes = bytes;
+    sb.total_bytes = offset + bytes;
+
+    ///Journal first, the superblock only points at it once it is there
+    if (0 != ftruncate(fd, offset + bytes) || 0 != write_head(fd, offset, 1) || 0 != fdatasync(fd) ||
+        0 != pwrite_all(fd, &sb, sizeof(sb), 0) || 0 != fdatasync(fd))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_IO, "Can't add journal to %s!\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+///Give an unmounted image a journal of bytes at its end. Rounded up to pages
+///and to what a record of all system pages (superblock, FATs, inodes) takes
+int32_t jfs_journal_add(const char *path, uint64_t bytes)
+{
+    bytes = (bytes + JFS_JOURNAL_PAGE - 1) / JFS_JOURNAL_PAGE * JFS_JOURNAL_PAGE;
+    if (bytes < 2 * JFS_JOURNAL_PAGE)
+        bytes = 2 * JFS_JOURNAL_PAGE;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOENT, "Can't open image %s!\n", path);
+        return -1;
+    }
+
+    int32_t ret = add_journal(fd, path, bytes);
+    close(fd);
+    return ret;
+}
+
+///Apply whole records in seq order to the (private) map. With rdwr the pages
+///also go home and the journal starts over. Returns records applied or -1
+int32_t jfs_journal_replay(struct JSuper *sb, int fd, int rdwr)
+{
+    uint64_t offset = journal_offset(sb);
+    uint64_t bytes = sb->journal_bytes;
+    uint32_t pages = (offset + JFS_JOURNAL_PAGE - 1) / JFS_JOURNAL_PAGE;
+    uint8_t *image = (uint8_t *)sb;
+    uint64_t *touched = calloc((pages + 63) / 64, sizeof(uint64_t));
+    uint8_t *buf = NULL;
+    uint32_t records = 0;
+    uint64_t seq, pos;
+    int32_t ret = 0;
+
+    if (NULL == touched)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOMEM, "Can't alloc memory for journal!\n");
+        return -1;
+    }
+    if (0 != read_head(fd, offset, &seq))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_CORRUPT, "Broken journal!\n");
+        free(touched);
+        return -1;
+    }
+
+    for (pos = JFS_JOURNAL_PAGE; pos + sizeof(struct JJournalRec) <= bytes; seq++, records++)
+    {
+        struct JJournalRec rec;
+
+        if (0 != pread_all(fd, &rec, sizeof(rec), offset + pos) || JFS_JOURNAL_MAGIC != rec.magic || seq != rec.seq ||
+            0 == rec.pages || rec.pages > pages || rec_bytes(rec.pages) != rec.bytes || pos + rec.bytes > bytes)
+            break;
+
+        uint8_t *grown = realloc(buf, rec.bytes);
+        if (NULL == grown || 0 != pread_all(fd, grown, rec.bytes, offset + pos))
+        {
+            buf = NULL == grown ? buf : grown;
+            break;
+        }
+        buf = grown;
+
+        ///Torn record: the commit never finished, it and everything after is void
+        ((struct JJournalRec *)buf)->check = 0;
+        if (journal_hash(buf, rec.bytes) != rec.check)
+            break;
+
+        uint32_t *idx = (uint32_t *)(buf + sizeof(struct JJournalRec));
+        uint32_t ii = 0;
+        while (ii < rec.pages && idx[ii] < pages)
+            ii++;
+        if (ii < rec.pages)
+            break;
+
+        for (ii = 0; ii < rec.pages; ii++)
+        {
+            memcpy(image + (uint64_t)idx[ii] * JFS_JOURNAL_PAGE, buf + rec_index_bytes(rec.pages) + (uint64_t)ii * JFS_JOURNAL_PAGE,
+                   page_len(offset, idx[ii]));
+            touched[idx[ii] / 64] |= 1ull << (idx[ii] % 64);
+        }
+        pos += rec.bytes;
+    }
+
+    if (rdwr && 0 != records)
+    {
+        for (uint32_t page = 0; 0 == ret && page < pages; page++)
+            if (touched[page / 64] >> (page % 64) & 1)
+                ret = pwrite_all(fd, image + (uint64_t)page * JFS_JOURNAL_PAGE, page_len(offset, page), (uint64_t)page * JFS_JOURNAL_PAGE);
+        if (0 != ret || 0 != fdatasync(fd) || 0 != write_head(fd, offset, seq) || 0 != fdatasync(fd))
+        {
+            JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_IO, "Can't write replayed journal home!\n");
+            ret = -1;
+        }
+    }
+    if (0 != records)
+        JFS_INFO(JFS_LOG_JOURNAL, "Replayed %u journal records\n", records);
+
+    free(buf);
+    free(touched);
+    return 0 == ret ? (int32_t)records : -1;
+}
+
+///Start journaling changes of a mounted (attached, RDWR) image
+int32_t jfs_journal_open(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JJournal *j;
+
+    if (NULL == st || st->fd < 0)
+        return -1;
+
+    j = calloc(1, sizeof(struct JJournal));
+    if (NULL == j)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOMEM, "Can't alloc memory for journal!\n");
+        return -1;
+    }
+
+    j->offset = journal_offset(sb);
+    j->bytes = sb->journal_bytes;
+    j->head = JFS_JOURNAL_PAGE;
+    j->open_txn = 1;
+    j->pages = (j->offset + JFS_JOURNAL_PAGE - 1) / JFS_JOURNAL_PAGE;
+    j->meta = calloc((j->pages + 63) / 64, sizeof(uint64_t));
+    j->data = calloc((j->pages + 63) / 64, sizeof(uint64_t));
+    j->list = malloc(j->pages * sizeof(uint32_t));
+    if (NULL == j->meta || NULL == j->data || NULL == j->list || 0 != read_head(st->fd, j->offset, &(j->seq)))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_IO, "Can't open journal!\n");
+        free(j->meta);
+        free(j->data);
+        free(j->list);
+        free(j);
+        return -1;
+    }
+
+    pthread_mutex_init(&(j->lock), NULL);
+    pthread_cond_init(&(j->done), NULL);
+    st->journal = j;
+
+    return 0;
+}
+
+static inline struct JJournal *dirty_journal(struct JSuper *sb)
+{
+    if (!(sb->flags & JFS_FLAG_JOURNAL))
+        return NULL;
+
+    struct JState *st = jfs_get_state(sb);
+    return NULL == st ? NULL : st->journal;
+}
+
+static void dirty_mark(struct JJournal *j, uint64_t *bits, uint64_t from, uint64_t len)
+{
+    uint64_t last = (from + len - 1) / JFS_JOURNAL_PAGE;
+
+    if (last >= j->pages)
+        last = j->pages - 1;
+    for (uint64_t page = from / JFS_JOURNAL_PAGE; page <= last; page++)
+        __atomic_fetch_or(&(bits[page / 64]), 1ull << (page % 64), __ATOMIC_RELAXED);
+}
+
+///Mark bytes of the image changed, they are journaled with the next commit
+void jfs_dirty_meta(struct JSuper *sb, const void *ptr, uint64_t len)
+{
+    struct JJournal *j = dirty_journal(sb);
+
+    if (NULL != j && 0 != len)
+        dirty_mark(j, j->meta, (const uint8_t *)ptr - (const uint8_t *)sb, len);
+}
+
+///File contents, written home ahead of the commit, not journaled
+void jfs_dirty_data(struct JSuper *sb, const void *ptr, uint64_t len)
+{
+    struct JJournal *j = dirty_journal(sb);
+
+    if (NULL != j && 0 != len)
+        dirty_mark(j, j->data, (const uint8_t *)ptr - (const uint8_t *)sb, len);
+}
+
+///FAT and reverse FAT entries of count blocks from block
+void jfs_dirty_fat(struct JSuper *sb, int32_t block, uint32_t count)
+{
+    if (0 > block || NULL == dirty_journal(sb))
+        return;
+
+    jfs_dirty_meta(sb, jfs_get_fat_ptr(sb) + block, count * sizeof(int32_t));
+    jfs_dirty_meta(sb, jfs_get_rfat_ptr(sb) + block, count * sizeof(int32_t));
+}
+
+static int32_t write_home(int fd, struct JJournal *j, const uint8_t *images, uint32_t cnt)
+{
+    for (uint32_t ii = 0; ii < cnt; ii++)
+        if (0 != pwrite_all(fd, images + (uint64_t)ii * JFS_JOURNAL_PAGE, page_len(j->offset, j->list[ii]),
+                            (uint64_t)j->list[ii] * JFS_JOURNAL_PAGE))
+            return -1;
+
+    return 0;
+}
+
+///Everything marked so far as one transaction. Only one thread runs it at a time
+static int32_t journal_write(struct JSuper *sb, struct JState *st, struct JJournal *j)
+{
+    uint8_t *image = (uint8_t *)sb;
+    uint32_t words = (j->pages + 63) / 64;
+    uint32_t cnt = 0, data_cnt = 0;
+    int32_t ret = 0;
+
+    if (j->aborted)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOSPC, "Journal aborted, changes stay in memory!\n");
+        return -1;
+    }
+
+    ///No operation is halfway through while pages are taken
+    jfs_ns_write_lock(sb);
+    jfs_free_release(sb); //Whatever this one frees is taken only by the next
+    jfs_alloc_drain(sb);  //Cached blocks must be on the committed free list
+
+    uint64_t any = 0;
+    for (uint32_t ww = 0; ww < words; ww++)
+        any |= j->meta[ww];
+    if (0 != any)
+        j->meta[0] |= 1; //Superblock counters change along with any metadata
+
+    ///Going home without the journal would tear it, the file stays as of the
+    ///last commit and takes nothing more
+    for (uint32_t ww = 0; ww < words; ww++)
+        cnt += __builtin_popcountll(j->meta[ww]);
+    if (rec_bytes(cnt) > j->bytes - JFS_JOURNAL_PAGE)
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOSPC, "Transaction of %u pages doesn't fit the journal, image stays as of the last commit!\n", cnt);
+        j->aborted = 1;
+        jfs_ns_write_unlock(sb);
+        return -1;
+    }
+    cnt = 0;
+
+    for (uint32_t ww = 0; ww < words; ww++)
+    {
+        uint64_t meta = j->meta[ww], data = j->data[ww] & ~meta;
+
+        j->meta[ww] = 0;
+        j->data[ww] = 0;
+        for (; 0 != data && 0 == ret; data &= data - 1, data_cnt++)
+        {
+            uint32_t page = ww * 64 + __builtin_ctzll(data);
+            ret = pwrite_all(st->fd, image + (uint64_t)page * JFS_JOURNAL_PAGE, page_len(j->offset, page), (uint64_t)page * JFS_JOURNAL_PAGE);
+            ///Home copy is current and nobody writes meanwhile: the private
+            ///copy goes, the next touch maps the file's page again
+            if (0 == ret)
+                madvise(image + (uint64_t)page * JFS_JOURNAL_PAGE, JFS_JOURNAL_PAGE, MADV_DONTNEED);
+        }
+        for (; 0 != meta; meta &= meta - 1)
+            j->list[cnt++] = ww * 64 + __builtin_ctzll(meta);
+    }
+
+    uint64_t need = rec_bytes(cnt);
+    if (0 != cnt && need > j->buf_cap)
+    {
+        uint8_t *buf = realloc(j->buf, need);
+        if (NULL == buf)
+        {
+            JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_NOMEM, "Can't alloc memory for journal!\n");
+            jfs_ns_write_unlock(sb);
+            return -1;
+        }
+        j->buf = buf;
+        j->buf_cap = need;
+    }
+    for (uint32_t ii = 0; ii < cnt; ii++)
+        memcpy(j->buf + rec_index_bytes(cnt) + (uint64_t)ii * JFS_JOURNAL_PAGE, image + (uint64_t)j->list[ii] * JFS_JOURNAL_PAGE,
+               page_len(j->offset, j->list[ii]));
+    jfs_ns_write_unlock(sb);
+
+    ///Data first: the record may point at these blocks
+    if (0 == ret && 0 != data_cnt)
+    {
+        ret = fdatasync(st->fd);
+        j->syncs++;
+    }
+    if (0 != ret || 0 == cnt)
+        return 0 != ret ? -1 : 0;
+
+    uint8_t *images = j->buf + rec_index_bytes(cnt);
+    if (j->head + need > j->bytes)
+    {
+        ///Journal is full: make the home copies durable and start from the top
+        j->syncs++;
+        if (0 != fdatasync(st->fd) || 0 != write_head(st->fd, j->offset, j->seq))
+            return -1;
+        j->head = JFS_JOURNAL_PAGE;
+    }
+
+    struct JJournalRec *rec = (struct JJournalRec *)j->buf;
+    rec->magic = JFS_JOURNAL_MAGIC;
+    rec->pages = cnt;
+    rec->seq = j->seq;
+    rec->bytes = need;
+    rec->check = 0;
+    memset(j->buf + sizeof(struct JJournalRec), 0, rec_index_bytes(cnt) - sizeof(struct JJournalRec));
+    memcpy(j->buf + sizeof(struct JJournalRec), j->list, cnt * sizeof(uint32_t));
+    rec->check = journal_hash(j->buf, need);
+
+    j->syncs++;
+    if (0 != pwrite_all(st->fd, j->buf, need, j->offset + j->head) || 0 != fdatasync(st->fd))
+        return -1;
+    j->head += need;
+    j->seq++;
+    j->commits++;
+
+    ///Durable in the journal, home copies may lag until the next checkpoint
+    return write_home(st->fd, j, images, cnt);
+}
+
+///Wait until every change finished before the call is durable. The first
+///waiter commits for everybody who queued up meanwhile
+static int32_t journal_wait(struct JSuper *sb, struct JState *st, struct JJournal *j)
+{
+    pthread_mutex_lock(&(j->lock));
+    uint64_t txn = j->open_txn;
+
+    while (j->done_txn < txn)
+    {
+        if (j->committing)
+        {
+            pthread_cond_wait(&(j->done), &(j->lock));
+            continue;
+        }
+
+        uint64_t cur = j->open_txn++;
+        j->committing = 1;
+        pthread_mutex_unlock(&(j->lock));
+
+        int32_t ret = journal_write(sb, st, j);
+
+        pthread_mutex_lock(&(j->lock));
+        if (0 != ret)
+        {
+            if (!j->aborted) ///Abort has told why itself
+                JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_IO, "Can't commit journal!\n");
+            ///Blocks freed by the lost record may be reused already, a later
+            ///record would leave the file pointing at their new contents
+            j->aborted = 1;
+            j->failed_txn = cur;
+        }
+        j->committing = 0;
+        j->done_txn = cur;
+        pthread_cond_broadcast(&(j->done));
+    }
+
+    int32_t ret = j->failed_txn >= txn ? -1 : 0;
+    pthread_mutex_unlock(&(j->lock));
+    return ret;
+}
+
+///Called by mutators once they let go of their locks. Inside a section the
+///commit would wait for this very thread, there the changes go with the next one
+int32_t jfs_journal_commit(struct JSuper *sb)
+{
+    struct JJournal *j = dirty_journal(sb);
+
+    if (NULL == j || jfs_ns_held(sb))
+        return 0;
+
+    return journal_wait(sb, jfs_get_state(sb), j);
+}
+
+///Make everything done so far durable, e.g. after a batch in a section
+int32_t jfs_journal_sync(struct JSuper *sb)
+{
+    struct JJournal *j = dirty_journal(sb);
+
+    if (NULL == j)
+        return 0;
+    if (jfs_ns_held(sb))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_BUSY, "Can't sync the journal inside a namespace section!\n");
+        return -1;
+    }
+
+    return journal_wait(sb, jfs_get_state(sb), j);
+}
+
+///Commit what is left and checkpoint, the journal is empty afterwards
+int32_t jfs_journal_close(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JJournal *j = NULL == st ? NULL : st->journal;
+    int32_t ret;
+
+    if (NULL == j)
+        return 0;
+
+    ret = journal_wait(sb, st, j);
+    if (0 != fdatasync(st->fd) || 0 != write_head(st->fd, j->offset, j->seq) || 0 != fdatasync(st->fd))
+    {
+        JFS_ERROR(JFS_LOG_JOURNAL, JFS_ERR_IO, "Can't checkpoint journal!\n");
+        ret = -1;
+    }
+
+    st->journal = NULL;
+    pthread_mutex_destroy(&(j->lock));
+    pthread_cond_destroy(&(j->done));
+    free(j->meta);
+    free(j->data);
+    free(j->list);
+    free(j->buf);
+    free(j->held);
+    free(j);
+
+    return ret;
+}
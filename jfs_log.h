@@ -0,0 +1,57 @@
+#ifndef __JFS_LOG_H__
+#define __JFS_LOG_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "jfs.h"
+
+//Messages of the core. Those above JFS_LOG_LEVEL (build time, e.g.
+//-DJFS_LOG_LEVEL=JFS_LOG_DEBUG) compile to nothing, arguments included. The
+//rest pass the runtime level and category mask of jfs_set_log before they
+//are formatted.
+#define JFS_LOG_NONE    0
+#define JFS_LOG_ERROR   1
+#define JFS_LOG_WARN    2
+#define JFS_LOG_INFO    3
+#define JFS_LOG_DEBUG   4   //Per operation traces
+
+#ifndef JFS_LOG_LEVEL
+#define JFS_LOG_LEVEL   JFS_LOG_INFO
+#endif
+
+#define JFS_LOG_ALLOC   0x01
+#define JFS_LOG_DIR     0x02 //Create, lookup, rename, move, remove
+#define JFS_LOG_DATA    0x04 //File reads, writes, resizes
+#define JFS_LOG_MOUNT   0x08
+#define JFS_LOG_JOURNAL 0x10
+#define JFS_LOG_CACHE   0x20
+#define JFS_LOG_IMAGE   0x40 //Image builders, extraction and defrag
+#define JFS_LOG_ALL     0xff
+
+extern uint32_t jfs_log_level;
+extern uint32_t jfs_log_mask;
+
+void jfs_set_log(uint32_t level, uint32_t mask, FILE *out); //out NULL keeps the current one, stdout at start
+void jfs_log_write(uint32_t level, uint32_t category, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void jfs_set_error(int32_t code);
+
+#define JFS_LOG(level, category, ...)                                                                      \
+    do                                                                                                     \
+    {                                                                                                      \
+        if ((level) <= JFS_LOG_LEVEL && (level) <= jfs_log_level && ((category) & jfs_log_mask))           \
+            jfs_log_write((level), (category), __VA_ARGS__);                                               \
+    } while (0)
+
+//Failure of a call: sets the code jfs_last_error() returns, then logs
+#define JFS_ERROR(category, code, ...)                                                                     \
+    do                                                                                                     \
+    {                                                                                                      \
+        jfs_set_error(code);                                                                               \
+        JFS_LOG(JFS_LOG_ERROR, (category), __VA_ARGS__);                                                   \
+    } while (0)
+
+#define JFS_WARN(category, ...)  JFS_LOG(JFS_LOG_WARN, (category), __VA_ARGS__)
+#define JFS_INFO(category, ...)  JFS_LOG(JFS_LOG_INFO, (category), __VA_ARGS__)
+#define JFS_DEBUG(category, ...) JFS_LOG(JFS_LOG_DEBUG, (category), __VA_ARGS__)
+
+#endif //__JFS_LOG_H__
@@ -0,0 +1,319 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+///Sanity check of the header before anything follows its offsets
+int32_t jfs_check_super(struct JSuper *sb, uint64_t image_size)
+{
+    if (image_size < sizeof(struct JSuper))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Image is too small!\n");
+        return -1;
+    }
+
+    if (JFS_MAGIC != sb->magic || JFS_VERSION != sb->version)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Not a jfs image or unsupported version!\n");
+        return -1;
+    }
+
+    if (0 == jfs_files_fit_in_block(sb) || 0 == sb->blocks_count ||
+        (0 != sb->inodes_count) != (0 != (sb->flags & JFS_FLAG_ITABLE)) ||
+        0 != (sb->flags & ~(JFS_FLAG_JOURNAL | JFS_FLAG_ITABLE | JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS)) ||
+        ((sb->flags & (JFS_FLAG_COMPACT | JFS_FLAG_INLINE | JFS_FLAG_TAILPACK | JFS_FLAG_COMPRESS)) && !(sb->flags & JFS_FLAG_ITABLE)) ||
+        sb->system_bytes != jfs_system_size_opts(sb->blocks_count, sb->inodes_count, sb->flags) ||
+        sb->total_bytes != sb->system_bytes + (uint64_t)sb->blocks_count * sb->block_size + sb->journal_bytes ||
+        sb->total_bytes > image_size)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Broken image geometry!\n");
+        return -1;
+    }
+
+    if ((0 != sb->journal_bytes) != (0 != (sb->flags & JFS_FLAG_JOURNAL)) ||
+        0 != sb->journal_bytes % JFS_JOURNAL_PAGE || (0 != sb->journal_bytes && sb->journal_bytes < 2 * JFS_JOURNAL_PAGE))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Broken journal geometry!\n");
+        return -1;
+    }
+
+    if (sb->first_free_block < -1 || sb->first_free_block >= (int32_t)sb->blocks_count ||
+        sb->free_blocks > sb->blocks_count || !jfs_is_dir(&(sb->root)) ||
+        sb->free_inode < -1 || sb->free_inode >= (int32_t)sb->inodes_count ||
+        sb->tail_block < -1 || sb->tail_block >= (int32_t)sb->blocks_count ||
+        (0 <= sb->tail_block && !(sb->flags & JFS_FLAG_TAILPACK)))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Broken superblock!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t pread_all(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+    for (uint8_t *ptr = buf; len > 0; )
+    {
+        ssize_t got = pread(fd, ptr, len, offset);
+        if (got <= 0)
+            return -1;
+        ptr += got;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+///Tail block of file into place. Files of a dir mostly share a few, *last skips repeats
+static int32_t load_tail(struct JFile *file, struct JSuper *sb, int fd, int32_t *last)
+{
+    struct JTail *tail = jfs_file_tail(file);
+
+    if (NULL == tail || tail->block == *last)
+        return 0;
+    if (tail->block < 0 || (uint32_t)tail->block >= sb->blocks_count ||
+        tail->offset < sizeof(struct JTailBlock) || tail->offset + tail->len > sb->block_size ||
+        0 != pread_all(fd, jfs_block_idx_to_ptr(tail->block, sb), sb->block_size,
+                       jfs_block_idx_to_ptr(tail->block, sb) - (uint8_t *)sb))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_IO, "Can't read tail of %s!\n", file->name);
+        return -1;
+    }
+    *last = tail->block;
+
+    return 0;
+}
+
+///Read the blocks of dir and of all dirs below it into place, one request per
+///run, and the tail blocks of their files
+static int32_t load_dir(struct JFile *dir, struct JSuper *sb, int fd)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t left = sb->blocks_count;
+    int32_t last_tail = -1;
+    struct JDirIter it;
+    struct JFile *entry;
+
+    for (int32_t block = dir->first_data_block_idx; 0 <= block; )
+    {
+        uint32_t run = (uint32_t)block < sb->blocks_count ? jfs_contig_blocks(fat, block, left) : 0;
+        if (0 == run || block + run > sb->blocks_count ||
+            0 != pread_all(fd, jfs_block_idx_to_ptr(block, sb), (uint64_t)run * sb->block_size,
+                           jfs_block_idx_to_ptr(block, sb) - (uint8_t *)sb))
+        {
+            JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_IO, "Can't read directory %s!\n", dir->name);
+            return -1;
+        }
+        left -= run;
+        block = fat[block + run - 1];
+    }
+
+    jfs_dir_iter_init(&it, dir, sb);
+    while (NULL != (entry = jfs_dir_iter_next(&it, sb)))
+        if (0 != (jfs_is_dir(entry) ? load_dir(entry, sb, fd) : load_tail(entry, sb, fd, &last_tail)))
+            return -1;
+
+    return 0;
+}
+
+///No mapping of the image at all: an anonymous region of its size only gets
+///the header, FAT, rFAT, directory and tail blocks. File data is read on demand
+static struct JSuper *mount_pread(const char *path, uint32_t flags)
+{
+    struct JSuper head;
+    struct JSuper *sb;
+    struct JState *st;
+
+    if (flags & JFS_MOUNT_RDWR)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_INVAL, "pread mounts are read-only!\n");
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_NOENT, "Can't open image %s!\n", path);
+        return NULL;
+    }
+
+    ///Block devices report no st_size
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(struct JSuper) || 0 != pread_all(fd, &head, sizeof(head), 0))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Image %s is too small!\n", path);
+        close(fd);
+        return NULL;
+    }
+    if (0 != jfs_check_super(&head, size))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t map_len = head.total_bytes - head.journal_bytes;
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == map)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_NOMEM, "Can't reserve memory for image %s!\n", path);
+        close(fd);
+        return NULL;
+    }
+    sb = (struct JSuper *)map;
+
+    ///Replay would have to patch file data under the cache as well
+    int32_t records = 0;
+    if (0 != pread_all(fd, map, head.system_bytes, 0) ||
+        ((head.flags & JFS_FLAG_JOURNAL) && 0 != (records = jfs_journal_replay(sb, fd, 0))))
+    {
+        if (0 < records)
+            JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_BUSY, "Journal of %s needs replay, mount it RDWR once!\n", path);
+        else
+            JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_IO, "Can't read image %s!\n", path);
+        munmap(map, map_len);
+        close(fd);
+        return NULL;
+    }
+
+    st = jfs_attach(sb);
+    if (NULL == st)
+    {
+        munmap(map, map_len);
+        close(fd);
+        return NULL;
+    }
+    st->mount_flags = flags;
+    st->fd = fd;
+    st->map = map;
+    st->map_len = map_len;
+
+    if (0 != load_dir(&(sb->root), sb, fd) || 0 != jfs_cache_create(sb, JFS_CACHE_MIB, JFS_READAHEAD))
+    {
+        jfs_detach(sb);
+        munmap(map, map_len);
+        close(fd);
+        return NULL;
+    }
+
+    return sb;
+}
+
+///Images with a journal are mapped privately: changes reach the file only
+///through commits, and replay can fix up the map even for read-only mounts.
+///Commits give data pages back to the file; changed metadata pages stay
+///private copies until unmount, at most the system area and directory blocks
+struct JSuper *jfs_mount(const char *path, uint32_t flags)
+{
+    int rdwr = flags & JFS_MOUNT_RDWR;
+    struct stat st_buf;
+    struct JSuper head;
+    struct JState *st;
+    void *map;
+
+    if (flags & JFS_MOUNT_PREAD)
+        return mount_pread(path, flags);
+
+    int fd = open(path, rdwr ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_NOENT, "Can't open image %s!\n", path);
+        return NULL;
+    }
+
+    if (0 != fstat(fd, &st_buf) || st_buf.st_size < (off_t)sizeof(struct JSuper) ||
+        sizeof(head) != pread(fd, &head, sizeof(head), 0))
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_CORRUPT, "Image %s is too small!\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (0 != jfs_check_super(&head, st_buf.st_size))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    int journal = head.flags & JFS_FLAG_JOURNAL;
+    map = mmap(NULL, st_buf.st_size, journal || rdwr ? PROT_READ | PROT_WRITE : PROT_READ,
+               journal ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_NOMEM, "Can't map image %s!\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    ///Replayed pages may carry anything, the superblock is checked once more
+    if (journal && (0 > jfs_journal_replay((struct JSuper *)map, fd, rdwr) ||
+                    0 != jfs_check_super((struct JSuper *)map, st_buf.st_size)))
+    {
+        munmap(map, st_buf.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    st = jfs_attach((struct JSuper *)map);
+    if (NULL == st)
+    {
+        munmap(map, st_buf.st_size);
+        close(fd);
+        return NULL;
+    }
+    st->mount_flags = flags;
+    st->fd = fd;
+    st->map = map;
+    st->map_len = st_buf.st_size;
+
+    if (journal && rdwr && 0 != jfs_journal_open((struct JSuper *)map))
+    {
+        jfs_detach((struct JSuper *)map);
+        munmap(map, st_buf.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    return (struct JSuper *)map;
+}
+
+int32_t jfs_umount(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    int32_t ret = 0;
+
+    if (NULL == st || NULL == st->map)
+    {
+        JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_INVAL, "Image is not mounted!\n");
+        return -1;
+    }
+
+    void *map = st->map;
+    uint64_t map_len = st->map_len;
+    int fd = st->fd;
+
+    if (NULL != st->journal)
+    {
+        ret = jfs_journal_close(sb);
+    }
+    else
+    {
+        jfs_alloc_drain(sb);
+        if ((st->mount_flags & JFS_MOUNT_RDWR) && 0 != msync(map, map_len, MS_SYNC))
+        {
+            JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_IO, "Can't sync image!\n");
+            ret = -1;
+        }
+    }
+
+    jfs_cache_destroy(sb);
+    jfs_detach(sb);
+    munmap(map, map_len);
+    close(fd);
+
+    return ret;
+}
@@ -0,0 +1,1164 @@
+#include "jfs.h"
+#include "jfs_state.h"
+#include "jfs_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct JState *states[JFS_MAX_STATES];
+
+#ifdef JFS_STATS
+///Live threads are listed, exited ones are folded into stats_gone. The lock
+///only guards the list, counters are never locked
+__thread struct JThreadStats *jfs_tstats;
+static struct JThreadStats *stats_threads;
+static struct JStats stats_gone;
+static struct JStats stats_base;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void stats_sum(struct JStats *dst, const struct JStats *src)
+{
+    const uint64_t *from = (const uint64_t *)src;
+    uint64_t *to = (uint64_t *)dst;
+
+    for (uint32_t ii = 0; ii < sizeof(struct JStats) / sizeof(uint64_t); ii++)
+        to[ii] += __atomic_load_n(&(from[ii]), __ATOMIC_RELAXED);
+}
+
+static void stats_thread_exit(void *arg)
+{
+    struct JThreadStats *ts = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(&stats_gone, &(ts->s));
+    if (NULL != ts->prev)
+        ts->prev->next = ts->next;
+    else
+        stats_threads = ts->next;
+    if (NULL != ts->next)
+        ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&stats_lock);
+
+    jfs_tstats = NULL;
+    free(ts);
+}
+
+static void stats_key_init(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+///First count of a thread. NULL (nothing counted) without memory
+struct JThreadStats *jfs_stats_register(void)
+{
+    struct JThreadStats *ts = calloc(1, sizeof(struct JThreadStats));
+
+    if (NULL == ts)
+        return NULL;
+
+    pthread_once(&stats_once, stats_key_init);
+    pthread_mutex_lock(&stats_lock);
+    ts->next = stats_threads;
+    if (NULL != stats_threads)
+        stats_threads->prev = ts;
+    stats_threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, ts);
+    jfs_tstats = ts;
+    return ts;
+}
+
+static void stats_total(struct JStats *stats)
+{
+    memset(stats, 0, sizeof(struct JStats));
+    stats_sum(stats, &stats_gone);
+    for (struct JThreadStats *ts = stats_threads; NULL != ts; ts = ts->next)
+        stats_sum(stats, &(ts->s));
+}
+
+int32_t jfs_stats_get(struct JStats *stats)
+{
+    uint64_t *count = (uint64_t *)stats;
+    const uint64_t *base = (const uint64_t *)&stats_base;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_total(stats);
+    for (uint32_t ii = 0; ii < sizeof(struct JStats) / sizeof(uint64_t); ii++)
+        count[ii] -= base[ii];
+    pthread_mutex_unlock(&stats_lock);
+
+    return 0;
+}
+
+int32_t jfs_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_total(&stats_base);
+    pthread_mutex_unlock(&stats_lock);
+
+    return 0;
+}
+#else
+int32_t jfs_stats_get(struct JStats *stats)
+{
+    memset(stats, 0, sizeof(struct JStats));
+    return -1;
+}
+
+int32_t jfs_stats_reset(void)
+{
+    return -1;
+}
+#endif
+
+int32_t jfs_stats_dump(const struct JStats *stats, char *buf, uint32_t size)
+{
+    static const char *const op_names[JFS_OP_COUNT] = {
+        "other", "create", "lookup", "read_dir", "read", "write", "resize", "rename", "move", "remove"
+    };
+    const struct { const char *name; uint64_t value; } totals[] = {
+        {"blocks_allocated", stats->blocks_allocated},
+        {"blocks_freed", stats->blocks_freed},
+        {"bytes_read", stats->bytes_read},
+        {"bytes_written", stats->bytes_written},
+        {"dir_entries_scanned", stats->dir_entries_scanned},
+        {"child_fixups", stats->child_fixups},
+        {"entry_swaps", stats->entry_swaps},
+    };
+    uint32_t len = 0;
+
+    ///Like snprintf: the full length is counted even when buf is short
+    for (uint32_t ii = 0; ii < JFS_OP_COUNT; ii++)
+        len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "ops.%s %lu\nfat_hops.%s %lu\n",
+                        op_names[ii], (unsigned long)stats->ops[ii], op_names[ii], (unsigned long)stats->fat_hops[ii]);
+    for (uint32_t ii = 0; ii < sizeof(totals) / sizeof(totals[0]); ii++)
+        len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "%s %lu\n",
+                        totals[ii].name, (unsigned long)totals[ii].value);
+
+    return len;
+}
+
+struct JState *jfs_get_state(struct JSuper *sb)
+{
+    for (int ii = 0; ii < JFS_MAX_STATES; ii++)
+    {
+        if (NULL != states[ii] && states[ii]->sb == sb)
+            return states[ii];
+    }
+
+    return NULL;
+}
+
+static void run_leaf(struct JRunNode *node, uint64_t word)
+{
+    uint32_t max = 0;
+
+    node->pre = ~word ? __builtin_ctzll(~word) : 64;
+    node->suf = ~word ? __builtin_clzll(~word) : 64;
+    for (; 0 != word; max++)
+        word &= word >> 1;
+    node->max = max;
+}
+
+static void run_pull(struct JRunNode *tree, uint32_t ii, uint32_t half)
+{
+    struct JRunNode *l = &(tree[2 * ii]), *r = &(tree[2 * ii + 1]);
+    uint32_t mid = l->suf + r->pre;
+
+    tree[ii].pre = l->pre == half ? half + r->pre : l->pre;
+    tree[ii].suf = r->suf == half ? half + l->suf : r->suf;
+    tree[ii].max = l->max > r->max ? l->max : r->max;
+    if (mid > tree[ii].max)
+        tree[ii].max = mid;
+}
+
+///Recompute leaves lo..hi (word indexes) and everything above them
+static void run_tree_update(struct JState *st, uint32_t lo, uint32_t hi)
+{
+    uint32_t half = 64;
+
+    for (uint32_t ii = lo; ii <= hi; ii++)
+        run_leaf(&(st->run_tree[st->map_leaves + ii]), ii < st->map_words ? st->free_map[ii] : 0);
+
+    for (lo = (st->map_leaves + lo) / 2, hi = (st->map_leaves + hi) / 2; lo >= 1; lo /= 2, hi /= 2, half *= 2)
+    {
+        for (uint32_t ii = lo; ii <= hi; ii++)
+            run_pull(st->run_tree, ii, half);
+    }
+}
+
+static void free_map_set(struct JState *st, uint32_t start, uint32_t count, int free)
+{
+    for (uint32_t block = start; block < start + count; )
+    {
+        uint32_t bit = block % 64;
+        uint32_t n = 64 - bit < start + count - block ? 64 - bit : start + count - block;
+        uint64_t mask = (64 == n ? ~0ull : ((1ull << n) - 1)) << bit;
+
+        if (free)
+            st->free_map[block / 64] |= mask;
+        else
+            st->free_map[block / 64] &= ~mask;
+        block += n;
+    }
+}
+
+static int32_t free_map_build(struct JState *st)
+{
+    struct JSuper *sb = st->sb;
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+
+    st->map_words = (sb->blocks_count + 63) / 64;
+    for (st->map_leaves = 1; st->map_leaves < st->map_words; st->map_leaves *= 2)
+        ;
+    st->free_map = calloc(st->map_words, sizeof(uint64_t));
+    st->run_tree = calloc(2 * st->map_leaves, sizeof(struct JRunNode));
+    if (NULL == st->free_map || NULL == st->run_tree)
+    {
+        JFS_ERROR(JFS_LOG_ALLOC, JFS_ERR_NOMEM, "Can't alloc memory for free map!\n");
+        return -1;
+    }
+
+    for (int32_t ext = sb->first_free_block; 0 <= ext; ext = fat[ext])
+        free_map_set(st, ext, rfat[ext], 1);
+
+    run_tree_update(st, 0, st->map_leaves - 1);
+    st->free_split = 1; ///Whoever wrote the list before may have left touching extents
+    return 0;
+}
+
+void jfs_free_map_update(struct JSuper *sb, int32_t start, uint32_t count, int free)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || NULL == st->free_map || 0 == count)
+        return;
+
+    free_map_set(st, start, count, free);
+    run_tree_update(st, start / 64, (start + count - 1) / 64);
+}
+
+///1 - block is on the free list, 0 - it is not, -1 - no free map to tell
+int32_t jfs_free_map_test(struct JSuper *sb, int32_t block)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || NULL == st->free_map || 0 > block || (uint32_t)block >= sb->blocks_count)
+        return -1;
+
+    return st->free_map[block / 64] >> block % 64 & 1;
+}
+
+///First block at or after block whose map bit is bit, blocks_count if none
+static uint32_t free_map_next(struct JState *st, uint32_t block, int bit)
+{
+    while (block < st->sb->blocks_count)
+    {
+        uint64_t word = (bit ? st->free_map[block / 64] : ~st->free_map[block / 64]) >> block % 64;
+        if (0 != word)
+            return block + __builtin_ctzll(word) < st->sb->blocks_count ? block + __builtin_ctzll(word) : st->sb->blocks_count;
+        block = (block / 64 + 1) * 64;
+    }
+
+    return st->sb->blocks_count;
+}
+
+///Free list from the free map: an extent per run, in block order. Runs that
+///frees left in several touching extents become one. Under the alloc lock
+int32_t jfs_free_list_relink(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    int32_t prev = -1;
+
+    if (NULL == st || NULL == st->free_map)
+        return -1;
+
+    sb->first_free_block = -1;
+    for (uint32_t block = free_map_next(st, 0, 1); block < sb->blocks_count; )
+    {
+        uint32_t end = free_map_next(st, block, 0);
+
+        fat[block] = -1;
+        rfat[block] = end - block;
+        jfs_dirty_fat(sb, block, 1);
+        if (0 > prev)
+            sb->first_free_block = block;
+        else
+            fat[prev] = block;
+        jfs_dirty_fat(sb, prev, 1);
+        prev = block;
+        block = free_map_next(st, end, 1);
+    }
+    st->free_split = 0;
+
+    return 0;
+}
+
+///Image without state: the free list is marked in a scratch map and scanned.
+///Extents may touch each other, so the longest one alone is not the answer
+static uint32_t free_list_largest_run(struct JSuper *sb)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    int32_t *rfat = jfs_get_rfat_ptr(sb);
+    uint64_t *map = calloc((sb->blocks_count + 63) / 64, sizeof(uint64_t));
+    uint32_t max = 0, run = 0;
+
+    for (int32_t ext = sb->first_free_block; 0 <= ext; ext = fat[ext])
+    {
+        if (NULL == map) ///Lower bound only
+            max = (uint32_t)rfat[ext] > max ? (uint32_t)rfat[ext] : max;
+        else
+            for (uint32_t block = ext; block < (uint32_t)ext + rfat[ext] && block < sb->blocks_count; block++)
+                map[block / 64] |= 1ull << block % 64;
+    }
+    if (NULL == map)
+        return max;
+
+    for (uint32_t block = 0; block < sb->blocks_count; block++)
+    {
+        run = map[block / 64] >> block % 64 & 1 ? run + 1 : 0;
+        max = run > max ? run : max;
+    }
+    free(map);
+
+    return max;
+}
+
+uint32_t jfs_largest_free_run(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st)
+        return free_list_largest_run(sb);
+
+    return st->run_tree[1].max;
+}
+
+///Lowest block starting a free run of at least count blocks, -1 if there is
+///none. Needs the free map of an attached image, -1 without it
+int32_t jfs_find_free_run(struct JSuper *sb, uint32_t count)
+{
+    struct JState *st = jfs_get_state(sb);
+    uint32_t ii = 1, base = 0, size;
+
+    if (NULL == st || 0 == count || st->run_tree[1].max < count)
+        return -1;
+
+    for (size = 64 * st->map_leaves; ii < st->map_leaves; )
+    {
+        struct JRunNode *l = &(st->run_tree[2 * ii]), *r = &(st->run_tree[2 * ii + 1]);
+
+        size /= 2;
+        if (l->max >= count)
+        {
+            ii = 2 * ii;
+        }
+        else if (l->suf + r->pre >= count) ///Run crosses the middle
+        {
+            return base + size - l->suf;
+        }
+        else
+        {
+            ii = 2 * ii + 1;
+            base += size;
+        }
+    }
+
+    uint64_t word = st->free_map[ii - st->map_leaves];
+    for (uint32_t bit = 0, run = 0; bit < 64; bit++)
+    {
+        run = (word >> bit & 1) ? run + 1 : 0;
+        if (run == count)
+            return base + bit + 1 - count;
+    }
+
+    return -1;
+}
+
+void jfs_generation_bump(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st)
+        __atomic_add_fetch(&(st->generation), 1, __ATOMIC_RELAXED);
+}
+
+uint32_t jfs_generation(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    return NULL == st ? 0 : __atomic_load_n(&(st->generation), __ATOMIC_RELAXED);
+}
+
+static void locks_init(struct JState *st)
+{
+    pthread_mutex_init(&(st->alloc_lock), NULL);
+    pthread_mutex_init(&(st->tail_lock), NULL);
+    pthread_mutex_init(&(st->zcache.lock), NULL);
+    pthread_rwlock_init(&(st->dir_lock), NULL);
+    for (int ii = 0; ii < JFS_SEEK_SHARDS; ii++)
+        pthread_rwlock_init(&(st->seek[ii].lock), NULL);
+    for (int ii = 0; ii < JFS_LOCK_SLOTS; ii++)
+    {
+        pthread_rwlock_init(&(st->ns[ii].lock), NULL);
+        pthread_mutex_init(&(st->mags[ii].lock), NULL);
+    }
+    for (int ii = 0; ii < JFS_LOCK_STRIPES; ii++)
+        pthread_rwlock_init(&(st->files[ii].lock), NULL);
+}
+
+static void locks_destroy(struct JState *st)
+{
+    pthread_mutex_destroy(&(st->alloc_lock));
+    pthread_mutex_destroy(&(st->tail_lock));
+    pthread_mutex_destroy(&(st->zcache.lock));
+    pthread_rwlock_destroy(&(st->dir_lock));
+    for (int ii = 0; ii < JFS_SEEK_SHARDS; ii++)
+        pthread_rwlock_destroy(&(st->seek[ii].lock));
+    for (int ii = 0; ii < JFS_LOCK_SLOTS; ii++)
+    {
+        pthread_rwlock_destroy(&(st->ns[ii].lock));
+        pthread_mutex_destroy(&(st->mags[ii].lock));
+    }
+    for (int ii = 0; ii < JFS_LOCK_STRIPES; ii++)
+        pthread_rwlock_destroy(&(st->files[ii].lock));
+}
+
+struct JState *jfs_attach(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+    if (NULL != st)
+        return st;
+
+    for (int ii = 0; ii < JFS_MAX_STATES; ii++)
+    {
+        if (NULL == states[ii])
+        {
+            st = aligned_alloc(64, sizeof(struct JState));
+            if (NULL == st)
+            {
+                JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_NOMEM, "Can't alloc memory for jfs state!\n");
+                return NULL;
+            }
+            memset(st, 0, sizeof(struct JState));
+            st->sb = sb;
+            st->idx = ii;
+            st->mount_flags = JFS_MOUNT_RDWR;
+            st->fd = -1;
+            if (0 != free_map_build(st))
+            {
+                free(st->free_map);
+                free(st->run_tree);
+                free(st);
+                return NULL;
+            }
+            locks_init(st);
+            states[ii] = st;
+            return st;
+        }
+    }
+
+    JFS_ERROR(JFS_LOG_MOUNT, JFS_ERR_BUSY, "Too many attached images!\n");
+    return NULL;
+}
+
+static void seek_index_free_all(struct JState *st)
+{
+    for (int jj = 0; jj < JFS_SEEK_SHARDS; jj++)
+    {
+        struct JSeekShard *shard = &(st->seek[jj]);
+        for (uint32_t ii = 0; ii < shard->buckets; ii++)
+        {
+            struct JSeekIndex *idx = shard->tab[ii];
+            while (NULL != idx)
+            {
+                struct JSeekIndex *next = idx->next;
+                free(idx->blocks);
+                free(idx);
+                idx = next;
+            }
+        }
+        free(shard->tab);
+        shard->tab = NULL;
+        shard->buckets = 0;
+        shard->used = 0;
+    }
+}
+
+static void dir_index_free_all(struct JState *st)
+{
+    for (uint32_t ii = 0; ii < st->dir_buckets; ii++)
+    {
+        struct JDirIndex *idx = st->dir_tab[ii];
+        while (NULL != idx)
+        {
+            struct JDirIndex *next = idx->next;
+            free(idx->slots);
+            free(idx);
+            idx = next;
+        }
+    }
+    free(st->dir_tab);
+    st->dir_tab = NULL;
+    st->dir_buckets = 0;
+    st->dir_used = 0;
+}
+
+void jfs_detach(struct JSuper *sb)
+{
+    for (int ii = 0; ii < JFS_MAX_STATES; ii++)
+    {
+        if (NULL != states[ii] && states[ii]->sb == sb)
+        {
+            jfs_alloc_drain(sb); //Cached blocks go back to the image's free list
+            seek_index_free_all(states[ii]);
+            dir_index_free_all(states[ii]);
+            jfs_zcache_free(states[ii]);
+            locks_destroy(states[ii]);
+            free(states[ii]->free_map);
+            free(states[ii]->run_tree);
+            free(states[ii]);
+            states[ii] = NULL;
+            return;
+        }
+    }
+}
+
+int8_t jfs_is_read_only(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    return NULL != st && !(st->mount_flags & JFS_MOUNT_RDWR);
+}
+
+///Locks. A thread keeps one namespace slot for its whole life, so readers
+///on different slots never write to a shared cache line.
+
+static uint32_t slot_next;
+static __thread int32_t my_slot = -1;
+static __thread uint32_t ns_read_depth[JFS_MAX_STATES];  //Per image, by JState.idx
+static __thread uint32_t ns_write_depth[JFS_MAX_STATES];
+
+uint32_t jfs_thread_slot(void)
+{
+    if (0 > my_slot)
+        my_slot = __atomic_fetch_add(&slot_next, 1, __ATOMIC_RELAXED) % JFS_LOCK_SLOTS;
+
+    return my_slot;
+}
+
+static inline struct JLock *ns_slot(struct JState *st)
+{
+    return &(st->ns[jfs_thread_slot()]);
+}
+
+///Pin the namespace: entry pointers (JFile *) stay valid until the unlock.
+///Nests, and inside a write section costs nothing
+void jfs_ns_read_lock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st && 0 == ns_read_depth[st->idx]++ && 0 == ns_write_depth[st->idx])
+        pthread_rwlock_rdlock(&(ns_slot(st)->lock));
+}
+
+void jfs_ns_read_unlock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st && 0 == --ns_read_depth[st->idx] && 0 == ns_write_depth[st->idx])
+        pthread_rwlock_unlock(&(ns_slot(st)->lock));
+}
+
+///Thread pins the namespace for reading only, so it can't get the write lock
+int8_t jfs_ns_in_read(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    return NULL != st && 0 != ns_read_depth[st->idx] && 0 == ns_write_depth[st->idx];
+}
+
+///Thread is inside a section of either kind
+int8_t jfs_ns_held(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    return NULL != st && (0 != ns_read_depth[st->idx] || 0 != ns_write_depth[st->idx]);
+}
+
+///Own the namespace: lookups and mutators of this thread only. Nests
+void jfs_ns_write_lock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || 0 != ns_write_depth[st->idx]++)
+        return;
+    for (int ii = 0; ii < JFS_LOCK_SLOTS; ii++)
+        pthread_rwlock_wrlock(&(st->ns[ii].lock));
+}
+
+void jfs_ns_write_unlock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || 0 != --ns_write_depth[st->idx])
+        return;
+    for (int ii = JFS_LOCK_SLOTS - 1; ii >= 0; ii--)
+        pthread_rwlock_unlock(&(st->ns[ii].lock));
+}
+
+static inline struct JLock *file_stripe(struct JState *st, struct JFile *file)
+{
+    uintptr_t key = (uintptr_t)file / sizeof(struct JFile);
+
+    return &(st->files[(uint32_t)(key * 2654435761u) >> 24 & (JFS_LOCK_STRIPES - 1)]);
+}
+
+///File data ops run inside a namespace read section of their own, so a
+///namespace writer (create, remove, defrag) never sees a chain half-written
+void jfs_file_lock(struct JFile *file, struct JSuper *sb, int write)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st)
+        return;
+    jfs_ns_read_lock(sb);
+    if (write)
+        pthread_rwlock_wrlock(&(file_stripe(st, file)->lock));
+    else
+        pthread_rwlock_rdlock(&(file_stripe(st, file)->lock));
+}
+
+void jfs_file_unlock(struct JFile *file, struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st)
+        return;
+    pthread_rwlock_unlock(&(file_stripe(st, file)->lock));
+    jfs_ns_read_unlock(sb);
+}
+
+void jfs_alloc_lock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st)
+        pthread_mutex_lock(&(st->alloc_lock));
+}
+
+void jfs_alloc_unlock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st)
+        pthread_mutex_unlock(&(st->alloc_lock));
+}
+
+void jfs_tail_lock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st)
+        pthread_mutex_lock(&(st->tail_lock));
+}
+
+void jfs_tail_unlock(struct JSuper *sb)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL != st)
+        pthread_mutex_unlock(&(st->tail_lock));
+}
+
+///Seek index
+
+int32_t jfs_set_seek_index(struct JSuper *sb, uint32_t stride)
+{
+    struct JState *st = jfs_attach(sb);
+    if (NULL == st)
+        return -1;
+
+    seek_index_free_all(st);
+    st->seek_stride = stride;
+
+    return 0;
+}
+
+static inline uint32_t seek_hash(int32_t first_block, uint32_t buckets)
+{
+    return ((uint32_t)first_block * 2654435761u) & (buckets - 1);
+}
+
+static inline struct JSeekShard *seek_shard(struct JState *st, int32_t first_block)
+{
+    return &(st->seek[((uint32_t)first_block * 2654435761u) >> 28 & (JFS_SEEK_SHARDS - 1)]);
+}
+
+static int32_t seek_index_grow(struct JSeekShard *shard)
+{
+    uint32_t buckets = shard->buckets ? shard->buckets * 2 : 64;
+    struct JSeekIndex **tab = calloc(buckets, sizeof(struct JSeekIndex *));
+    if (NULL == tab)
+        return -1;
+
+    for (uint32_t ii = 0; ii < shard->buckets; ii++)
+    {
+        struct JSeekIndex *idx = shard->tab[ii];
+        while (NULL != idx)
+        {
+            struct JSeekIndex *next = idx->next;
+            uint32_t h = seek_hash(idx->first_block, buckets);
+            idx->next = tab[h];
+            tab[h] = idx;
+            idx = next;
+        }
+    }
+
+    free(shard->tab);
+    shard->tab = tab;
+    shard->buckets = buckets;
+    return 0;
+}
+
+///Caller holds shard->lock for reading at least
+static struct JSeekIndex *seek_index_find(struct JSeekShard *shard, int32_t first_block)
+{
+    if (0 == shard->buckets)
+        return NULL;
+
+    for (struct JSeekIndex *idx = shard->tab[seek_hash(first_block, shard->buckets)]; NULL != idx; idx = idx->next)
+    {
+        if (idx->first_block == first_block)
+            return idx;
+    }
+    return NULL;
+}
+
+///Caller holds shard->lock for writing
+static struct JSeekIndex *seek_index_get(struct JSeekShard *shard, int32_t first_block)
+{
+    struct JSeekIndex *idx = seek_index_find(shard, first_block);
+
+    if (NULL != idx)
+        return idx;
+
+    if (shard->used >= shard->buckets && 0 != seek_index_grow(shard))
+        return NULL;
+
+    idx = calloc(1, sizeof(struct JSeekIndex));
+    if (NULL == idx)
+        return NULL;
+    idx->cap = 16;
+    idx->blocks = malloc(idx->cap * sizeof(int32_t));
+    if (NULL == idx->blocks)
+    {
+        free(idx);
+        return NULL;
+    }
+    idx->first_block = first_block;
+    idx->blocks[0] = first_block;
+    idx->count = 1;
+
+    uint32_t h = seek_hash(first_block, shard->buckets);
+    idx->next = shard->tab[h];
+    shard->tab[h] = idx;
+    shard->used++;
+
+    return idx;
+}
+
+static void seek_index_push(struct JSeekIndex *idx, int32_t block)
+{
+    if (idx->count == idx->cap)
+    {
+        int32_t *blocks = realloc(idx->blocks, 2 * idx->cap * sizeof(int32_t));
+        if (NULL == blocks)
+            return; //Index just stops growing, lookups walk the rest
+        idx->blocks = blocks;
+        idx->cap *= 2;
+    }
+    idx->blocks[idx->count++] = block;
+}
+
+///Drop samples past the first blocks_left blocks of the chain, 0 drops the whole index
+void jfs_seek_index_truncate(struct JSuper *sb, int32_t first_block, uint32_t blocks_left)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || 0 == st->seek_stride || first_block < 0)
+        return;
+
+    struct JSeekShard *shard = seek_shard(st, first_block);
+    pthread_rwlock_wrlock(&(shard->lock));
+
+    struct JSeekIndex **link = 0 == shard->buckets ? NULL : &(shard->tab[seek_hash(first_block, shard->buckets)]);
+    for (; NULL != link && NULL != *link; link = &((*link)->next))
+    {
+        struct JSeekIndex *idx = *link;
+        if (idx->first_block != first_block)
+            continue;
+
+        if (0 == blocks_left)
+        {
+            *link = idx->next;
+            free(idx->blocks);
+            free(idx);
+            shard->used--;
+        }
+        else if ((blocks_left - 1) / st->seek_stride + 1 < idx->count)
+        {
+            idx->count = (blocks_left - 1) / st->seek_stride + 1;
+        }
+        break;
+    }
+
+    pthread_rwlock_unlock(&(shard->lock));
+}
+
+///Block at position n of the file's (or directory's) chain, -1 if chain is shorter
+int32_t jfs_seek_block(struct JFile *file, struct JSuper *sb, uint32_t n)
+{
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    struct JState *st = jfs_get_state(sb);
+    struct JSeekIndex *idx = NULL;
+    int32_t block = file->first_data_block_idx;
+    uint32_t pos = 0;
+
+    if (block < 0)
+        return -1;
+
+    if (0 != file->size && !(file->flags & (JFS_FILE_TAIL | JFS_FILE_COMP)) &&
+        n == (file->size - 1) / (jfs_is_dir(file) ? jfs_files_fit_in_block(sb) : sb->block_size))
+        return file->last_data_block_idx;
+
+    if (NULL == st || 0 == st->seek_stride)
+    {
+        for (; pos < n && block >= 0; pos++)
+            block = jfs_fat_next(fat, block);
+        return block;
+    }
+
+    ///Hits share the shard, the file's own lock keeps its chain still while we walk
+    struct JSeekShard *shard = seek_shard(st, block);
+    uint32_t sample = n / st->seek_stride;
+    pthread_rwlock_rdlock(&(shard->lock));
+    idx = seek_index_find(shard, block);
+    if (NULL != idx && sample < idx->count)
+    {
+        block = idx->blocks[sample];
+        pthread_rwlock_unlock(&(shard->lock));
+        for (pos = sample * st->seek_stride; pos < n && block >= 0; pos++)
+            block = jfs_fat_next(fat, block);
+        return block;
+    }
+    pthread_rwlock_unlock(&(shard->lock));
+
+    ///Miss, the walk extends the index
+    pthread_rwlock_wrlock(&(shard->lock));
+    idx = seek_index_get(shard, block);
+
+    if (NULL != idx)
+    {
+        if (sample >= idx->count)
+            sample = idx->count - 1;
+        block = idx->blocks[sample];
+        pos = sample * st->seek_stride;
+    }
+
+    while (pos < n && block >= 0)
+    {
+        block = jfs_fat_next(fat, block);
+        pos++;
+        if (NULL != idx && block >= 0 && pos == idx->count * st->seek_stride)
+            seek_index_push(idx, block);
+    }
+
+    pthread_rwlock_unlock(&(shard->lock));
+    return block;
+}
+
+///Directory name index
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    for (; '\0' != *name; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+
+    return h;
+}
+
+static inline struct JFile *dir_slot_file(struct JDirSlot *slot, struct JSuper *sb)
+{
+    return jfs_dir_entry(sb, slot->block, slot->offset);
+}
+
+static int32_t dir_tab_grow(struct JState *st)
+{
+    uint32_t buckets = st->dir_buckets ? st->dir_buckets * 2 : 64;
+    struct JDirIndex **tab = calloc(buckets, sizeof(struct JDirIndex *));
+    if (NULL == tab)
+        return -1;
+
+    for (uint32_t ii = 0; ii < st->dir_buckets; ii++)
+    {
+        struct JDirIndex *idx = st->dir_tab[ii];
+        while (NULL != idx)
+        {
+            struct JDirIndex *next = idx->next;
+            uint32_t h = seek_hash(idx->first_block, buckets);
+            idx->next = tab[h];
+            tab[h] = idx;
+            idx = next;
+        }
+    }
+
+    free(st->dir_tab);
+    st->dir_tab = tab;
+    st->dir_buckets = buckets;
+    return 0;
+}
+
+static struct JDirIndex *dir_index_lookup(struct JState *st, int32_t first_block)
+{
+    if (0 == st->dir_buckets || first_block < 0)
+        return NULL;
+
+    for (struct JDirIndex *idx = st->dir_tab[seek_hash(first_block, st->dir_buckets)]; NULL != idx; idx = idx->next)
+    {
+        if (idx->first_block == first_block)
+            return idx;
+    }
+
+    return NULL;
+}
+
+static void dir_slot_put(struct JDirIndex *idx, uint32_t hash, int32_t block, uint32_t offset)
+{
+    uint32_t ii = hash & (idx->cap - 1);
+
+    while (-1 != idx->slots[ii].block)
+        ii = (ii + 1) & (idx->cap - 1);
+
+    idx->slots[ii].hash = hash;
+    idx->slots[ii].block = block;
+    idx->slots[ii].offset = offset;
+    idx->used++;
+}
+
+static int32_t dir_index_resize(struct JDirIndex *idx, uint32_t cap)
+{
+    struct JDirSlot *old = idx->slots;
+    uint32_t old_cap = idx->cap;
+
+    idx->slots = malloc(cap * sizeof(struct JDirSlot));
+    if (NULL == idx->slots)
+    {
+        idx->slots = old;
+        return -1;
+    }
+    for (uint32_t ii = 0; ii < cap; ii++)
+        idx->slots[ii].block = -1;
+    idx->cap = cap;
+    idx->used = 0;
+
+    for (uint32_t ii = 0; ii < old_cap; ii++)
+    {
+        if (-1 != old[ii].block)
+            dir_slot_put(idx, old[ii].hash, old[ii].block, old[ii].offset);
+    }
+    free(old);
+
+    return 0;
+}
+
+///Index every entry of the directory
+static struct JDirIndex *dir_index_build(struct JState *st, struct JFile *dir)
+{
+    struct JSuper *sb = st->sb;
+    int32_t *fat = jfs_get_fat_ptr(sb);
+    uint32_t fit = jfs_files_fit_in_block(sb);
+    uint32_t cap = 16;
+
+    if (st->dir_used >= st->dir_buckets && 0 != dir_tab_grow(st))
+        return NULL;
+
+    while (cap < dir->size * 2)
+        cap *= 2;
+
+    struct JDirIndex *idx = calloc(1, sizeof(struct JDirIndex));
+    if (NULL == idx)
+        return NULL;
+    idx->first_block = dir->first_data_block_idx;
+    if (0 != dir_index_resize(idx, cap))
+    {
+        free(idx);
+        return NULL;
+    }
+
+    int32_t block = dir->first_data_block_idx;
+    for (uint32_t ii = 0; ii < dir->size; ii++)
+    {
+        if (0 != ii && 0 == ii % fit)
+            block = jfs_fat_next(fat, block);
+
+        struct JFile *entry = jfs_dir_entry(sb, block, ii % fit);
+        dir_slot_put(idx, name_hash(entry->name), block, ii % fit);
+    }
+
+    uint32_t h = seek_hash(idx->first_block, st->dir_buckets);
+    idx->next = st->dir_tab[h];
+    st->dir_tab[h] = idx;
+    st->dir_used++;
+
+    return idx;
+}
+
+///Find entry by name into *ret (NULL - no such name), build the index on first
+///access. -1 - there is no index to ask (no state, out of memory), scan instead
+int32_t jfs_dir_index_find(struct JFile *dir, struct JSuper *sb, const char *name, struct JFile **ret)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    *ret = NULL;
+    if (NULL == st)
+        return -1;
+    if (0 == dir->size)
+        return 0;
+
+    ///Namespace readers share the index, the first one to miss builds it
+    pthread_rwlock_rdlock(&(st->dir_lock));
+    struct JDirIndex *idx = dir_index_lookup(st, dir->first_data_block_idx);
+    if (NULL == idx)
+    {
+        pthread_rwlock_unlock(&(st->dir_lock));
+        pthread_rwlock_wrlock(&(st->dir_lock));
+        idx = dir_index_lookup(st, dir->first_data_block_idx);
+        if (NULL == idx)
+            idx = dir_index_build(st, dir);
+    }
+    if (NULL == idx)
+    {
+        pthread_rwlock_unlock(&(st->dir_lock));
+        return -1;
+    }
+
+    uint32_t hash = name_hash(name);
+    for (uint32_t ii = hash & (idx->cap - 1); -1 != idx->slots[ii].block; ii = (ii + 1) & (idx->cap - 1))
+    {
+        JFS_STAT(dir_entries_scanned, 1);
+        if (idx->slots[ii].hash == hash && 0 == strcmp(dir_slot_file(&(idx->slots[ii]), sb)->name, name))
+        {
+            *ret = dir_slot_file(&(idx->slots[ii]), sb);
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&(st->dir_lock));
+    return 0;
+}
+
+void jfs_dir_index_insert(struct JFile *dir, struct JSuper *sb, struct JFile *entry)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JDirIndex *idx;
+
+    if (NULL == st || NULL == (idx = dir_index_lookup(st, dir->first_data_block_idx)))
+        return;
+
+    if (2 * (idx->used + 1) > idx->cap && 0 != dir_index_resize(idx, 2 * idx->cap))
+    {
+        jfs_dir_index_drop(sb, dir->first_data_block_idx); //Rebuilt on next lookup
+        return;
+    }
+
+    dir_slot_put(idx, name_hash(entry->name), entry->coord.my_jfile_block, entry->coord.my_jfile_offset);
+}
+
+static struct JDirSlot *dir_slot_find(struct JDirIndex *idx, const char *name, int32_t block, uint32_t offset)
+{
+    uint32_t hash = name_hash(name);
+
+    for (uint32_t ii = hash & (idx->cap - 1); -1 != idx->slots[ii].block; ii = (ii + 1) & (idx->cap - 1))
+    {
+        if (idx->slots[ii].block == block && idx->slots[ii].offset == offset)
+            return &(idx->slots[ii]);
+    }
+
+    return NULL;
+}
+
+void jfs_dir_index_remove(struct JFile *dir, struct JSuper *sb, struct JFile *entry)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JDirIndex *idx;
+    struct JDirSlot *slot;
+
+    if (NULL == st || NULL == (idx = dir_index_lookup(st, dir->first_data_block_idx)))
+        return;
+
+    slot = dir_slot_find(idx, entry->name, entry->coord.my_jfile_block, entry->coord.my_jfile_offset);
+    if (NULL == slot)
+        return;
+
+    ///Backward shift deletion, keeps probe chains without tombstones
+    uint32_t hole = slot - idx->slots;
+    for (uint32_t ii = (hole + 1) & (idx->cap - 1); -1 != idx->slots[ii].block; ii = (ii + 1) & (idx->cap - 1))
+    {
+        uint32_t home = idx->slots[ii].hash & (idx->cap - 1);
+        if (((ii - home) & (idx->cap - 1)) >= ((ii - hole) & (idx->cap - 1)))
+        {
+            idx->slots[hole] = idx->slots[ii];
+            hole = ii;
+        }
+    }
+    idx->slots[hole].block = -1;
+    idx->used--;
+}
+
+///Entry was copied from (old_block, old_offset) to its current place
+void jfs_dir_index_relocate(struct JFile *dir, struct JSuper *sb, int32_t old_block, uint32_t old_offset, struct JFile *entry)
+{
+    struct JState *st = jfs_get_state(sb);
+    struct JDirIndex *idx;
+    struct JDirSlot *slot;
+
+    if (NULL == st || NULL == (idx = dir_index_lookup(st, dir->first_data_block_idx)))
+        return;
+
+    slot = dir_slot_find(idx, entry->name, old_block, old_offset);
+    if (NULL != slot)
+    {
+        slot->block = entry->coord.my_jfile_block;
+        slot->offset = entry->coord.my_jfile_offset;
+    }
+}
+
+void jfs_dir_index_drop(struct JSuper *sb, int32_t first_block)
+{
+    struct JState *st = jfs_get_state(sb);
+
+    if (NULL == st || 0 == st->dir_buckets || first_block < 0)
+        return;
+
+    for (struct JDirIndex **link = &(st->dir_tab[seek_hash(first_block, st->dir_buckets)]); NULL != *link; link = &((*link)->next))
+    {
+        struct JDirIndex *idx = *link;
+        if (idx->first_block == first_block)
+        {
+            *link = idx->next;
+            free(idx->slots);
+            free(idx);
+            st->dir_used--;
+            return;
+        }
+    }
+}
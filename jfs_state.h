@@ -0,0 +1,316 @@
+#ifndef __JFS_STATE_H__
+#define __JFS_STATE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "jfs.h"
+
+//In-memory side tables of an image. Nothing here is written to the image:
+//everything is built lazily after jfs_attach() and dropped by jfs_detach().
+
+#define JFS_MAX_STATES          16
+#define JFS_SEEK_STRIDE         64  //Default distance (in blocks) between seek index samples
+#define JFS_LOCK_SLOTS          16  //Reader slots of the namespace lock, threads are spread over them
+#define JFS_LOCK_STRIPES        256 //File locks, picked by the JFile address
+#define JFS_SEEK_SHARDS         16  //Seek index tables, each with its own lock
+#define JFS_MAG_EXTENTS         8   //Free extents one thread cache holds
+#define JFS_MAG_BATCH           64  //Blocks per refill, bigger requests go to the free list
+#define JFS_MAG_MAX             256 //Cached blocks above this go back to the free list
+#define JFS_JOURNAL_PAGE        4096 //Unit of dirty tracking and of journal records
+#define JFS_CACHE_SHARDS        16  //Block cache parts, picked by block number, each with its own lock
+#define JFS_CACHE_IO            (1u << 20) //Largest single device read
+#define JFS_CACHE_REF           0x1 //Block cache slot used since the hand passed
+#define JFS_CACHE_AHEAD         0x2 //Read ahead and not used yet
+#define JFS_CACHE_TRIGGER       0x4 //First of a read ahead batch: using it reads the next one
+#define JFS_ZCACHE_SLOTS        32  //Decompressed clusters kept per image
+
+//Counters of this thread, in builds with -DJFS_STATS. The owner writes with
+//relaxed stores, jfs_stats_get reads them from any thread.
+#ifdef JFS_STATS
+struct JThreadStats
+{
+    struct JStats s;
+    uint32_t op;    //Outermost call in progress, JFS_OP_OTHER between calls
+    struct JThreadStats *prev;
+    struct JThreadStats *next;
+};
+
+extern __thread struct JThreadStats *jfs_tstats;
+struct JThreadStats *jfs_stats_register(void);
+
+static inline struct JThreadStats *jfs_my_stats(void)
+{
+    struct JThreadStats *ts = jfs_tstats;
+    return __builtin_expect(NULL != ts, 1) ? ts : jfs_stats_register();
+}
+
+static inline void jfs_stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+//Charges the thread's work to op until JFS_STAT_OP_END, unless a call is already in progress
+static inline uint32_t jfs_stat_op_begin(uint32_t op)
+{
+    struct JThreadStats *ts = jfs_my_stats();
+    if (NULL == ts || JFS_OP_OTHER != ts->op)
+        return 0;
+    ts->op = op;
+    jfs_stat_add(&(ts->s.ops[op]), 1);
+    return 1;
+}
+
+static inline void jfs_stat_op_end(uint32_t began)
+{
+    if (began)
+        jfs_tstats->op = JFS_OP_OTHER;
+}
+
+#define JFS_STAT(field, n)                                              \
+    do                                                                  \
+    {                                                                   \
+        struct JThreadStats *jfs_ts_ = jfs_my_stats();                  \
+        if (NULL != jfs_ts_)                                            \
+            jfs_stat_add(&(jfs_ts_->s.field), (n));                     \
+    } while (0)
+#define JFS_HOPS(n) JFS_STAT(fat_hops[jfs_ts_->op], (n))
+#define JFS_STAT_OP(op) uint32_t jfs_stat_began_ = jfs_stat_op_begin(op)
+#define JFS_STAT_OP_END() jfs_stat_op_end(jfs_stat_began_)
+#else
+#define JFS_STAT(field, n) ((void)0)
+#define JFS_HOPS(n) ((void)0)
+#define JFS_STAT_OP(op) ((void)0)
+#define JFS_STAT_OP_END() ((void)0)
+#endif
+
+//Next block of a chain (or of the free extent list)
+static inline int32_t jfs_fat_next(int32_t *fat, int32_t block)
+{
+    JFS_HOPS(1);
+    return fat[block];
+}
+
+//blocks[i] is the block at position i*stride of the chain starting at first_block
+struct JSeekIndex
+{
+    int32_t first_block;
+    uint32_t count;
+    uint32_t cap;
+    int32_t *blocks;
+    struct JSeekIndex *next;
+};
+
+//Name index of one directory, open addressing with linear probing
+struct JDirSlot
+{
+    uint32_t hash;
+    int32_t block; //-1 - empty slot
+    uint32_t offset;
+};
+
+struct JDirIndex
+{
+    int32_t first_block;
+    uint32_t cap;  //Power of two
+    uint32_t used;
+    struct JDirSlot *slots;
+    struct JDirIndex *next;
+};
+
+//Lock alone on its cache line, so slots and stripes don't share lines
+struct JLock
+{
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+struct JSeekShard
+{
+    pthread_rwlock_t lock; //Hits read, index growth writes
+    uint32_t buckets;
+    uint32_t used;
+    struct JSeekIndex **tab;
+} __attribute__((aligned(64)));
+
+//Free blocks cached for the threads of one lock slot. They are off the free
+//list and the free map but still count as free (jfs_free_blocks)
+struct JMagazine
+{
+    pthread_mutex_t lock; //Practically only its own thread takes it
+    uint32_t blocks;
+    uint32_t cnt;
+    int32_t start[JFS_MAG_EXTENTS];
+    uint32_t len[JFS_MAG_EXTENTS];
+} __attribute__((aligned(64)));
+
+//Group commit state of a journaled mount. Mutators mark the pages they
+//change; one thread at a time writes everything marked as one transaction
+//while the others wait for it
+struct JJournal
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint64_t offset;      //Journal region in the image file
+    uint64_t bytes;
+    uint64_t head;        //Next record goes here, from offset
+    uint64_t seq;         //Seq of the next record
+    uint64_t open_txn;    //Transaction that finished changes join
+    uint64_t done_txn;    //Last durable transaction
+    uint64_t failed_txn;  //Last transaction that failed to commit
+    uint8_t aborted;      //A transaction failed or didn't fit, nothing more goes to the file
+    uint8_t committing;
+    uint32_t pages;       //Pages of the image before the journal
+    uint64_t *meta;       //Dirty bitmaps, journaled before going home
+    uint64_t *data;       //Go home before the record that points at them
+    uint32_t *list;
+    uint8_t *buf;
+    uint64_t buf_cap;
+    uint32_t *held;       //Extents freed in the open transaction, start and length pairs. alloc_lock
+    uint32_t held_cnt;
+    uint32_t held_cap;
+    uint64_t commits;
+    uint64_t syncs;       //fdatasync calls
+};
+
+//Part of the block cache of a pread mount. CLOCK replacement: a hit sets
+//ref, the hand clears it and evicts slots that stayed unreferenced
+struct JCacheShard
+{
+    pthread_mutex_t lock;
+    uint32_t slots;
+    uint32_t hand;
+    uint32_t buckets;     //Power of two
+    int32_t *bucket;      //First slot of the hash chain, -1 - none
+    int32_t *next;        //Per slot: next slot in the chain
+    int32_t *block;       //Per slot: cached block, -1 - slot is free
+    uint8_t *ref;         //Per slot: JFS_CACHE_* flags
+    uint8_t *data;
+    uint64_t hits;
+    uint64_t readahead_hits;
+} __attribute__((aligned(64)));
+
+struct JCache
+{
+    uint32_t block_size;
+    uint32_t window;      //Blocks to read ahead along the chain
+    uint64_t misses;      //Atomic, as the counters below
+    uint64_t readahead;   //Blocks read ahead
+    uint64_t reads;       //Device requests
+    uint64_t read_bytes;
+    struct JCacheShard shards[JFS_CACHE_SHARDS];
+};
+
+//Decompressed cluster of a JFS_FILE_COMP file. The key is the first block
+//of the chain and the generation it was filled in: any mutator makes all
+//slots stale, so chains that move or are freed never hit
+struct JZSlot
+{
+    int32_t block;
+    uint32_t cluster;     //Index in the file
+    uint32_t generation;
+    uint32_t len;
+    uint8_t ref;          //JFS_CACHE_REF
+    uint8_t *data;        //NULL - slot is free
+};
+
+//CLOCK over a few slots, as the block cache does over its shards
+struct JZCache
+{
+    pthread_mutex_t lock;
+    uint32_t hand;
+    struct JZSlot slots[JFS_ZCACHE_SLOTS];
+};
+
+//Free runs summary of a node of the free map tree
+struct JRunNode
+{
+    uint32_t pre; //Free blocks at the start of the node's range
+    uint32_t suf; //Free blocks at the end
+    uint32_t max; //Longest free run inside
+};
+
+struct JState
+{
+    struct JSuper *sb;
+    uint32_t idx;             //Place in the registry
+    uint32_t mount_flags;
+    int fd;                   //-1 if image is not a mounted file
+    void *map;
+    uint64_t map_len;
+    uint32_t map_words;
+    uint32_t map_leaves;      //Power of two >= map_words
+    uint64_t *free_map;       //Bit is set for a free block
+    struct JRunNode *run_tree; //Heap layout, 2 * map_leaves nodes, leaves are free_map words
+    uint8_t free_split;       //Free list may hold touching extents, relinked on the next long miss
+    uint32_t seek_stride; //0 - plain mode, walk chains from the first block
+    struct JSeekShard seek[JFS_SEEK_SHARDS];
+    pthread_rwlock_t dir_lock; //Lookups read, lazy index builds write
+    uint32_t dir_buckets;
+    uint32_t dir_used;
+    struct JDirIndex **dir_tab;
+    uint32_t generation;      //Bumped by every mutator, stale cursors restart. Atomic
+    pthread_mutex_t alloc_lock; //Free list, free map, free_blocks
+    uint8_t mag_off;            //1 - every allocation goes to the free list
+    pthread_mutex_t tail_lock;  //Tail block heads and sb->tail_block, taken before alloc_lock
+    struct JMagazine mags[JFS_LOCK_SLOTS]; //Indexed by jfs_thread_slot()
+    struct JJournal *journal; //NULL - changes are not journaled
+    struct JCache *cache;     //File data of pread mounts, NULL - data is mapped
+    struct JZCache zcache;    //Clusters of compressed files
+    struct JLock ns[JFS_LOCK_SLOTS];       //Namespace: readers take their slot, writers take all
+    struct JLock files[JFS_LOCK_STRIPES];  //File data and size
+};
+
+struct JState *jfs_attach(struct JSuper *sb);
+void jfs_detach(struct JSuper *sb);
+struct JState *jfs_get_state(struct JSuper *sb);
+
+void jfs_free_map_update(struct JSuper *sb, int32_t start, uint32_t count, int free);
+int32_t jfs_free_map_test(struct JSuper *sb, int32_t block);
+int32_t jfs_free_list_relink(struct JSuper *sb);
+uint32_t jfs_largest_free_run(struct JSuper *sb);
+int32_t jfs_find_free_run(struct JSuper *sb, uint32_t count);
+
+void jfs_generation_bump(struct JSuper *sb);
+uint32_t jfs_generation(struct JSuper *sb);
+
+uint32_t jfs_thread_slot(void);
+int8_t jfs_ns_in_read(struct JSuper *sb);
+int8_t jfs_ns_held(struct JSuper *sb);
+void jfs_file_lock(struct JFile *file, struct JSuper *sb, int write);
+void jfs_file_unlock(struct JFile *file, struct JSuper *sb);
+void jfs_alloc_lock(struct JSuper *sb);
+void jfs_alloc_unlock(struct JSuper *sb);
+void jfs_tail_lock(struct JSuper *sb);
+void jfs_tail_unlock(struct JSuper *sb);
+
+void jfs_alloc_drain(struct JSuper *sb);
+void jfs_free_release(struct JSuper *sb);
+int32_t jfs_set_alloc_cache(struct JSuper *sb, uint8_t on);
+
+int32_t jfs_cache_create(struct JSuper *sb, uint32_t mib, uint32_t window);
+void jfs_cache_destroy(struct JSuper *sb);
+int32_t jfs_cache_read(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size, uint32_t *ret_size);
+
+uint32_t jfs_lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+int32_t jfs_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len);
+int32_t jfs_comp_read(struct JFile *file, struct JSuper *sb, uint32_t offset, uint8_t *dst, uint32_t size);
+void jfs_zcache_free(struct JState *st);
+
+int32_t jfs_journal_replay(struct JSuper *sb, int fd, int rdwr);
+int32_t jfs_journal_open(struct JSuper *sb);
+int32_t jfs_journal_close(struct JSuper *sb);
+int32_t jfs_journal_commit(struct JSuper *sb);
+void jfs_dirty_meta(struct JSuper *sb, const void *ptr, uint64_t len);
+void jfs_dirty_data(struct JSuper *sb, const void *ptr, uint64_t len);
+void jfs_dirty_fat(struct JSuper *sb, int32_t block, uint32_t count);
+
+int32_t jfs_set_seek_index(struct JSuper *sb, uint32_t stride);
+int32_t jfs_seek_block(struct JFile *file, struct JSuper *sb, uint32_t n);
+void jfs_seek_index_truncate(struct JSuper *sb, int32_t first_block, uint32_t blocks_left);
+
+int32_t jfs_dir_index_find(struct JFile *dir, struct JSuper *sb, const char *name, struct JFile **ret);
+void jfs_dir_index_insert(struct JFile *dir, struct JSuper *sb, struct JFile *entry);
+void jfs_dir_index_remove(struct JFile *dir, struct JSuper *sb, struct JFile *entry);
+void jfs_dir_index_relocate(struct JFile *dir, struct JSuper *sb, int32_t old_block, uint32_t old_offset, struct JFile *entry);
+void jfs_dir_index_drop(struct JSuper *sb, int32_t first_block);
+
+#endif //__JFS_STATE_H__
@@ -1,20 +1,64 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include "jfs.h"
 #include "gen_jfs_image.h"
+#include "extract_jfs_image.h"
 #include <stdint.h>
 
 //TODO: Don't forget about endian!
 
 int main(int argc, char **argv)
 {
+    if (argc > 1 && 0 == strcmp(argv[1], "defrag"))
+    {
+        if (argc < 3)
+        {
+            printf("Usage: %s defrag <image> [--truncate]\n", argv[0]);
+            return 1;
+        }
+        return 0 == jfs_defrag_image(argv[2], argc > 3 && 0 == strcmp(argv[3], "--truncate")) ? 0 : 1;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "journal"))
+    {
+        if (argc < 3)
+        {
+            printf("Usage: %s journal <image> [KiB]\n", argv[0]);
+            return 1;
+        }
+        return 0 == jfs_journal_add(argv[2], argc > 3 ? (uint64_t)atoi(argv[3]) << 10 : JFS_JOURNAL_BYTES) ? 0 : 1;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "extract"))
+    {
+        if (argc < 4)
+        {
+            printf("Usage: %s extract <image> <dst> [path in image] [threads]\n", argv[0]);
+            return 1;
+        }
+        return 0 == extract_jfs_image(argv[2], argc > 4 ? argv[4] : "", argv[3],
+                                      argc > 5 ? atoi(argv[5]) : JFS_EXTRACT_THREADS) ? 0 : 1;
+    }
+
     //struct JFile tmp;
     //int ret = write_file_name("/ReturN/", NULL, &tmp);
     //printf("%d\n", ret);
     /*int ret = */create_jfs_image("fs_files/jfs_instance", "jfs", "data", BLOCK_SIZE, BLOCKS_CNT);
 
+    ///Read the image back from disk
+    struct JSuper *sb = jfs_mount("fs_files/jfs_instance", JFS_MOUNT_RDONLY);
+    if (NULL != sb)
+    {
+        printf("\n------------------------------------------\n\n");
+        explore_image(jfs_get_root_dir(sb), sb);
+        jfs_umount(sb);
+    }
+
     //~ printf("%d\n", files_of_dir("data"));
 
-    //~ struct Dir_explore get = explore_dir("data", 100);
+    //~ struct Dir_explore get = {0, 0, 0, 0};
+    //~ explore_dir("data", 100, &get);
     //~ printf("\nFiles: %d, Dirs: %d, FBlocks: %d, DBlocks: %d\n", get.files, get.dirs, get.file_blocks, get.dir_blocks);
 
     return 0;